@@ -0,0 +1,315 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_alloc.c>
+ * Sub-allocation of the input and output windows between open files.
+ *
+ * Each window is a gen_pool with page granularity and the order-aligned
+ * first fit algorithm, which gives buddy style alignment without rounding
+ * sizes up. gen_pool reserves address 0 for failure, so window offsets
+ * are biased by the window size rounded up to a power of 2, which keeps
+ * the alignment of the biased addresses and of the offsets identical.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/genalloc.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+
+#include "seki_device_defs.h"
+#include "seki_uapi.h"
+#include "seki_alloc.h"
+#include "seki_ring.h"
+
+static struct gen_pool *seki_alloc_pool(SekiData *device_data,
+                                        unsigned int window,
+                                        unsigned long *length)
+{
+    switch (window) {
+    case SEKI_WINDOW_INPUT:
+        *length = device_data->input_mmio_length;
+        return device_data->input_pool;
+    case SEKI_WINDOW_OUTPUT:
+        *length = device_data->output_mmio_length;
+        return device_data->output_pool;
+    default:
+        return 0;
+    }
+}
+
+static inline unsigned long seki_alloc_bias(unsigned long window_length)
+{
+    return roundup_pow_of_two(window_length);
+}
+
+// Init & uninit
+static struct gen_pool *seki_alloc_create_pool(SekiData *device_data,
+                                               unsigned long length)
+{
+    int nid = device_data->node;
+    struct gen_pool *pool;
+
+    if (!length)
+        return 0;
+
+    pool = gen_pool_create(PAGE_SHIFT, nid);
+    if (!pool)
+        return 0;
+
+    gen_pool_set_algo(pool, gen_pool_first_fit_order_align, NULL);
+
+    if (gen_pool_add(pool, seki_alloc_bias(length), length & PAGE_MASK,
+                     nid)) {
+        gen_pool_destroy(pool);
+        return 0;
+    }
+
+    return pool;
+}
+
+int seki_alloc_init_device(SekiData *device_data)
+{
+    device_data->input_pool =
+            seki_alloc_create_pool(device_data,
+                                   device_data->input_mmio_length);
+    device_data->output_pool =
+            seki_alloc_create_pool(device_data,
+                                   device_data->output_mmio_length);
+
+    if (!device_data->input_pool || !device_data->output_pool) {
+        seki_alloc_uninit_device(device_data);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+void seki_alloc_uninit_device(SekiData *device_data)
+{
+    // Open files give their chunks back on release, before we get here
+    if (device_data->input_pool)
+        gen_pool_destroy(device_data->input_pool);
+    if (device_data->output_pool)
+        gen_pool_destroy(device_data->output_pool);
+
+    device_data->input_pool = 0;
+    device_data->output_pool = 0;
+}
+
+// Ranges the driver keeps for itself, e.g. the staging slots
+int seki_alloc_reserve(SekiData *device_data, unsigned int window,
+                       unsigned long offset, unsigned long size)
+{
+    struct genpool_data_fixed fixed = { .offset = offset };
+    unsigned long length;
+    struct gen_pool *pool = seki_alloc_pool(device_data, window, &length);
+
+    if (!pool || !size || !PAGE_ALIGNED(offset) || !PAGE_ALIGNED(size) ||
+        size > length || offset > length - size)
+        return -EINVAL;
+
+    if (gen_pool_alloc_algo(pool, size, gen_pool_fixed_alloc, &fixed) !=
+        seki_alloc_bias(length) + offset)
+        return -ENOSPC;
+
+    return 0;
+}
+
+void seki_alloc_unreserve(SekiData *device_data, unsigned int window,
+                          unsigned long offset, unsigned long size)
+{
+    unsigned long length;
+    struct gen_pool *pool = seki_alloc_pool(device_data, window, &length);
+
+    gen_pool_free(pool, seki_alloc_bias(length) + offset, size);
+}
+
+// Per file
+void seki_alloc_init_file(SekiFile *file)
+{
+    mutex_init(&file->chunks_lock);
+    INIT_LIST_HEAD(&file->chunks);
+}
+
+static void seki_alloc_release_chunk(SekiData *device_data, SekiChunk *chunk)
+{
+    unsigned long length;
+    struct gen_pool *pool = seki_alloc_pool(device_data, chunk->window,
+                                            &length);
+
+    gen_pool_free(pool, seki_alloc_bias(length) + chunk->offset, chunk->size);
+    list_del(&chunk->node);
+    kfree(chunk);
+}
+
+// Chunks nobody can reach any more, may be called from the IRQ path
+void seki_alloc_release_chunks(SekiData *device_data, struct list_head *chunks)
+{
+    SekiChunk *chunk;
+    SekiChunk *tmp;
+
+    list_for_each_entry_safe(chunk, tmp, chunks, node)
+        seki_alloc_release_chunk(device_data, chunk);
+}
+
+// Before the ring reference of the file goes. Jobs in flight hold the
+// ring and may still be writing to the chunks, so they go with the ring.
+void seki_alloc_release_file(SekiFile *file)
+{
+    SekiRing *ring = READ_ONCE(file->ring);
+
+    mutex_lock(&file->chunks_lock);
+    if (ring)
+        list_splice_init(&file->chunks, &ring->chunks);
+    else
+        seki_alloc_release_chunks(file->device_data, &file->chunks);
+    mutex_unlock(&file->chunks_lock);
+}
+
+int seki_alloc_chunk(SekiFile *file, struct seki_alloc_request *request)
+{
+    SekiData *device_data = file->device_data;
+    struct genpool_data_fixed fixed;
+    struct gen_pool *pool;
+    unsigned long length;
+    unsigned long size;
+    unsigned long addr;
+    SekiChunk *chunk;
+
+    pool = seki_alloc_pool(device_data, request->window, &length);
+    if (!pool || (request->flags & ~SEKI_ALLOC_FIXED))
+        return -EINVAL;
+
+    if (!request->size || request->size > length)
+        return -EINVAL;
+    size = PAGE_ALIGN(request->size);
+
+    chunk = kzalloc_node(sizeof(*chunk), GFP_KERNEL, device_data->node);
+    if (!chunk)
+        return -ENOMEM;
+
+    if (request->flags & SEKI_ALLOC_FIXED) {
+        if (!PAGE_ALIGNED(request->offset) || request->offset >= length) {
+            kfree(chunk);
+            return -EINVAL;
+        }
+
+        fixed.offset = request->offset;
+        addr = gen_pool_alloc_algo(pool, size, gen_pool_fixed_alloc, &fixed);
+    } else {
+        addr = gen_pool_alloc(pool, size);
+    }
+
+    if (!addr) {
+        kfree(chunk);
+        return -ENOSPC;
+    }
+
+    chunk->window = request->window;
+    chunk->offset = addr - seki_alloc_bias(length);
+    chunk->size   = size;
+
+    mutex_lock(&file->chunks_lock);
+    list_add_tail(&chunk->node, &file->chunks);
+    mutex_unlock(&file->chunks_lock);
+
+    request->offset = chunk->offset;
+    request->size   = size;
+
+    return 0;
+}
+
+int seki_alloc_free_chunk(SekiFile *file,
+                          const struct seki_alloc_request *request)
+{
+    SekiRing *ring = READ_ONCE(file->ring);
+    SekiChunk *chunk;
+    int rv = -EINVAL;
+
+    mutex_lock(&file->chunks_lock);
+    list_for_each_entry(chunk, &file->chunks, node) {
+        if (chunk->window != request->window ||
+            chunk->offset != request->offset)
+            continue;
+
+        // Someone else could get it while we still map it, or while
+        // jobs may still use it
+        if (chunk->map_count || (ring && atomic_read(&ring->inflight))) {
+            rv = -EBUSY;
+            break;
+        }
+
+        seki_alloc_release_chunk(file->device_data, chunk);
+        rv = 0;
+        break;
+    }
+    mutex_unlock(&file->chunks_lock);
+
+    return rv;
+}
+
+static SekiChunk *seki_alloc_find_locked(SekiFile *file, unsigned int window,
+                                         unsigned long offset,
+                                         unsigned long length)
+{
+    SekiChunk *chunk;
+
+    list_for_each_entry(chunk, &file->chunks, node) {
+        if (chunk->window == window && offset >= chunk->offset &&
+            length <= chunk->size &&
+            offset - chunk->offset <= chunk->size - length)
+            return chunk;
+    }
+
+    return 0;
+}
+
+int seki_alloc_owns(SekiFile *file, unsigned int window,
+                    unsigned long offset, unsigned long length)
+{
+    int owns;
+
+    if (!length)
+        return 1;
+
+    mutex_lock(&file->chunks_lock);
+    owns = seki_alloc_find_locked(file, window, offset, length) != 0;
+    mutex_unlock(&file->chunks_lock);
+
+    return owns;
+}
+
+SekiChunk *seki_alloc_get_mapping(SekiFile *file, unsigned int window,
+                                  unsigned long offset, unsigned long length)
+{
+    SekiChunk *chunk;
+
+    mutex_lock(&file->chunks_lock);
+    chunk = seki_alloc_find_locked(file, window, offset, length);
+    if (chunk)
+        ++chunk->map_count;
+    mutex_unlock(&file->chunks_lock);
+
+    return chunk;
+}
+
+void seki_alloc_hold_mapping(SekiFile *file, SekiChunk *chunk)
+{
+    mutex_lock(&file->chunks_lock);
+    ++chunk->map_count;
+    mutex_unlock(&file->chunks_lock);
+}
+
+void seki_alloc_put_mapping(SekiFile *file, SekiChunk *chunk)
+{
+    mutex_lock(&file->chunks_lock);
+    --chunk->map_count;
+    mutex_unlock(&file->chunks_lock);
+}
@@ -0,0 +1,57 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_alloc.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_ALLOC_H
+#define SEKI_ALLOC_H
+
+#include <linux/list.h>
+#include <linux/types.h>
+
+struct SekiData;
+struct SekiFile;
+struct seki_alloc_request;
+
+// A piece of the input or output window owned by one open file
+typedef struct SekiChunk {
+    struct list_head    node;       // In SekiFile.chunks
+    unsigned int        window;     // SEKI_WINDOW_*
+    unsigned long       offset;
+    unsigned long       size;
+    unsigned int        map_count;  // Live VMAs, under chunks_lock
+} SekiChunk;
+
+int seki_alloc_init_device(struct SekiData *device_data);
+void seki_alloc_uninit_device(struct SekiData *device_data);
+
+void seki_alloc_init_file(struct SekiFile *file);
+void seki_alloc_release_file(struct SekiFile *file);
+void seki_alloc_release_chunks(struct SekiData *device_data,
+                               struct list_head *chunks);
+
+int seki_alloc_chunk(struct SekiFile *file,
+                     struct seki_alloc_request *request);
+int seki_alloc_free_chunk(struct SekiFile *file,
+                          const struct seki_alloc_request *request);
+int seki_alloc_owns(struct SekiFile *file, unsigned int window,
+                    unsigned long offset, unsigned long length);
+
+int seki_alloc_reserve(struct SekiData *device_data, unsigned int window,
+                       unsigned long offset, unsigned long size);
+void seki_alloc_unreserve(struct SekiData *device_data, unsigned int window,
+                          unsigned long offset, unsigned long size);
+
+SekiChunk *seki_alloc_get_mapping(struct SekiFile *file, unsigned int window,
+                                  unsigned long offset, unsigned long length);
+void seki_alloc_hold_mapping(struct SekiFile *file, SekiChunk *chunk);
+void seki_alloc_put_mapping(struct SekiFile *file, SekiChunk *chunk);
+
+
+#endif // SEKI_ALLOC_H
@@ -0,0 +1,470 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_buffer.c>
+ * Registered buffers, user memory pinned and mapped for DMA once.
+ *
+ * Pinning and IOMMU mapping a buffer on every transfer costs more than
+ * the transfer for the buffers workers reuse forever. A file can
+ * register such buffers up front, like RDMA memory regions: the pages
+ * are pinned, the SG table mapped and the bus address of each page
+ * kept, in an interval tree by user address. DMA on a range inside a
+ * registered buffer takes the pages from there.
+ *
+ * The pages stay pinned however the process remaps its memory, so an
+ * mmu_notifier on the mm drops every buffer whose range is unmapped or
+ * gets other pages behind it. Dropping only takes the buffer off the
+ * tree, transfers already using it finish into the old pages, which are
+ * unpinned after the last one.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/capability.h>
+#include <linux/dma-mapping.h>
+#include <linux/err.h>
+#include <linux/interval_tree_generic.h>
+#include <linux/mm.h>
+#include <linux/sched/mm.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "seki_device_defs.h"
+#include "seki_uapi.h"
+#include "seki_buffer.h"
+#include "seki_dma.h"
+
+#define SEKI_BUFFER_MAX_PAGES   (1UL << 22)     // 16GB with 4K pages
+
+#define SEKI_BUFFER_START(buffer)   ((buffer)->start)
+#define SEKI_BUFFER_LAST(buffer)    ((buffer)->last)
+
+INTERVAL_TREE_DEFINE(SekiBuffer, rb, unsigned long, subtree_last,
+                     SEKI_BUFFER_START, SEKI_BUFFER_LAST, static inline,
+                     seki_buffer_it)
+
+// Pinned pages count against RLIMIT_MEMLOCK, like RDMA memory regions
+static int seki_buffer_account(struct mm_struct *mm, unsigned long nr_pages)
+{
+    unsigned long limit = rlimit(RLIMIT_MEMLOCK) >> PAGE_SHIFT;
+
+    if (atomic64_add_return(nr_pages, &mm->pinned_vm) > limit &&
+        !capable(CAP_IPC_LOCK)) {
+        atomic64_sub(nr_pages, &mm->pinned_vm);
+        return -ENOMEM;
+    }
+
+    return 0;
+}
+
+// Refcounting. The last put may sleep.
+static void seki_buffer_free(struct kref *ref)
+{
+    SekiBuffer *buffer = container_of(ref, SekiBuffer, ref);
+
+    // The DMA engine did not stop, it may still be using the pages
+    if (READ_ONCE(buffer->device_data->dma_failed)) {
+        buffer->sg_count = 0;
+        buffer->nr_pinned = 0;
+    }
+
+    if (buffer->sg_count)
+        dma_unmap_sg(buffer->device_data->device, buffer->sgt.sgl,
+                     buffer->sgt.orig_nents, DMA_BIDIRECTIONAL);
+    if (buffer->sgt.sgl)
+        sg_free_table(&buffer->sgt);
+
+    // The device may have written anywhere in it
+    for (unsigned long i = 0; i < buffer->nr_pinned; ++i) {
+        set_page_dirty_lock(buffer->pages[i]);
+        put_page(buffer->pages[i]);
+    }
+
+    if (buffer->mm) {
+        atomic64_sub(buffer->nr_pages, &buffer->mm->pinned_vm);
+        mmdrop(buffer->mm);
+    }
+
+    kvfree(buffer->pages);
+    kvfree(buffer->page_bus);
+    kfree(buffer);
+}
+
+void seki_buffer_put(SekiBuffer *buffer)
+{
+    kref_put(&buffer->ref, seki_buffer_free);
+}
+
+// Invalidation
+// Off the tree, the tree's reference goes to the dead list. Under lock.
+static void seki_buffer_kill_locked(SekiBufferCache *cache,
+                                    SekiBuffer *buffer)
+{
+    seki_buffer_it_remove(buffer, &cache->tree);
+    list_add_tail(&buffer->dead, &cache->dead);
+}
+
+static void seki_buffer_reap(struct work_struct *work)
+{
+    SekiBufferCache *cache = container_of(work, SekiBufferCache, reap_work);
+    SekiBuffer *buffer;
+    SekiBuffer *next;
+    LIST_HEAD(dead);
+
+    spin_lock(&cache->lock);
+    list_splice_init(&cache->dead, &dead);
+    spin_unlock(&cache->lock);
+
+    list_for_each_entry_safe(buffer, next, &dead, dead) {
+        list_del(&buffer->dead);
+        seki_buffer_put(buffer);
+    }
+}
+
+static void seki_buffer_kill_range(SekiBufferCache *cache,
+                                   unsigned long start, unsigned long last)
+{
+    SekiBuffer *buffer;
+    int killed = 0;
+
+    spin_lock(&cache->lock);
+    while ((buffer = seki_buffer_it_iter_first(&cache->tree, start, last))) {
+        seki_buffer_kill_locked(cache, buffer);
+        killed = 1;
+    }
+    spin_unlock(&cache->lock);
+
+    // Unpinning may sleep, the notifier may not
+    if (killed)
+        schedule_work(&cache->reap_work);
+}
+
+#ifdef CONFIG_MMU_NOTIFIER
+// Protection changes keep the same pages behind the range
+static inline int seki_buffer_event_moves_pages(enum mmu_notifier_event event)
+{
+    return event != MMU_NOTIFY_PROTECTION_VMA &&
+           event != MMU_NOTIFY_PROTECTION_PAGE &&
+           event != MMU_NOTIFY_SOFT_DIRTY;
+}
+
+static int
+seki_buffer_invalidate_range_start(struct mmu_notifier *notifier,
+                                   const struct mmu_notifier_range *range)
+{
+    SekiBufferCache *cache = container_of(notifier, SekiBufferCache,
+                                          notifier);
+
+    if (!seki_buffer_event_moves_pages(range->event))
+        return 0;
+
+    // Registrations racing with us start over
+    spin_lock(&cache->lock);
+    ++cache->invalidate_seq;
+    ++cache->invalidating;
+    spin_unlock(&cache->lock);
+
+    seki_buffer_kill_range(cache, range->start, range->end - 1);
+
+    return 0;
+}
+
+static void
+seki_buffer_invalidate_range_end(struct mmu_notifier *notifier,
+                                 const struct mmu_notifier_range *range)
+{
+    SekiBufferCache *cache = container_of(notifier, SekiBufferCache,
+                                          notifier);
+
+    if (!seki_buffer_event_moves_pages(range->event))
+        return;
+
+    spin_lock(&cache->lock);
+    --cache->invalidating;
+    spin_unlock(&cache->lock);
+}
+
+static void seki_buffer_release_mm(struct mmu_notifier *notifier,
+                                   struct mm_struct *mm)
+{
+    SekiBufferCache *cache = container_of(notifier, SekiBufferCache,
+                                          notifier);
+
+    SEKI_UNUSED(mm);
+
+    seki_buffer_kill_range(cache, 0, ULONG_MAX);
+}
+
+static const struct mmu_notifier_ops seki_buffer_notifier_ops = {
+    .invalidate_range_start = seki_buffer_invalidate_range_start,
+    .invalidate_range_end   = seki_buffer_invalidate_range_end,
+    .release                = seki_buffer_release_mm,
+};
+#endif
+
+// Per file
+static void seki_buffer_destroy_cache(SekiBufferCache *cache)
+{
+#ifdef CONFIG_MMU_NOTIFIER
+    mmu_notifier_unregister(&cache->notifier, cache->mm);
+#endif
+
+    // Nothing queues reaps any more
+    flush_work(&cache->reap_work);
+
+    seki_buffer_kill_range(cache, 0, ULONG_MAX);
+    flush_work(&cache->reap_work);
+
+    kfree(cache);
+}
+
+static SekiBufferCache *seki_buffer_create_cache(SekiFile *file)
+{
+    SekiBufferCache *cache;
+    int rv;
+
+    cache = kzalloc_node(sizeof(*cache), GFP_KERNEL,
+                         file->device_data->node);
+    if (!cache)
+        return ERR_PTR(-ENOMEM);
+
+    cache->mm = current->mm;
+    cache->file = file;
+    spin_lock_init(&cache->lock);
+    cache->tree = RB_ROOT_CACHED;
+    INIT_LIST_HEAD(&cache->dead);
+    INIT_WORK(&cache->reap_work, seki_buffer_reap);
+
+#ifdef CONFIG_MMU_NOTIFIER
+    cache->notifier.ops = &seki_buffer_notifier_ops;
+    rv = mmu_notifier_register(&cache->notifier, cache->mm);
+#else
+    rv = -EOPNOTSUPP;   // Without invalidation DMA could hit freed memory
+#endif
+    if (rv) {
+        kfree(cache);
+        return ERR_PTR(rv);
+    }
+
+    return cache;
+}
+
+// Of the calling process, which must be the one that registered first
+static SekiBufferCache *seki_buffer_get_cache(SekiFile *file)
+{
+    SekiBufferCache *cache = READ_ONCE(file->buffers);
+    SekiBufferCache *old;
+
+    if (!cache) {
+        cache = seki_buffer_create_cache(file);
+        if (IS_ERR(cache))
+            return cache;
+
+        old = cmpxchg(&file->buffers, NULL, cache);
+        if (old) {
+            seki_buffer_destroy_cache(cache);
+            cache = old;
+        }
+    }
+
+    // User addresses only mean something in the mm that registered
+    if (cache->mm != current->mm)
+        return ERR_PTR(-EINVAL);
+
+    return cache;
+}
+
+void seki_buffer_init_file(SekiFile *file)
+{
+    file->buffers = 0;
+}
+
+void seki_buffer_release_file(SekiFile *file)
+{
+    SekiBufferCache *cache = xchg(&file->buffers, NULL);
+
+    if (cache)
+        seki_buffer_destroy_cache(cache);
+}
+
+// Pinning & mapping
+static int seki_buffer_map(SekiBuffer *buffer, unsigned long first_page)
+{
+    struct device *dev = buffer->device_data->device;
+    struct scatterlist *sg;
+    unsigned long p = 0;
+    int pinned;
+    int rv;
+    int i;
+
+    pinned = get_user_pages_fast(first_page, buffer->nr_pages,
+                                 FOLL_WRITE | FOLL_LONGTERM, buffer->pages);
+    if (pinned < 0)
+        return pinned;
+    buffer->nr_pinned = pinned;
+    if (pinned != buffer->nr_pages)
+        return -EFAULT;
+
+    // page_bus stays unused, the software engine copies through kmap
+    if (!seki_dma_maps_pages(buffer->device_data))
+        return 0;
+
+    rv = sg_alloc_table_from_pages(&buffer->sgt, buffer->pages,
+                                   buffer->nr_pages, 0,
+                                   buffer->nr_pages << PAGE_SHIFT,
+                                   GFP_KERNEL);
+    if (rv)
+        return rv;
+
+    buffer->sg_count = dma_map_sg(dev, buffer->sgt.sgl,
+                                  buffer->sgt.orig_nents, DMA_BIDIRECTIONAL);
+    if (!buffer->sg_count)
+        return -EIO;
+
+    // Entries are whole pages, so each page is contiguous on the bus
+    for_each_sg(buffer->sgt.sgl, sg, buffer->sg_count, i) {
+        for (unsigned int off = 0;
+             off < sg_dma_len(sg) && p < buffer->nr_pages; off += PAGE_SIZE)
+            buffer->page_bus[p++] = sg_dma_address(sg) + off;
+    }
+
+    return p == buffer->nr_pages ? 0 : -EIO;
+}
+
+// Interface
+int seki_buffer_register(SekiFile *file,
+                         const struct seki_buffer_register *request)
+{
+    SekiData *device_data = file->device_data;
+    unsigned long start = request->user_addr;
+    unsigned long last = start + request->length - 1;
+    unsigned long first_page = start & PAGE_MASK;
+    unsigned long seq;
+    SekiBufferCache *cache;
+    SekiBuffer *buffer;
+    int rv;
+
+    if (request->flags || !request->length || last < start)
+        return -EINVAL;
+
+    if (!access_ok((void __user *)start, request->length))
+        return -EFAULT;
+
+    if ((PAGE_ALIGN(last + 1) - first_page) >> PAGE_SHIFT >
+        SEKI_BUFFER_MAX_PAGES)
+        return -EINVAL;
+
+    cache = seki_buffer_get_cache(file);
+    if (IS_ERR(cache))
+        return PTR_ERR(cache);
+
+    buffer = kzalloc_node(sizeof(*buffer), GFP_KERNEL, device_data->node);
+    if (!buffer)
+        return -ENOMEM;
+
+    kref_init(&buffer->ref);
+    INIT_LIST_HEAD(&buffer->dead);
+    buffer->start = start;
+    buffer->last = last;
+    buffer->device_data = device_data;
+    buffer->nr_pages = (PAGE_ALIGN(last + 1) - first_page) >> PAGE_SHIFT;
+
+    buffer->pages = kvmalloc_array(buffer->nr_pages, sizeof(*buffer->pages),
+                                   GFP_KERNEL);
+    buffer->page_bus = kvmalloc_array(buffer->nr_pages,
+                                      sizeof(*buffer->page_bus), GFP_KERNEL);
+    if (!buffer->pages || !buffer->page_bus) {
+        rv = -ENOMEM;
+        goto err_put;
+    }
+
+    rv = seki_buffer_account(current->mm, buffer->nr_pages);
+    if (rv)
+        goto err_put;
+    mmgrab(current->mm);
+    buffer->mm = current->mm;
+
+    spin_lock(&cache->lock);
+    seq = cache->invalidate_seq;
+    spin_unlock(&cache->lock);
+
+    rv = seki_buffer_map(buffer, first_page);
+    if (rv)
+        goto err_put;
+
+    // Pages pinned while the range was being invalidated may be stale
+    spin_lock(&cache->lock);
+    if (cache->invalidating || cache->invalidate_seq != seq)
+        rv = -EAGAIN;
+    else if (seki_buffer_it_iter_first(&cache->tree, start, last))
+        rv = -EEXIST;
+    else
+        seki_buffer_it_insert(buffer, &cache->tree);
+    spin_unlock(&cache->lock);
+
+    if (rv)
+        goto err_put;
+
+    return 0;
+
+err_put:
+    seki_buffer_put(buffer);
+    return rv;
+}
+
+int seki_buffer_unregister(SekiFile *file,
+                           const struct seki_buffer_register *request)
+{
+    SekiBufferCache *cache = READ_ONCE(file->buffers);
+    unsigned long start = request->user_addr;
+    unsigned long last = start + request->length - 1;
+    SekiBuffer *buffer;
+
+    if (!cache || request->flags || !request->length || last < start)
+        return -EINVAL;
+
+    spin_lock(&cache->lock);
+    buffer = seki_buffer_it_iter_first(&cache->tree, start, last);
+    if (buffer && buffer->start == start && buffer->last == last)
+        seki_buffer_it_remove(buffer, &cache->tree);
+    else
+        buffer = 0;
+    spin_unlock(&cache->lock);
+
+    // Never registered, or invalidated already
+    if (!buffer)
+        return -ENOENT;
+
+    seki_buffer_put(buffer);
+
+    return 0;
+}
+
+// The registered buffer [user_addr, user_addr + length) is in, referenced,
+// or 0 if there is none
+SekiBuffer *seki_buffer_get(SekiFile *file, unsigned long user_addr,
+                            unsigned long length)
+{
+    SekiBufferCache *cache = READ_ONCE(file->buffers);
+    unsigned long last = user_addr + length - 1;
+    SekiBuffer *buffer;
+
+    if (!cache || cache->mm != current->mm || !length || last < user_addr)
+        return 0;
+
+    spin_lock(&cache->lock);
+    buffer = seki_buffer_it_iter_first(&cache->tree, user_addr, last);
+    if (buffer && buffer->start <= user_addr && last <= buffer->last)
+        kref_get(&buffer->ref);
+    else
+        buffer = 0;
+    spin_unlock(&cache->lock);
+
+    return buffer;
+}
@@ -0,0 +1,73 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_buffer.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_BUFFER_H
+#define SEKI_BUFFER_H
+
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mmu_notifier.h>
+#include <linux/rbtree.h>
+#include <linux/scatterlist.h>
+#include <linux/spinlock.h>
+#include <linux/workqueue.h>
+
+struct SekiData;
+struct SekiFile;
+struct seki_buffer_register;
+
+// A user buffer pinned and mapped for DMA once, see seki_buffer.c
+typedef struct SekiBuffer {
+    struct rb_node              rb;         // In SekiBufferCache.tree
+    unsigned long               start;      // User addresses, inclusive
+    unsigned long               last;
+    unsigned long               subtree_last;
+    struct list_head            dead;       // In SekiBufferCache.dead
+    struct kref                 ref;        // The tree's and DMA users'
+    struct SekiData             *device_data;
+    struct mm_struct            *mm;        // Grabbed, for pinned_vm
+
+    unsigned long               nr_pages;   // From start & PAGE_MASK
+    unsigned long               nr_pinned;
+    struct page                 **pages;
+    dma_addr_t                  *page_bus;  // Of each page
+    struct sg_table             sgt;
+    int                         sg_count;
+} SekiBuffer;
+
+// Registered buffers of one file, in the mm that registered them
+typedef struct SekiBufferCache {
+    struct mmu_notifier     notifier;
+    struct mm_struct        *mm;
+    struct SekiFile         *file;
+
+    spinlock_t              lock;
+    struct rb_root_cached   tree;           // SekiBuffer, by address
+    struct list_head        dead;           // Invalidated, to be put
+    unsigned long           invalidate_seq;
+    unsigned int            invalidating;   // Ranges between start & end
+    struct work_struct      reap_work;
+} SekiBufferCache;
+
+void seki_buffer_init_file(struct SekiFile *file);
+void seki_buffer_release_file(struct SekiFile *file);
+
+int seki_buffer_register(struct SekiFile *file,
+                         const struct seki_buffer_register *request);
+int seki_buffer_unregister(struct SekiFile *file,
+                           const struct seki_buffer_register *request);
+
+SekiBuffer *seki_buffer_get(struct SekiFile *file, unsigned long user_addr,
+                            unsigned long length);
+void seki_buffer_put(SekiBuffer *buffer);
+
+
+#endif // SEKI_BUFFER_H
@@ -0,0 +1,248 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_chain.c>
+ * Job chains, many small jobs for one ioctl, one doorbell and one CQE.
+ *
+ * For jobs of a few KB the SQE, the ring enter and the doorbell cost as
+ * much as the job. A chain is validated as a whole up front, goes to the
+ * hardware queue of the submitting CPU in as few doorbells as its depth
+ * allows and reserves a single CQE on the ring of the file. Each job
+ * completes into the results array of the chain, the last one posts the
+ * CQE.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/mm.h>
+#include <linux/overflow.h>
+#include <linux/sched/signal.h>
+#include <linux/slab.h>
+#include <linux/uaccess.h>
+
+#include "seki_device_defs.h"
+#include "seki_uapi.h"
+#include "seki_chain.h"
+#include "seki_queue.h"
+#include "seki_ring.h"
+#include "seki_sched.h"
+
+// Refcounting
+static void seki_chain_free(struct kref *ref)
+{
+    kvfree(container_of(ref, SekiChain, ref));
+}
+
+static inline void seki_chain_put(SekiChain *chain)
+{
+    kref_put(&chain->ref, seki_chain_free);
+}
+
+// Completion, from the queue
+void seki_chain_complete(SekiChain *chain, u32 index, s32 status,
+                         u32 output_length)
+{
+    s32 first_error = 0;
+    u64 total = 0;
+
+    if (index < chain->count) {
+        chain->results[index].status = status;
+        chain->results[index].output_length = output_length;
+    }
+
+    // Fully ordered, the last one sees every result
+    if (!atomic_dec_and_test(&chain->remaining))
+        return;
+
+    for (u32 i = 0; i < chain->count; ++i) {
+        if (chain->results[i].status < 0) {
+            if (!first_error)
+                first_error = chain->results[i].status;
+        } else {
+            total += chain->results[i].output_length;
+        }
+    }
+
+    seki_ring_complete(chain->ring, chain->user_data, first_error,
+                       min_t(u64, total, U32_MAX));
+    seki_chain_put(chain);
+}
+
+// Per file
+void seki_chain_init_file(SekiFile *file)
+{
+    mutex_init(&file->chains_lock);
+    INIT_LIST_HEAD(&file->chains);
+    file->nr_chains = 0;
+    file->next_chain_id = 0;
+}
+
+// Chains still running finish on the reference of their jobs
+void seki_chain_release_file(SekiFile *file)
+{
+    SekiChain *chain;
+    SekiChain *next;
+
+    list_for_each_entry_safe(chain, next, &file->chains, node) {
+        list_del(&chain->node);
+        seki_chain_put(chain);
+    }
+    file->nr_chains = 0;
+}
+
+// Interface
+int seki_chain_submit(SekiFile *file, struct seki_chain_submit *request)
+{
+    SekiData *device_data = file->device_data;
+    SekiRing *ring = READ_ONCE(file->ring);
+    int keep = !(request->flags & SEKI_CHAIN_NO_RESULTS);
+    struct seki_job_desc *descs;
+    SekiQueue *queue;
+    SekiChain *chain;
+    u32 count = request->count;
+    u32 sent = 0;
+    int rv;
+
+    if (!ring || !count || count > SEKI_CHAIN_MAX_JOBS ||
+        (request->flags & ~SEKI_CHAIN_NO_RESULTS))
+        return -EINVAL;
+
+    descs = kvmalloc_array(count, sizeof(*descs), GFP_KERNEL);
+    if (!descs)
+        return -ENOMEM;
+
+    if (copy_from_user(descs, (void __user *)(unsigned long)request->descs,
+                       count * sizeof(*descs))) {
+        rv = -EFAULT;
+        goto err_free_descs;
+    }
+
+    // All or nothing, before the device sees any of it
+    for (u32 i = 0; i < count; ++i) {
+        rv = seki_ring_validate(file, descs + i);
+        if (rv) {
+            request->error_index = i;
+            goto err_free_descs;
+        }
+
+        descs[i].user_data = i;
+    }
+
+    chain = kvzalloc_node(struct_size(chain, results, count), GFP_KERNEL,
+                          device_data->node);
+    if (!chain) {
+        rv = -ENOMEM;
+        goto err_free_descs;
+    }
+
+    kref_init(&chain->ref);     // Of the jobs
+    INIT_LIST_HEAD(&chain->node);
+    chain->user_data = request->user_data;
+    chain->ring = ring;
+    chain->count = count;
+    atomic_set(&chain->remaining, count);
+
+    queue = seki_queue_for_cpu(device_data);
+
+    mutex_lock(&file->chains_lock);
+    if (keep && file->nr_chains >= SEKI_CHAIN_MAX_PENDING)
+        rv = -EBUSY;
+    else
+        rv = seki_ring_reserve(ring, queue);
+
+    if (!rv && keep) {
+        chain->id = ++file->next_chain_id;
+        kref_get(&chain->ref);
+        list_add_tail(&chain->node, &file->chains);
+        ++file->nr_chains;
+    }
+    mutex_unlock(&file->chains_lock);
+
+    if (rv)
+        goto err_free_chain;
+
+    request->id = chain->id;
+    request->error_index = 0;
+
+    // Gone as soon as its last job completes, unless the file keeps it
+    while (sent < count) {
+        unsigned int n = seki_sched_submit(queue, ring, chain, descs + sent,
+                                           count - sent);
+
+        sent += n;
+        if (sent == count || signal_pending(current) ||
+            !READ_ONCE(device_data->used))
+            break;
+
+        // Longer than the queue, wait for some of it to drain
+        if (!n) {
+            if (!device_data->nr_irq_vectors)
+                seki_queue_reap(queue);
+            usleep_range(10, 50);
+        }
+    }
+
+    // The rest never reaches the device
+    for (u32 i = sent; i < count; ++i)
+        seki_chain_complete(chain, i, -EINTR, 0);
+
+    kvfree(descs);
+
+    return 0;
+
+err_free_chain:
+    kvfree(chain);
+err_free_descs:
+    kvfree(descs);
+    return rv;
+}
+
+int seki_chain_status(SekiFile *file, struct seki_chain_status *request)
+{
+    SekiChain *found = 0;
+    SekiChain *chain;
+    int rv = -ENOENT;
+
+    mutex_lock(&file->chains_lock);
+
+    list_for_each_entry(chain, &file->chains, node) {
+        if (chain->id != request->id)
+            continue;
+
+        if (atomic_read(&chain->remaining)) {
+            rv = -EBUSY;
+        } else if (request->count < chain->count) {
+            rv = -ENOSPC;
+        } else {
+            // Results are written before remaining drops
+            smp_rmb();
+
+            if (copy_to_user((void __user *)(unsigned long)request->results,
+                             chain->results,
+                             chain->count * sizeof(*chain->results))) {
+                rv = -EFAULT;
+            } else {
+                list_del(&chain->node);
+                --file->nr_chains;
+                found = chain;
+                rv = 0;
+            }
+        }
+
+        request->count = chain->count;
+        break;
+    }
+
+    mutex_unlock(&file->chains_lock);
+
+    if (found)
+        seki_chain_put(found);
+
+    return rv;
+}
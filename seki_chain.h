@@ -0,0 +1,50 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_chain.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_CHAIN_H
+#define SEKI_CHAIN_H
+
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/types.h>
+
+#include "seki_uapi.h"
+
+struct SekiFile;
+struct SekiRing;
+
+// Jobs submitted together, completing as one CQE. Held by the file until
+// SEKI_IOCTL_CHAIN_STATUS and by the jobs until the last one is done.
+typedef struct SekiChain {
+    struct kref         ref;
+    struct list_head    node;       // In SekiFile.chains
+    u64                 id;
+    u64                 user_data;
+    struct SekiRing     *ring;      // Referenced, one CQE reserved
+    u32                 count;
+    atomic_t            remaining;
+    struct seki_chain_result    results[];
+} SekiChain;
+
+void seki_chain_init_file(struct SekiFile *file);
+void seki_chain_release_file(struct SekiFile *file);
+
+int seki_chain_submit(struct SekiFile *file,
+                      struct seki_chain_submit *request);
+int seki_chain_status(struct SekiFile *file,
+                      struct seki_chain_status *request);
+
+void seki_chain_complete(SekiChain *chain, u32 index, s32 status,
+                         u32 output_length);
+
+
+#endif // SEKI_CHAIN_H
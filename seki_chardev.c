@@ -6,7 +6,9 @@
  *
  * <seki_chardev.c>
  *
- * Note that sekictrl and seki[0-3] are mmap only char device
+ * Note that sekictrl is a mmap only char device, seki%d take ioctls
+ * as well. seki-any is the same as seki%d, bound at open to whichever
+ * card seki_dispatch_pick_device() likes best
  *
  ***************************************************************************/
 
@@ -18,10 +20,33 @@
 #include <linux/io.h>
 #include <linux/module.h>
 #include <linux/mm.h>
+#include <linux/mman.h>
+#include <linux/pfn_t.h>
 #include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/poll.h>
+#include <linux/rculist.h>
+#include <linux/srcu.h>
+#include <linux/uaccess.h>
 
 #include "seki_device_defs.h"
 #include "seki_chardev.h"
+#include "seki_uapi.h"
+#include "seki_alloc.h"
+#include "seki_buffer.h"
+#include "seki_chain.h"
+#include "seki_device.h"
+#include "seki_dispatch.h"
+#include "seki_dma.h"
+#include "seki_irq.h"
+#include "seki_oring.h"
+#include "seki_queue.h"
+#include "seki_ring.h"
+#include "seki_sched.h"
+#include "seki_stage.h"
+#include "seki_stats.h"
+#include "seki_telemetry.h"
+#include "seki_trace.h"
 
 // Variables
 static struct class *_seki_chardev_class_ctrl;
@@ -29,12 +54,65 @@ static struct class *_seki_chardev_class_device;
 
 static dev_t        _seki_chardev_devt_ctrl;
 static dev_t        _seki_chardev_devt_device;
+static dev_t        _seki_chardev_devt_any;
 static struct cdev  _seki_chardev_cdev_sekictrl;
+static struct cdev  _seki_chardev_cdev_any;
+
+// BAR mappings are populated on fault. Faults run in an SRCU read side
+// section and check the device is still used, so once remove has
+// unpublished the device, synchronized and zapped the mappings, nothing
+// maps its BARs again and later accesses get SIGBUS.
+//
+// Every sekictrl file shares one address_space and every seki%d file
+// shares the one of its device, so the zap finds all of the mappings
+// whatever inode they came through.
+DEFINE_STATIC_SRCU(_seki_chardev_mmap_srcu);
+static struct address_space _seki_chardev_ctl_mapping;
 
-// FIXME: What will happen if a device is unplugged
-//          when already mmaped?
 // FIXME: Macronize strings
 // Ctl file ops
+static int
+seki_chardev_file_ctl_open(struct inode *inode, struct file *filp)
+{
+    filp->f_mapping = &_seki_chardev_ctl_mapping;
+
+    return nonseekable_open(inode, filp);
+}
+
+static vm_fault_t seki_chardev_file_ctl_vma_fault(struct vm_fault *vmf)
+{
+    unsigned long dev_num = vmf->pgoff / 0x100;
+    unsigned long offset = (vmf->pgoff % 0x100) << PAGE_SHIFT;
+    unsigned long phys = 0;
+    SekiData *device_data;
+    vm_fault_t rv = VM_FAULT_SIGBUS;
+    int idx;
+
+    idx = srcu_read_lock(&_seki_chardev_mmap_srcu);
+
+    rcu_read_lock();
+    device_data = idr_find(&_seki_device_idr, dev_num);
+    if (device_data && READ_ONCE(device_data->used) &&
+        offset < device_data->ctrl_mmio_length) {
+        phys = device_data->ctrl_mmio_physical_addr + offset;
+        seki_stats_inc(device_data, SEKI_STAT_MMAP_FAULTS);
+    }
+    rcu_read_unlock();
+
+    if (phys)
+        rv = vmf_insert_pfn(vmf->vma, vmf->address, phys >> PAGE_SHIFT);
+
+    trace_seki_fault(dev_num, phys, PAGE_SIZE, rv);
+
+    srcu_read_unlock(&_seki_chardev_mmap_srcu, idx);
+
+    return rv;
+}
+
+static const struct vm_operations_struct seki_chardev_ctl_vm_ops = {
+    .fault  = seki_chardev_file_ctl_vma_fault,
+};
+
 static int
 seki_chardev_file_ctl_mmap(struct file *filp,
                            struct vm_area_struct *vma)
@@ -46,60 +124,990 @@ seki_chardev_file_ctl_mmap(struct file *filp,
     // Only 1 device can be mapped one time
     unsigned long dev_num = vma->vm_pgoff / 0x100;  // 100 pf per Ctrl Mem
     unsigned long len = vma->vm_end - vma->vm_start; // in bytes
+    SekiData *device_data;
 
-    if (dev_num >= _seki_device_count) {
+    if (dev_num >= SEKI_MAX_PCI_DEVICES) {
         pr_err("mmap offset off range");
 
         return -EINVAL;
     }
 
-    if (len > 0x100000) {
+    // Faults must not wander into the next device
+    if (len > 0x100000 ||
+        (vma->vm_pgoff % 0x100) + vma_pages(vma) > 0x100) {
         pr_err("mmap length too large");
 
         return -EINVAL;
     }
 
-    if (!_seki_data_array[dev_num].used) {
+    // Copy on write cannot work on PFN maps of registers
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    // Only fail early, the fault handler checks again
+    device_data = seki_device_get(dev_num);
+    if (!device_data) {
         pr_err("mmap invalid device struct. This should not happed");
 
         return -EAGAIN;
     }
+    seki_device_put(device_data);
 
-    vma->vm_flags |= VM_LOCKED;
+    vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP;
+    vma->vm_ops = &seki_chardev_ctl_vm_ops;
 
-    if (io_remap_pfn_range(vma, vma->vm_start,
-                           (_seki_data_array[dev_num].ctrl_mmio_physical_addr
-                           >> PAGE_SHIFT) + vma->vm_pgoff,
-                           len,
-                           vma->vm_page_prot)) {
-        return -EAGAIN;
-    }
-    return 0;
+    trace_seki_mmap(dev_num, vma->vm_pgoff << PAGE_SHIFT, len);
 
+    return 0;
 }
 
 static struct file_operations seki_chardev_file_ctl_fops = {
     .owner  = THIS_MODULE,
-    .open   = nonseekable_open,
+    .open   = seki_chardev_file_ctl_open,
     .llseek = no_llseek,
     .mmap   = seki_chardev_file_ctl_mmap
 };
 
 // Device file ops
+// Takes over the reference on device_data when it succeeds
+static int
+seki_chardev_file_open_device(SekiData *device_data, struct inode *inode,
+                              struct file *filp)
+{
+    SekiFile *file;
+
+    // Touched by the IRQ path, which runs near the card
+    file = kzalloc_node(sizeof(*file), GFP_KERNEL, device_data->node);
+    if (!file)
+        return -ENOMEM;
+
+    file->device_data = device_data;
+    if (seki_sched_init_file(file)) {
+        kfree(file);
+        return -ENOMEM;
+    }
+
+    file->poll_mode = seki_ring_default_poll_mode();
+    seki_irq_init_file(file);
+    seki_alloc_init_file(file);
+    seki_chain_init_file(file);
+    seki_buffer_init_file(file);
+
+    spin_lock(&device_data->files_lock);
+    list_add_tail_rcu(&file->node, &device_data->files);
+    spin_unlock(&device_data->files_lock);
+    atomic_inc(&device_data->nr_files);
+
+    filp->private_data = file;
+    filp->f_mapping = &device_data->mapping;
+
+    // Seekable, read() and write() take the mmap offsets
+    SEKI_UNUSED(inode);
+
+    return 0;
+}
+
+static int
+seki_chardev_file_device_open(struct inode *inode, struct file *filp)
+{
+    unsigned int dev_num = iminor(inode) - MINOR(_seki_chardev_devt_device);
+    SekiData *device_data = seki_device_get(dev_num);
+    int rv;
+
+    if (!device_data)
+        return -ENODEV;
+
+    rv = seki_chardev_file_open_device(device_data, inode, filp);
+    if (rv)
+        seki_device_put(device_data);
+
+    return rv;
+}
+
+static int
+seki_chardev_file_any_open(struct inode *inode, struct file *filp)
+{
+    SekiData *device_data = seki_dispatch_pick_device();
+    int rv;
+
+    if (!device_data)
+        return -ENODEV;
+
+    rv = seki_chardev_file_open_device(device_data, inode, filp);
+    if (rv)
+        seki_device_put(device_data);
+
+    return rv;
+}
+
+static int
+seki_chardev_file_device_release(struct inode *inode, struct file *filp)
+{
+    SekiFile *file = filp->private_data;
+    SekiData *device_data = file->device_data;
+    int idx;
+
+    SEKI_UNUSED(inode);
+
+    spin_lock(&device_data->files_lock);
+    list_del_rcu(&file->node);
+    spin_unlock(&device_data->files_lock);
+    atomic_dec(&device_data->nr_files);
+
+    // Even once removed, so teardown does not pull the registers from
+    // under seki_oring_release_file()
+    idx = srcu_read_lock(&device_data->ops_srcu);
+
+    seki_irq_uninit_file(file);
+    seki_chain_release_file(file);
+    seki_oring_release_file(file);
+    seki_alloc_release_file(file);
+    seki_ring_release(file);
+    seki_buffer_release_file(file);
+    seki_sched_release_file(file);
+
+    srcu_read_unlock(&device_data->ops_srcu, idx);
+
+    // The IRQ path may still be walking past us
+    kfree_rcu(file, rcu);
+
+    seki_device_put(device_data);
+
+    return 0;
+}
+
+static __poll_t
+seki_chardev_file_device_poll(struct file *filp, poll_table *wait)
+{
+    SekiFile *file = filp->private_data;
+    __poll_t mask;
+    int idx;
+
+    idx = seki_device_enter(file->device_data);
+    if (idx < 0)
+        return EPOLLERR | EPOLLHUP;
+
+    poll_wait(filp, &file->event_wait, wait);
+
+    mask = seki_ring_poll(file, filp, wait);
+    mask |= seki_oring_poll(file, filp, wait);
+    if (seki_irq_file_has_events(file))
+        mask |= EPOLLIN | EPOLLRDNORM;
+
+    seki_device_leave(file->device_data, idx);
+
+    return mask;
+}
+
+// Window mappings
+// Which window an mmap offset of /dev/seki%d falls in
+static int
+seki_chardev_window_of(SekiData *device_data, unsigned long offset,
+                       unsigned int *window, unsigned long *region_offset,
+                       unsigned long *region_physical_addr,
+                       unsigned long *region_length)
+{
+    if (offset >= SEKI_MMAP_OUTPUT_OFFSET &&
+        offset < SEKI_MMAP_OUTPUT_OFFSET + SEKI_MMAP_REGION_SIZE) {
+        *window               = SEKI_WINDOW_OUTPUT;
+        *region_offset        = offset - SEKI_MMAP_OUTPUT_OFFSET;
+        *region_physical_addr = device_data->output_mmio_physical_addr;
+        *region_length        = device_data->output_mmio_length;
+    } else if (offset < SEKI_MMAP_INPUT_OFFSET + SEKI_MMAP_REGION_SIZE) {
+        *window               = SEKI_WINDOW_INPUT;
+        *region_offset        = offset - SEKI_MMAP_INPUT_OFFSET;
+        *region_physical_addr = device_data->input_mmio_physical_addr;
+        *region_length        = device_data->input_mmio_length;
+    } else {
+        return -EINVAL;
+    }
+
+    return 0;
+}
+
+// Physical address behind an mmap offset, 0 if there is none
+static unsigned long
+seki_chardev_window_phys(SekiData *device_data, unsigned long offset)
+{
+    unsigned long region_offset;
+    unsigned long region_physical_addr;
+    unsigned long region_length;
+    unsigned int  window;
+
+    if (seki_chardev_window_of(device_data, offset, &window, &region_offset,
+                               &region_physical_addr, &region_length) ||
+        region_offset >= region_length)
+        return 0;
+
+    return region_physical_addr + region_offset;
+}
+
+// Window mappings pin their chunk, so it cannot be freed and handed to
+// someone else while still mapped
+static void seki_chardev_window_vma_open(struct vm_area_struct *vma)
+{
+    seki_alloc_hold_mapping(vma->vm_file->private_data,
+                            vma->vm_private_data);
+}
+
+static void seki_chardev_window_vma_close(struct vm_area_struct *vma)
+{
+    seki_alloc_put_mapping(vma->vm_file->private_data,
+                           vma->vm_private_data);
+}
+
+// Pages are inserted on fault, as large as the alignment of the user
+// address and the bus address allows. The mmap checks already keep the
+// whole VMA inside one chunk.
+static vm_fault_t
+seki_chardev_window_vma_huge_fault(struct vm_fault *vmf,
+                                   enum page_entry_size pe_size)
+{
+    struct vm_area_struct *vma = vmf->vma;
+    SekiFile *file = vma->vm_file->private_data;
+    SekiData *device_data = file->device_data;
+    bool write = vmf->flags & FAULT_FLAG_WRITE;
+    unsigned long size;
+    unsigned long addr;
+    unsigned long phys;
+    vm_fault_t rv;
+    pfn_t pfn;
+    int idx;
+
+    switch (pe_size) {
+    case PE_SIZE_PTE:
+        size = PAGE_SIZE;
+        break;
+    case PE_SIZE_PMD:
+        size = PMD_SIZE;
+        break;
+    case PE_SIZE_PUD:
+        size = PUD_SIZE;
+        break;
+    default:
+        return VM_FAULT_FALLBACK;
+    }
+
+    addr = vmf->address & ~(size - 1);
+    if (addr < vma->vm_start || addr + size > vma->vm_end)
+        return VM_FAULT_FALLBACK;
+
+    phys = seki_chardev_window_phys(device_data,
+                                    (vma->vm_pgoff << PAGE_SHIFT) +
+                                    (addr - vma->vm_start));
+    if (!phys)
+        return VM_FAULT_SIGBUS;
+    if (phys & (size - 1))
+        return VM_FAULT_FALLBACK;
+
+    pfn = phys_to_pfn_t(phys, PFN_DEV);
+
+    idx = srcu_read_lock(&_seki_chardev_mmap_srcu);
+
+    if (!READ_ONCE(device_data->used)) {
+        rv = VM_FAULT_SIGBUS;
+        goto out_unlock;
+    }
+
+    seki_stats_inc(device_data, SEKI_STAT_MMAP_FAULTS);
+
+    switch (pe_size) {
+    case PE_SIZE_PTE:
+        rv = vmf_insert_pfn(vma, addr, pfn_t_to_pfn(pfn));
+        break;
+#ifdef CONFIG_TRANSPARENT_HUGEPAGE
+    case PE_SIZE_PMD:
+        rv = vmf_insert_pfn_pmd(vmf, pfn, write);
+        break;
+#endif
+#ifdef CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD
+    case PE_SIZE_PUD:
+        rv = vmf_insert_pfn_pud(vmf, pfn, write);
+        break;
+#endif
+    default:
+        SEKI_UNUSED(write);
+        rv = VM_FAULT_FALLBACK;
+        break;
+    }
+
+out_unlock:
+    srcu_read_unlock(&_seki_chardev_mmap_srcu, idx);
+
+    trace_seki_fault(device_data->device_num, phys, size, rv);
+
+    return rv;
+}
+
+static vm_fault_t seki_chardev_window_vma_fault(struct vm_fault *vmf)
+{
+    return seki_chardev_window_vma_huge_fault(vmf, PE_SIZE_PTE);
+}
+
+static const struct vm_operations_struct seki_chardev_window_vm_ops = {
+    .open       = seki_chardev_window_vma_open,
+    .close      = seki_chardev_window_vma_close,
+    .fault      = seki_chardev_window_vma_fault,
+    .huge_fault = seki_chardev_window_vma_huge_fault,
+};
+
+// Aligns window mappings to the bus address, so huge_fault can use PMD
+// or PUD entries
+static unsigned long
+seki_chardev_file_device_get_unmapped_area(struct file *filp,
+                                           unsigned long addr,
+                                           unsigned long len,
+                                           unsigned long pgoff,
+                                           unsigned long flags)
+{
+    SekiFile *file = filp->private_data;
+    unsigned long phys = 0;
+    unsigned long align = 0;
+    unsigned long area;
+
+    if (!addr && !(flags & MAP_FIXED))
+        phys = seki_chardev_window_phys(file->device_data,
+                                        pgoff << PAGE_SHIFT);
+
+    if (phys && len >= PUD_SIZE &&
+        IS_ENABLED(CONFIG_HAVE_ARCH_TRANSPARENT_HUGEPAGE_PUD))
+        align = PUD_SIZE;
+    else if (phys && len >= PMD_SIZE &&
+             IS_ENABLED(CONFIG_TRANSPARENT_HUGEPAGE))
+        align = PMD_SIZE;
+
+    if (align && len + align > len) {
+        area = current->mm->get_unmapped_area(filp, 0, len + align,
+                                              pgoff, flags);
+        if (!IS_ERR_VALUE(area))
+            return area + ((phys - area) & (align - 1));
+    }
+
+    return current->mm->get_unmapped_area(filp, addr, len, pgoff, flags);
+}
+
+static int
+seki_chardev_mmap(SekiFile *file, struct vm_area_struct *vma)
+{
+    SekiData *device_data = file->device_data;
+    unsigned long offset = vma->vm_pgoff << PAGE_SHIFT;  // in bytes
+    unsigned long len = vma->vm_end - vma->vm_start;
+    unsigned long region_offset;
+    unsigned long region_physical_addr;
+    unsigned long region_length;
+    unsigned int  window;
+    SekiChunk     *chunk;
+
+    if (offset >= SEKI_MMAP_RING_OFFSET &&
+        offset < SEKI_MMAP_RING_OFFSET + SEKI_MMAP_REGION_SIZE)
+        return seki_ring_mmap(file, vma);
+
+    if (offset >= SEKI_MMAP_TELEMETRY_OFFSET &&
+        offset < SEKI_MMAP_TELEMETRY_OFFSET + SEKI_MMAP_REGION_SIZE)
+        return seki_telemetry_mmap(file, vma);
+
+    if (seki_chardev_window_of(device_data, offset, &window, &region_offset,
+                               &region_physical_addr, &region_length)) {
+        pr_err("mmap offset off range");
+
+        return -EINVAL;
+    }
+
+    // A private mapping would be copy on write, which PFN maps of a BAR
+    // cannot do
+    if (!(vma->vm_flags & VM_SHARED))
+        return -EINVAL;
+
+    if (len > region_length || region_offset > region_length - len) {
+        pr_err("mmap length too large");
+
+        return -EINVAL;
+    }
+
+    chunk = seki_alloc_get_mapping(file, window, region_offset, len);
+    if (!chunk) {
+        pr_debug("mmap outside of the chunks of this file");
+
+        return -EACCES;
+    }
+
+    if (window == SEKI_WINDOW_OUTPUT) {
+        // Output window is read back by the CPU, keep it uncached
+        vma->vm_page_prot = pgprot_noncached(vma->vm_page_prot);
+    } else {
+        // Input window is write mostly, let the CPU combine stores
+        // into full PCIe bursts
+        vma->vm_page_prot = pgprot_writecombine(vma->vm_page_prot);
+    }
+
+    // Populated by seki_chardev_window_vma_huge_fault(). VM_HUGEPAGE
+    // keeps huge entries on with THP in madvise mode.
+    vma->vm_flags |= VM_IO | VM_PFNMAP | VM_DONTEXPAND | VM_DONTDUMP |
+                     VM_HUGEPAGE;
+    vma->vm_private_data = chunk;
+    vma->vm_ops = &seki_chardev_window_vm_ops;
+
+    trace_seki_mmap(device_data->device_num, offset, len);
+
+    return 0;
+}
+
 static int
 seki_chardev_file_device_mmap(struct file *filp,
                               struct vm_area_struct *vma)
 {
-    return -EAGAIN;
+    SekiFile *file = filp->private_data;
+    int idx;
+    int rv;
+
+    idx = seki_device_enter(file->device_data);
+    if (idx < 0)
+        return idx;
+
+    rv = seki_chardev_mmap(file, vma);
+
+    seki_device_leave(file->device_data, idx);
+
+    return rv;
+}
+
+// Read & write, same offsets as mmap. Writes go to the input window and
+// reads come from the output window, like the DMA directions.
+static ssize_t
+seki_chardev_rw(SekiFile *file, char __user *buf, size_t count, loff_t *ppos,
+                int to_device)
+{
+    SekiData *device_data = file->device_data;
+    unsigned long region_offset;
+    unsigned long region_physical_addr;
+    unsigned long region_length;
+    unsigned int  window;
+    SekiBuffer    *buffer;
+    ssize_t rv;
+
+    if (*ppos < 0 ||
+        seki_chardev_window_of(device_data, *ppos, &window, &region_offset,
+                               &region_physical_addr, &region_length) ||
+        (window == SEKI_WINDOW_INPUT) != to_device)
+        return -EINVAL;
+
+    if (region_offset >= region_length)
+        return to_device ? -ENOSPC : 0;
+
+    count = min_t(size_t, count, region_length - region_offset);
+    if (!count)
+        return 0;
+
+    if (!seki_alloc_owns(file, window, region_offset, count))
+        return -EACCES;
+
+    // A registered buffer is pinned and mapped already, DMA straight
+    // from it rather than through the bounce buffers
+    buffer = seki_buffer_get(file, (unsigned long)buf, count);
+    if (buffer) {
+        struct seki_dma_request request = {
+            .user_addr     = (unsigned long)buf,
+            .length        = count,
+            .device_offset = region_offset,
+            .direction     = to_device ? SEKI_DMA_TO_DEVICE
+                                       : SEKI_DMA_FROM_DEVICE,
+        };
+
+        seki_buffer_put(buffer);
+        rv = seki_dma_submit_user(file, &request);
+        if (!rv)
+            rv = count;
+    } else if (to_device) {
+        rv = seki_dma_write_user(device_data, buf, count, region_offset);
+    } else {
+        rv = seki_dma_read_user(device_data, buf, count, region_offset);
+    }
+
+    if (rv > 0)
+        *ppos += rv;
+
+    return rv;
+}
+
+static ssize_t
+seki_chardev_file_device_rw(struct file *filp, char __user *buf,
+                            size_t count, loff_t *ppos, int to_device)
+{
+    SekiFile *file = filp->private_data;
+    ssize_t rv;
+    int idx;
+
+    idx = seki_device_enter(file->device_data);
+    if (idx < 0)
+        return idx;
+
+    rv = seki_chardev_rw(file, buf, count, ppos, to_device);
+
+    seki_device_leave(file->device_data, idx);
+
+    return rv;
+}
+
+static ssize_t
+seki_chardev_file_device_read(struct file *filp, char __user *buf,
+                              size_t count, loff_t *ppos)
+{
+    return seki_chardev_file_device_rw(filp, buf, count, ppos, 0);
+}
+
+static ssize_t
+seki_chardev_file_device_write(struct file *filp, const char __user *buf,
+                               size_t count, loff_t *ppos)
+{
+    return seki_chardev_file_device_rw(filp, (char __user *)buf, count,
+                                       ppos, 1);
+}
+
+// splice() and sendfile(), from the output window only like read(). The
+// device DMAs into pages the pipe then owns.
+static ssize_t
+seki_chardev_splice_read(SekiFile *file, loff_t *ppos,
+                         struct pipe_inode_info *pipe, size_t count)
+{
+    SekiData *device_data = file->device_data;
+    unsigned long region_offset;
+    unsigned long region_physical_addr;
+    unsigned long region_length;
+    unsigned int  window;
+    ssize_t rv;
+
+    if (*ppos < 0 ||
+        seki_chardev_window_of(device_data, *ppos, &window, &region_offset,
+                               &region_physical_addr, &region_length) ||
+        window != SEKI_WINDOW_OUTPUT)
+        return -EINVAL;
+
+    if (region_offset >= region_length)
+        return 0;
+
+    count = min_t(size_t, count, region_length - region_offset);
+    if (!count)
+        return 0;
+
+    if (!seki_alloc_owns(file, window, region_offset, count))
+        return -EACCES;
+
+    rv = seki_dma_splice_read(device_data, pipe, count, region_offset);
+    if (rv > 0)
+        *ppos += rv;
+
+    return rv;
+}
+
+static ssize_t
+seki_chardev_file_device_splice_read(struct file *filp, loff_t *ppos,
+                                     struct pipe_inode_info *pipe,
+                                     size_t count, unsigned int flags)
+{
+    SekiFile *file = filp->private_data;
+    ssize_t rv;
+    int idx;
+
+    SEKI_UNUSED(flags);
+
+    idx = seki_device_enter(file->device_data);
+    if (idx < 0)
+        return idx;
+
+    rv = seki_chardev_splice_read(file, ppos, pipe, count);
+
+    seki_device_leave(file->device_data, idx);
+
+    return rv;
+}
+
+static long
+seki_chardev_ioctl_dma_submit(SekiFile *file, void __user *argp)
+{
+    struct seki_dma_request request;
+    unsigned int window;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    window = request.direction == SEKI_DMA_TO_DEVICE ? SEKI_WINDOW_INPUT
+                                                     : SEKI_WINDOW_OUTPUT;
+    if (!seki_alloc_owns(file, window, request.device_offset,
+                         request.length))
+        return -EACCES;
+
+    return seki_dma_submit_user(file, &request);
+}
+
+static long
+seki_chardev_ioctl_set_eventfd(SekiFile *file, void __user *argp)
+{
+    __s32 fd;
+
+    if (get_user(fd, (__s32 __user *)argp))
+        return -EFAULT;
+
+    return seki_irq_set_eventfd(file, fd);
+}
+
+static long
+seki_chardev_ioctl_get_events(SekiFile *file, void __user *argp)
+{
+    struct seki_event_info info;
+
+    seki_irq_collect_events(file, &info);
+
+    if (copy_to_user(argp, &info, sizeof(info)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl_ring_setup(SekiFile *file, void __user *argp)
+{
+    struct seki_ring_params params;
+    int rv;
+
+    if (copy_from_user(&params, argp, sizeof(params)))
+        return -EFAULT;
+
+    rv = seki_ring_setup(file, &params);
+    if (rv)
+        return rv;
+
+    if (copy_to_user(argp, &params, sizeof(params)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl_ring_enter(SekiFile *file, void __user *argp)
+{
+    struct seki_ring_enter enter;
+    int rv;
+
+    if (copy_from_user(&enter, argp, sizeof(enter)))
+        return -EFAULT;
+
+    rv = seki_ring_enter(file, &enter);
+
+    // Report what was submitted even if the wait got interrupted
+    if (put_user(enter.submitted,
+                 &((struct seki_ring_enter __user *)argp)->submitted))
+        return -EFAULT;
+
+    return rv;
+}
+
+static long
+seki_chardev_ioctl_get_queue_info(SekiData *device_data, void __user *argp)
+{
+    struct seki_queue_info info;
+    SekiQueue *queue = seki_queue_for_cpu(device_data);
+
+    memset(&info, 0, sizeof(info));
+    info.queue        = queue->index;
+    info.nr_queues    = device_data->nr_queues;
+    info.input_offset = queue->input_offset;
+    info.input_length = queue->input_length;
+
+    if (copy_to_user(argp, &info, sizeof(info)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl_set_poll_mode(SekiFile *file, void __user *argp)
+{
+    __u32 mode;
+
+    if (get_user(mode, (__u32 __user *)argp))
+        return -EFAULT;
+
+    if (mode > SEKI_POLL_HYBRID)
+        return -EINVAL;
+
+    WRITE_ONCE(file->poll_mode, mode);
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl_alloc(SekiFile *file, void __user *argp)
+{
+    struct seki_alloc_request request;
+    int rv;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    rv = seki_alloc_chunk(file, &request);
+    if (rv)
+        return rv;
+
+    if (copy_to_user(argp, &request, sizeof(request))) {
+        seki_alloc_free_chunk(file, &request);
+        return -EFAULT;
+    }
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl_free(SekiFile *file, void __user *argp)
+{
+    struct seki_alloc_request request;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    return seki_alloc_free_chunk(file, &request);
+}
+
+static long
+seki_chardev_ioctl_get_device_num(SekiData *device_data, void __user *argp)
+{
+    return put_user((__u32)device_data->device_num, (__u32 __user *)argp);
+}
+
+static long
+seki_chardev_ioctl_stage_info(SekiData *device_data, void __user *argp)
+{
+    struct seki_stage_info info;
+
+    seki_stage_get_info(device_data, &info);
+
+    if (copy_to_user(argp, &info, sizeof(info)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl_stage_submit(SekiFile *file, void __user *argp)
+{
+    struct seki_stage_submit request;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    return seki_stage_submit(file, &request);
+}
+
+static long
+seki_chardev_ioctl_chain_submit(SekiFile *file, void __user *argp)
+{
+    struct seki_chain_submit request;
+    int rv;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    rv = seki_chain_submit(file, &request);
+
+    // The id, or error_index of a chain that failed validation
+    if (copy_to_user(argp, &request, sizeof(request)))
+        return -EFAULT;
+
+    return rv;
+}
+
+static long
+seki_chardev_ioctl_chain_status(SekiFile *file, void __user *argp)
+{
+    struct seki_chain_status request;
+    int rv;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    rv = seki_chain_status(file, &request);
+
+    if (put_user(request.count,
+                 &((struct seki_chain_status __user *)argp)->count))
+        return -EFAULT;
+
+    return rv;
+}
+
+static long
+seki_chardev_ioctl_oring_setup(SekiFile *file, void __user *argp)
+{
+    struct seki_oring_params params;
+
+    if (copy_from_user(&params, argp, sizeof(params)))
+        return -EFAULT;
+
+    return seki_oring_setup(file, &params);
+}
+
+static long
+seki_chardev_ioctl_oring_consume(SekiFile *file, void __user *argp)
+{
+    struct seki_oring_consume request;
+    int rv;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    rv = seki_oring_consume(file, &request);
+    if (rv)
+        return rv;
+
+    if (copy_to_user(argp, &request, sizeof(request)))
+        return -EFAULT;
 
     return 0;
 }
 
+static long
+seki_chardev_ioctl_buffer_register(SekiFile *file, void __user *argp)
+{
+    struct seki_buffer_register request;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    return seki_buffer_register(file, &request);
+}
+
+static long
+seki_chardev_ioctl_buffer_unregister(SekiFile *file, void __user *argp)
+{
+    struct seki_buffer_register request;
+
+    if (copy_from_user(&request, argp, sizeof(request)))
+        return -EFAULT;
+
+    return seki_buffer_unregister(file, &request);
+}
+
+static long
+seki_chardev_ioctl_sched_set(SekiFile *file, void __user *argp)
+{
+    struct seki_sched_params params;
+
+    if (copy_from_user(&params, argp, sizeof(params)))
+        return -EFAULT;
+
+    return seki_sched_set(file, &params);
+}
+
+static long
+seki_chardev_ioctl_sched_stats(SekiFile *file, void __user *argp)
+{
+    struct seki_sched_stats stats;
+
+    seki_sched_read_stats(file->sched, &stats);
+
+    if (copy_to_user(argp, &stats, sizeof(stats)))
+        return -EFAULT;
+
+    return 0;
+}
+
+static long
+seki_chardev_ioctl(SekiFile *file, unsigned int cmd, void __user *argp)
+{
+    SekiData *device_data = file->device_data;
+
+    switch (cmd) {
+    case SEKI_IOCTL_DMA_SUBMIT:
+        return seki_chardev_ioctl_dma_submit(file, argp);
+    case SEKI_IOCTL_SET_EVENTFD:
+        return seki_chardev_ioctl_set_eventfd(file, argp);
+    case SEKI_IOCTL_GET_EVENTS:
+        return seki_chardev_ioctl_get_events(file, argp);
+    case SEKI_IOCTL_RING_SETUP:
+        return seki_chardev_ioctl_ring_setup(file, argp);
+    case SEKI_IOCTL_RING_ENTER:
+        return seki_chardev_ioctl_ring_enter(file, argp);
+    case SEKI_IOCTL_GET_QUEUE_INFO:
+        return seki_chardev_ioctl_get_queue_info(device_data, argp);
+    case SEKI_IOCTL_SET_POLL_MODE:
+        return seki_chardev_ioctl_set_poll_mode(file, argp);
+    case SEKI_IOCTL_ALLOC:
+        return seki_chardev_ioctl_alloc(file, argp);
+    case SEKI_IOCTL_FREE:
+        return seki_chardev_ioctl_free(file, argp);
+    case SEKI_IOCTL_GET_DEVICE_NUM:
+        return seki_chardev_ioctl_get_device_num(device_data, argp);
+    case SEKI_IOCTL_STAGE_INFO:
+        return seki_chardev_ioctl_stage_info(device_data, argp);
+    case SEKI_IOCTL_STAGE_SUBMIT:
+        return seki_chardev_ioctl_stage_submit(file, argp);
+    case SEKI_IOCTL_CHAIN_SUBMIT:
+        return seki_chardev_ioctl_chain_submit(file, argp);
+    case SEKI_IOCTL_CHAIN_STATUS:
+        return seki_chardev_ioctl_chain_status(file, argp);
+    case SEKI_IOCTL_ORING_SETUP:
+        return seki_chardev_ioctl_oring_setup(file, argp);
+    case SEKI_IOCTL_ORING_CONSUME:
+        return seki_chardev_ioctl_oring_consume(file, argp);
+    case SEKI_IOCTL_BUFFER_REGISTER:
+        return seki_chardev_ioctl_buffer_register(file, argp);
+    case SEKI_IOCTL_BUFFER_UNREGISTER:
+        return seki_chardev_ioctl_buffer_unregister(file, argp);
+    case SEKI_IOCTL_SCHED_SET:
+        return seki_chardev_ioctl_sched_set(file, argp);
+    case SEKI_IOCTL_SCHED_STATS:
+        return seki_chardev_ioctl_sched_stats(file, argp);
+    default:
+        return -ENOTTY;
+    }
+}
+
+static long
+seki_chardev_file_device_ioctl(struct file *filp, unsigned int cmd,
+                               unsigned long arg)
+{
+    SekiFile *file = filp->private_data;
+    long rv;
+    int idx;
+
+    // Removed, the file only keeps the memory around
+    idx = seki_device_enter(file->device_data);
+    if (idx < 0)
+        return idx;
+
+    rv = seki_chardev_ioctl(file, cmd, (void __user *)arg);
+
+    seki_device_leave(file->device_data, idx);
+
+    return rv;
+}
+
 static struct file_operations seki_chardev_file_device_fops = {
-    .owner  = THIS_MODULE,
-    .open   = nonseekable_open,
-    .llseek = no_llseek,
-    .mmap   = seki_chardev_file_device_mmap
+    .owner          = THIS_MODULE,
+    .open           = seki_chardev_file_device_open,
+    .release        = seki_chardev_file_device_release,
+    .llseek         = no_seek_end_llseek,
+    .read           = seki_chardev_file_device_read,
+    .write          = seki_chardev_file_device_write,
+    .splice_read    = seki_chardev_file_device_splice_read,
+    .poll           = seki_chardev_file_device_poll,
+    .mmap           = seki_chardev_file_device_mmap,
+    .get_unmapped_area = seki_chardev_file_device_get_unmapped_area,
+    .unlocked_ioctl = seki_chardev_file_device_ioctl,
+    .compat_ioctl   = seki_chardev_file_device_ioctl,
+};
+
+static struct file_operations seki_chardev_file_any_fops = {
+    .owner          = THIS_MODULE,
+    .open           = seki_chardev_file_any_open,
+    .release        = seki_chardev_file_device_release,
+    .llseek         = no_seek_end_llseek,
+    .read           = seki_chardev_file_device_read,
+    .write          = seki_chardev_file_device_write,
+    .splice_read    = seki_chardev_file_device_splice_read,
+    .poll           = seki_chardev_file_device_poll,
+    .mmap           = seki_chardev_file_device_mmap,
+    .get_unmapped_area = seki_chardev_file_device_get_unmapped_area,
+    .unlocked_ioctl = seki_chardev_file_device_ioctl,
+    .compat_ioctl   = seki_chardev_file_device_ioctl,
 };
 
 
@@ -125,6 +1133,8 @@ int seki_chardev_register_file_ctl(void)
         return -ENOMEM;
     }
 
+    address_space_init_once(&_seki_chardev_ctl_mapping);
+
     cdev_init(&_seki_chardev_cdev_sekictrl, &seki_chardev_file_ctl_fops);
     rv = cdev_add(&_seki_chardev_cdev_sekictrl, num, 1);
     if (rv < 0) {
@@ -198,6 +1208,52 @@ void seki_chardev_unregister_file_seki_device(void)
     _seki_chardev_class_device = 0;
 }
 
+// Needs the seki class, register after seki_chardev_register_file_seki_device
+int seki_chardev_register_file_any(void)
+{
+    int rv;
+
+    rv = alloc_chrdev_region(&_seki_chardev_devt_any, 0, 1, "seki-any");
+    if (rv < 0) {
+        pr_err("Unable to allocate seki-any device region\n");
+
+        return rv;
+    }
+
+    cdev_init(&_seki_chardev_cdev_any, &seki_chardev_file_any_fops);
+    rv = cdev_add(&_seki_chardev_cdev_any, _seki_chardev_devt_any, 1);
+    if (rv < 0) {
+        pr_err("Unable to add seki-any char device\n");
+
+        goto err_unreg_any_region;
+    }
+
+    if (IS_ERR(device_create(_seki_chardev_class_device, NULL,
+                             _seki_chardev_devt_any, NULL, "seki-any"))) {
+        pr_err("Unable to create device seki-any with udev");
+
+        rv = -ENOMEM;
+        goto err_cdev_del_any;
+    }
+
+    return 0;
+
+err_cdev_del_any:
+    cdev_del(&_seki_chardev_cdev_any);
+err_unreg_any_region:
+    unregister_chrdev_region(_seki_chardev_devt_any, 1);
+    return rv;
+}
+
+void seki_chardev_unregister_file_any(void)
+{
+    device_destroy(_seki_chardev_class_device, _seki_chardev_devt_any);
+
+    cdev_del(&_seki_chardev_cdev_any);
+
+    unregister_chrdev_region(_seki_chardev_devt_any, 1);
+}
+
 int seki_chardev_create_file_seki_device(SekiData *device_data)
 {
     int rv;
@@ -240,6 +1296,43 @@ err_cdel:
     return rv;
 }
 
+// After seki_device_unpublish(). File ops blocked on the device look at
+// used again and leave.
+void seki_chardev_wake_files(SekiData *device_data)
+{
+    SekiFile *file;
+
+    // Files in the list still hold their ring
+    spin_lock(&device_data->files_lock);
+    list_for_each_entry(file, &device_data->files, node) {
+        SekiRing *ring = READ_ONCE(file->ring);
+
+        if (ring)
+            wake_up_all(&ring->cq_wait);
+        wake_up_all(&file->event_wait);
+    }
+    spin_unlock(&device_data->files_lock);
+
+    wake_up_all(&device_data->oring_wait);
+    wake_up_all(&device_data->stage_wait);
+    wake_up_all(&device_data->dma_bounce_wait);
+}
+
+// After seki_device_unpublish(), before the BARs are unmapped
+void seki_chardev_revoke_mappings(SekiData *device_data)
+{
+    loff_t ctl_offset = (loff_t)device_data->device_num * 0x100 << PAGE_SHIFT;
+
+    synchronize_srcu(&_seki_chardev_mmap_srcu);
+
+    unmap_mapping_range(&_seki_chardev_ctl_mapping, ctl_offset,
+                        0x100 << PAGE_SHIFT, 1);
+
+    // Rings and the telemetry page are plain memory and stay mapped, the
+    // -ENODEV completions of the jobs in flight still have to be read
+    unmap_mapping_range(&device_data->mapping, 0, SEKI_MMAP_RING_OFFSET, 1);
+}
+
 void seki_chardev_remove_file_seki_device(SekiData *device_data)
 {
     dev_t num;
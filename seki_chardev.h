@@ -20,8 +20,12 @@ int seki_chardev_register_file_ctl(void);
 void seki_chardev_unregister_file_ctl(void);
 int seki_chardev_register_file_seki_device(void);
 void seki_chardev_unregister_file_seki_device(void);
+int seki_chardev_register_file_any(void);
+void seki_chardev_unregister_file_any(void);
 int seki_chardev_create_file_seki_device(SekiData *device_data);
 void seki_chardev_remove_file_seki_device(SekiData *device_data);
+void seki_chardev_revoke_mappings(SekiData *device_data);
+void seki_chardev_wake_files(SekiData *device_data);
 
 
 #endif // SEKI_CHARDEV_H
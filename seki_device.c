@@ -0,0 +1,310 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_device.c>
+ * Device registry and the setup shared by PCI and emulated devices.
+ *
+ * SekiData is allocated on probe and refcounted. The IDR holds one
+ * reference from seki_device_create() until remove, every open file
+ * holds another one, so a file outlives the card it was opened on.
+ * Lookups only take rcu_read_lock(), the mutex serializes probe and
+ * remove. Memory is freed after a grace period so lookups may race
+ * with the last put.
+ *
+ * File ops run between seki_device_enter() and seki_device_leave().
+ * Teardown waits for them before the queues, DMA and the BARs go.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/idr.h>
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/slab.h>
+
+#include "seki_device_defs.h"
+#include "seki_alloc.h"
+#include "seki_chardev.h"
+#include "seki_device.h"
+#include "seki_dma.h"
+#include "seki_irq.h"
+#include "seki_procfs.h"
+#include "seki_queue.h"
+#include "seki_oring.h"
+#include "seki_stage.h"
+#include "seki_stats.h"
+#include "seki_telemetry.h"
+#include "seki_trace.h"
+
+DEFINE_IDR(_seki_device_idr);
+unsigned int _seki_device_count = 0;
+
+static DEFINE_MUTEX(_seki_device_lock);
+
+// procfs reads the stats of devices it finds under rcu_read_lock()
+static void seki_device_free_rcu(struct rcu_head *rcu)
+{
+    SekiData *device_data = container_of(rcu, SekiData, rcu);
+
+    seki_stats_uninit_device(device_data);
+    seki_telemetry_uninit_device(device_data);
+
+    kfree(device_data);
+}
+
+static void seki_device_release(struct kref *ref)
+{
+    SekiData *device_data = container_of(ref, SekiData, ref);
+
+    // Files give their chunks back on release, the pools go with the
+    // last of them
+    seki_alloc_uninit_device(device_data);
+    cleanup_srcu_struct(&device_data->ops_srcu);
+
+    call_rcu(&device_data->rcu, seki_device_free_rcu);
+}
+
+// Reserves a device number. Lookups see NULL until it is published.
+SekiData *seki_device_create(struct device *device)
+{
+    SekiData *device_data;
+    int dev_num;
+
+    device_data = kzalloc_node(sizeof(*device_data), GFP_KERNEL,
+                               dev_to_node(device));
+    if (!device_data)
+        return 0;
+
+    kref_init(&device_data->ref);
+    device_data->device = device;
+    device_data->node = dev_to_node(device);
+    address_space_init_once(&device_data->mapping);
+    spin_lock_init(&device_data->ctrl_mmio_lock);
+    spin_lock_init(&device_data->input_mmio_lock);
+    spin_lock_init(&device_data->output_mmio_lock);
+    INIT_LIST_HEAD(&device_data->files);
+    spin_lock_init(&device_data->files_lock);
+    atomic_set(&device_data->nr_files, 0);
+
+    if (init_srcu_struct(&device_data->ops_srcu)) {
+        kfree(device_data);
+        return 0;
+    }
+
+    if (seki_stats_init_device(device_data)) {
+        cleanup_srcu_struct(&device_data->ops_srcu);
+        kfree(device_data);
+        return 0;
+    }
+
+    mutex_lock(&_seki_device_lock);
+    dev_num = idr_alloc(&_seki_device_idr, NULL, 0, SEKI_MAX_PCI_DEVICES,
+                        GFP_KERNEL);
+    mutex_unlock(&_seki_device_lock);
+
+    if (dev_num < 0) {
+        pr_err("No device number left, %d devices max\n",
+               SEKI_MAX_PCI_DEVICES);
+        seki_stats_uninit_device(device_data);
+        cleanup_srcu_struct(&device_data->ops_srcu);
+        kfree(device_data);
+        return 0;
+    }
+
+    device_data->device_num = dev_num;
+
+    return device_data;
+}
+
+void seki_device_publish(SekiData *device_data)
+{
+    mutex_lock(&_seki_device_lock);
+    WRITE_ONCE(device_data->used, 1);
+    idr_replace(&_seki_device_idr, device_data, device_data->device_num);
+    ++_seki_device_count;
+    mutex_unlock(&_seki_device_lock);
+}
+
+// No new lookups after this, holders of a reference keep the memory
+void seki_device_unpublish(SekiData *device_data)
+{
+    mutex_lock(&_seki_device_lock);
+    if (device_data->used)
+        --_seki_device_count;
+    WRITE_ONCE(device_data->used, 0);
+    idr_remove(&_seki_device_idr, device_data->device_num);
+    mutex_unlock(&_seki_device_lock);
+}
+
+SekiData *seki_device_get(unsigned int dev_num)
+{
+    SekiData *device_data;
+
+    rcu_read_lock();
+    device_data = idr_find(&_seki_device_idr, dev_num);
+    if (device_data && !seki_device_hold(device_data))
+        device_data = 0;
+    rcu_read_unlock();
+
+    return device_data;
+}
+
+// For pointers found under RCU, fails once the device is going away
+int seki_device_hold(SekiData *device_data)
+{
+    if (!READ_ONCE(device_data->used))
+        return 0;
+
+    return kref_get_unless_zero(&device_data->ref);
+}
+
+void seki_device_put(SekiData *device_data)
+{
+    kref_put(&device_data->ref, seki_device_release);
+}
+
+// Returns the index for seki_device_leave(), or -ENODEV once removed
+int seki_device_enter(SekiData *device_data)
+{
+    int idx = srcu_read_lock(&device_data->ops_srcu);
+
+    if (!READ_ONCE(device_data->used)) {
+        srcu_read_unlock(&device_data->ops_srcu, idx);
+        return -ENODEV;
+    }
+
+    return idx;
+}
+
+void seki_device_leave(SekiData *device_data, int idx)
+{
+    srcu_read_unlock(&device_data->ops_srcu, idx);
+}
+
+// Common setup, once the bus specific code has filled in the BARs. The
+// device is published when this succeeds.
+int seki_device_setup(SekiData *device_data)
+{
+    unsigned int slot = device_data->slot;
+    int rv;
+
+    rv = seki_alloc_init_device(device_data);
+    if (rv) {
+        pr_err("Failed to init window allocator for device on slot %d\n",
+               slot);
+        return rv;
+    }
+
+    // Before the queues, which split what is below the slots
+    rv = seki_stage_init_device(device_data);
+    if (rv) {
+        pr_err("Failed to init staging slots for device on slot %d\n", slot);
+        return rv;
+    }
+
+    rv = seki_dma_init_device(device_data);
+    if (rv) {
+        pr_err("Failed to init DMA for device on slot %d\n", slot);
+        goto err_uninit_dma;
+    }
+
+    rv = seki_queue_init_device(device_data);
+    if (rv) {
+        pr_err("Failed to init queues for device on slot %d\n", slot);
+        goto err_uninit_dma;
+    }
+
+    // Before interrupts, which may wake its readers
+    seki_oring_init_device(device_data);
+
+    rv = seki_irq_init_device(device_data);
+    if (rv) {
+        pr_err("Failed to init interrupts for device on slot %d\n", slot);
+        goto err_uninit_oring;
+    }
+
+    rv = seki_telemetry_init_device(device_data);
+    if (rv) {
+        pr_err("Failed to init telemetry for device on slot %d\n", slot);
+        goto err_uninit_irq;
+    }
+
+    rv = seki_procfs_create_file_device(device_data);
+    if (rv) {
+        pr_err("Failed to create procfs file for device on slot %d\n", slot);
+        goto err_stop_telemetry;
+    }
+
+    rv = seki_chardev_create_file_seki_device(device_data);
+    if (rv) {
+        pr_err("Failed to create chardev for device on slot %d\n", slot);
+        goto err_uninit_procfs;
+    }
+
+    // Visible to lookups from now on
+    seki_device_publish(device_data);
+
+    trace_seki_probe(device_data->device_num, slot, device_data->nr_queues,
+                     device_data->nr_irq_vectors);
+
+    return 0;
+
+    // Errors:
+err_uninit_procfs:
+    seki_procfs_remove_file_device(device_data);
+
+err_stop_telemetry:
+    seki_telemetry_stop_device(device_data);
+
+err_uninit_irq:
+    seki_irq_uninit_device(device_data);
+
+err_uninit_oring:
+    seki_oring_uninit_device(device_data);
+    seki_queue_uninit_device(device_data);
+
+err_uninit_dma:
+    seki_dma_uninit_device(device_data);
+
+    seki_stage_uninit_device(device_data);
+
+    // The window allocators go with the last reference
+    return rv;
+}
+
+// Undoes seki_device_setup(), the BARs are still there when it returns
+void seki_device_teardown(SekiData *device_data)
+{
+    trace_seki_remove(device_data->device_num);
+
+    // No new lookups, open files keep their reference
+    seki_device_unpublish(device_data);
+
+    // File ops already in progress see used and leave, new ones fail
+    seki_chardev_wake_files(device_data);
+    synchronize_srcu(&device_data->ops_srcu);
+
+    // Mappings of the BARs go before the BARs do
+    seki_chardev_revoke_mappings(device_data);
+
+    seki_chardev_remove_file_seki_device(device_data);
+
+    seki_procfs_remove_file_device(device_data);
+
+    seki_telemetry_stop_device(device_data);
+
+    seki_irq_uninit_device(device_data);
+
+    seki_oring_uninit_device(device_data);
+
+    seki_queue_uninit_device(device_data);
+
+    seki_stage_uninit_device(device_data);
+
+    seki_dma_uninit_device(device_data);
+}
@@ -0,0 +1,40 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_device.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_DEVICE_H
+#define SEKI_DEVICE_H
+
+#include <linux/idr.h>
+
+struct SekiData;
+struct device;
+
+// Device number -> SekiData. Readers walk it under rcu_read_lock() and
+// must skip entries that are NULL (probing) or not used (going away).
+extern struct idr _seki_device_idr;
+extern unsigned int _seki_device_count;
+
+struct SekiData *seki_device_create(struct device *device);
+void seki_device_publish(struct SekiData *device_data);
+void seki_device_unpublish(struct SekiData *device_data);
+
+int seki_device_setup(struct SekiData *device_data);
+void seki_device_teardown(struct SekiData *device_data);
+
+struct SekiData *seki_device_get(unsigned int dev_num);
+int seki_device_hold(struct SekiData *device_data);
+void seki_device_put(struct SekiData *device_data);
+
+int seki_device_enter(struct SekiData *device_data);
+void seki_device_leave(struct SekiData *device_data, int idx);
+
+
+#endif // SEKI_DEVICE_H
@@ -12,20 +12,143 @@
 #ifndef SEKI_DEVICE_DEFS_H
 #define SEKI_DEVICE_DEFS_H
 
+#include <linux/atomic.h>
+#include <linux/bitmap.h>
+#include <linux/completion.h>
+#include <linux/fs.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/mutex.h>
+#include <linux/rcupdate.h>
 #include <linux/spinlock.h>
+#include <linux/srcu.h>
+#include <linux/types.h>
+#include <linux/wait.h>
+#include <linux/workqueue.h>
 
 // Forward declaration
 struct proc_dir_entry;
+struct pci_dev;
+struct device;
+struct SekiDmaDesc;
+struct SekiDmaEngine;
+struct SekiIocopy;
+struct SekiHwDesc;
+struct SekiHwCqe;
+struct SekiRing;
+struct SekiChain;
+struct SekiChunk;
+struct SekiBufferCache;
+struct SekiSchedTenant;
+struct SekiStats;
+struct eventfd_ctx;
+struct gen_pool;
+struct page;
 
 #define SEKI_DRIVER_NAME        "seki_emu"
-#define SEKI_MAX_PCI_DEVICES    4       // I don't believe you can plug 4 more
+#define SEKI_MAX_PCI_DEVICES    256     // Device numbers, i.e. minors
 #define SEKI_VENDOR_ID          0xFA58  // This is an unoccupied vendor id
 #define SEKI_DEVICE_ID          0x0961  // Random
+#define SEKI_MAX_QUEUES         16      // Hardware job queues per device
+#define SEKI_QUEUE_DEPTH        256     // Jobs in flight per hardware queue
+#define SEKI_DMA_BOUNCE_SLOTS   4       // read()/write() callers at once
+#define SEKI_MAX_STAGE_SLOTS    32      // Fits the bitmaps in SekiData
+#define SEKI_SCHED_CLASSES      3       // SEKI_SCHED_* in seki_uapi.h
 
 #define SEKI_UNUSED(var)        ((void)(var))
 
+struct SekiData;
+
+// A job in flight on a hardware queue, indexed by tag
+typedef struct SekiQueueJob {
+    struct SekiRing         *ring;      // Where the completion goes, or
+    struct SekiChain        *chain;     // the chain it is part of
+    struct SekiSchedTenant  *tenant;    // Held by the ring
+    u64                     user_data;  // Index in the chain for chains
+    u64                     queue_ns;   // Handed to the driver
+    u64                     submit_ns;  // Handed to the device
+    u64                     deadline_ns;    // U64_MAX if none
+    unsigned int            sched_class;
+    bool                    stream;     // Counted in oring_jobs
+} SekiQueueJob;
+
+// A hardware job queue. Submitters and the completion path only share
+// the tag bitmap, which is updated atomically.
+typedef struct SekiQueue {
+    struct SekiData *device_data;
+    unsigned int    index;
+
+    // Slice of the input window for kernel side staging
+    unsigned long   input_offset;
+    unsigned long   input_length;
+
+    spinlock_t          sq_lock;    // And the software queue, irqsave
+    struct SekiHwDesc   *sq;
+    dma_addr_t          sq_bus;
+    u32                 sq_tail;    // Free running, as written to SQ_TAIL
+
+    spinlock_t          cq_lock;
+    struct SekiHwCqe    *cq;
+    dma_addr_t          cq_bus;
+    u32                 cq_head;    // Free running, as written to CQ_HEAD
+
+    DECLARE_BITMAP(tags, SEKI_QUEUE_DEPTH);
+    SekiQueueJob        *jobs;
+
+    u64                 mean_service_ns;    // EWMA, for hybrid polling
+
+    // Software queue in front of the SQ, see seki_sched.c
+    struct list_head    sched_active[SEKI_SCHED_CLASSES];   // Entities
+    u64                 sched_vtime[SEKI_SCHED_CLASSES];
+    unsigned int        sched_pending[SEKI_SCHED_CLASSES];
+    atomic_t            sched_inflight[SEKI_SCHED_CLASSES];
+
+    atomic_long_t   completions;    // Completion interrupts seen
+} SekiQueue;
+
+// An interrupt vector, serving queues (index % nr_irq_vectors)
+typedef struct SekiIrqVector {
+    struct SekiData *device_data;
+    unsigned int    index;
+    unsigned int    irq;
+    u32             status_mask;    // SEKI_IRQ_* bits it handles
+    char            name[24];
+} SekiIrqVector;
+
+// Per open file of /dev/seki%d
+typedef struct SekiFile {
+    struct SekiData     *device_data;
+    struct list_head    node;           // In SekiData.files
+    struct rcu_head     rcu;
+
+    spinlock_t          lock;
+    struct eventfd_ctx  *eventfd;       // Signaled on completions, optional
+    wait_queue_head_t   event_wait;     // poll() waiters
+
+    // Of the jobs of this file, see seki_irq_notify_file()
+    atomic_long_t       completions[SEKI_MAX_QUEUES];
+    unsigned long       completions_seen[SEKI_MAX_QUEUES];
+
+    struct SekiRing     *ring;          // Job rings, once set up
+    unsigned int        poll_mode;      // SEKI_POLL_*
+
+    struct mutex        chunks_lock;
+    struct list_head    chunks;         // SekiChunk, window chunks owned
+
+    struct SekiBufferCache  *buffers;   // Registered buffers, once any
+    struct SekiSchedTenant  *sched;     // Class, weight & stats
+
+    struct mutex        chains_lock;
+    struct list_head    chains;         // SekiChain, awaiting CHAIN_STATUS
+    unsigned int        nr_chains;
+    u64                 next_chain_id;
+} SekiFile;
+
 typedef struct SekiData {
-    unsigned int    used;       // indicating if this struct is used
+    unsigned int    used;       // Published and not being removed
+    struct kref     ref;        // See seki_device.c
+    struct rcu_head rcu;
+    struct srcu_struct ops_srcu;    // File ops, see seki_device_enter()
     unsigned int    slot;
 
     unsigned long   ctrl_mmio_physical_addr;
@@ -44,17 +167,81 @@ typedef struct SekiData {
 
     unsigned int    device_num;
 
+    struct pci_dev  *pci_dev;
+    struct device   *device;    // The one handed to the DMA API
+    int             node;       // NUMA node, or NUMA_NO_NODE
+
     struct proc_dir_entry  *proc_entry;
     struct cdev            *char_dev;
+    struct address_space   mapping;     // Of every seki%d file, see
+                                        // seki_chardev_revoke_mappings
 
     // Locks are for write only
     spinlock_t      ctrl_mmio_lock;
     spinlock_t      input_mmio_lock;
     spinlock_t      output_mmio_lock;
-} SekiData;
 
-extern unsigned int _seki_device_count;
-extern SekiData _seki_data_array[SEKI_MAX_PCI_DEVICES];
-extern int      _seki_device_number_used_map[SEKI_MAX_PCI_DEVICES];
+    // DMA engine, one descriptor table per device
+    struct mutex                dma_lock;
+    struct SekiDmaDesc          *dma_desc_table;
+    dma_addr_t                  dma_desc_table_bus;
+    const struct SekiDmaEngine  *dma_engine;
+    const struct SekiIocopy     *iocopy;    // CPU copies to the input window
+    struct completion           dma_done;   // Signaled from the IRQ
+    u32                         dma_status;
+    unsigned int                dma_failed; // Would not stop, see seki_dma.c
+
+    // Coherent bounce buffers for read() & write(), see seki_dma.c
+    void                *dma_bounce[SEKI_DMA_BOUNCE_SLOTS];
+    dma_addr_t          dma_bounce_bus[SEKI_DMA_BOUNCE_SLOTS];
+    unsigned long       dma_bounce_busy;    // Bitmap of slots in use
+    wait_queue_head_t   dma_bounce_wait;
+
+    // Queues & interrupts
+    unsigned int        nr_queues;
+    SekiQueue           queues[SEKI_MAX_QUEUES];
+    unsigned int        *cpu_queue_map;     // nr_cpu_ids entries
+    unsigned int        nr_irq_vectors;     // 0 when polling
+    SekiIrqVector       irq_vectors[SEKI_MAX_QUEUES];
+
+    // Per-CPU, see seki_stats.c
+    struct SekiStats __percpu   *stats;
+
+    // Window allocators, see seki_alloc.c
+    struct gen_pool     *input_pool;
+    struct gen_pool     *output_pool;
+
+    // Staging slots at the top of the input window, see seki_stage.c
+    unsigned int        nr_stage_slots;     // 0 when off
+    unsigned long       stage_offset;       // Input window below is free
+    unsigned long       stage_slot_size;
+    unsigned long       stage_busy;         // Taken by a submitter
+    unsigned long       stage_handed;       // Owned by the device
+    u32                 stage_seq[SEKI_MAX_STAGE_SLOTS];    // Hand overs
+    wait_queue_head_t   stage_wait;
+
+    // Output ring in a chunk of one file, see seki_oring.c
+    struct mutex        oring_lock;
+    struct SekiFile     *oring_file;        // Owner, 0 when off
+    struct SekiSchedTenant *oring_tenant;   // Of the owner
+    atomic_t            oring_jobs;         // Stream jobs on the device
+    struct SekiChunk    *oring_chunk;       // Pinned while in use
+    u32                 oring_size;
+    u32                 oring_watermark;
+    u32                 oring_head;         // As written to ORING_HEAD
+    wait_queue_head_t   oring_wait;
+
+    // Read only page for collectors, see seki_telemetry.c
+    struct page         *telemetry_page;
+    struct delayed_work telemetry_work;
+    struct mutex        telemetry_lock;
+    unsigned int        telemetry_live;     // Refreshing allowed
+    atomic_t            telemetry_users;    // Mappings
+
+    // Open files, RCU protected for the IRQ path
+    struct list_head    files;
+    spinlock_t          files_lock;
+    atomic_t            nr_files;           // For seki_dispatch.c
+} SekiData;
 
 #endif // SEKI_DEVICE_DEFS_H
@@ -0,0 +1,81 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_dispatch.c>
+ * Device selection for /dev/seki-any.
+ *
+ * Window chunks, rings and mappings all belong to one card, so an open
+ * of seki-any is bound to a card for its whole life. The card is the
+ * one with the lowest cost: jobs in flight plus a weight per open file,
+ * doubled when it hangs off another NUMA node than the opening CPU.
+ *
+ ***************************************************************************/
+
+#include <linux/kernel.h>
+#include <linux/bitmap.h>
+#include <linux/device.h>
+#include <linux/idr.h>
+#include <linux/topology.h>
+
+#include "seki_device_defs.h"
+#include "seki_device.h"
+#include "seki_dispatch.h"
+
+// An open file is a worker that is about to submit
+#define SEKI_DISPATCH_FILE_WEIGHT   (SEKI_QUEUE_DEPTH / 4)
+
+unsigned long seki_dispatch_device_load(SekiData *device_data)
+{
+    unsigned long load = 0;
+
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q)
+        load += bitmap_weight(device_data->queues[q].tags, SEKI_QUEUE_DEPTH);
+
+    return load;
+}
+
+// Returns the device with a reference held
+SekiData *seki_dispatch_pick_device(void)
+{
+    SekiData *device_data;
+    SekiData *best;
+    unsigned long best_cost;
+    int node = numa_node_id();
+    int id;
+
+retry:
+    best = 0;
+    best_cost = ULONG_MAX;
+
+    rcu_read_lock();
+    idr_for_each_entry(&_seki_device_idr, device_data, id) {
+        unsigned long cost;
+
+        if (!READ_ONCE(device_data->used))
+            continue;
+
+        cost = seki_dispatch_device_load(device_data) + 1 +
+               atomic_read(&device_data->nr_files) *
+               SEKI_DISPATCH_FILE_WEIGHT;
+
+        if (device_data->node != NUMA_NO_NODE && device_data->node != node)
+            cost *= 2;
+
+        if (cost < best_cost) {
+            best = device_data;
+            best_cost = cost;
+        }
+    }
+
+    // Lost a race with remove, pick again among the rest
+    if (best && !seki_device_hold(best)) {
+        rcu_read_unlock();
+        goto retry;
+    }
+    rcu_read_unlock();
+
+    return best;
+}
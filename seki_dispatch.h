@@ -0,0 +1,21 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_dispatch.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_DISPATCH_H
+#define SEKI_DISPATCH_H
+
+struct SekiData;
+
+unsigned long seki_dispatch_device_load(struct SekiData *device_data);
+struct SekiData *seki_dispatch_pick_device(void);
+
+
+#endif // SEKI_DISPATCH_H
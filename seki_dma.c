@@ -0,0 +1,805 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_dma.c>
+ * Scatter-gather DMA between pinned user pages and the BAR windows.
+ *
+ * A user buffer is pinned and mapped in rounds of SEKI_DMA_MAX_PAGES,
+ * each round becomes one descriptor table handed to the engine. The
+ * software engine does the same job with the CPU, so the submission path
+ * can be exercised and measured without the hardware engine.
+ *
+ * read() and write() go through a pool of coherent bounce buffers
+ * instead, so nothing is pinned or allocated per call. Each caller gets
+ * a slot and copies to or from userspace without holding the engine,
+ * so the copies of one caller overlap the transfers of another.
+ *
+ * splice() and sendfile() from the output window skip the copy. The
+ * engine fills newly allocated pages that then go to the pipe, and on to
+ * a socket, without being touched again.
+ *
+ * A transfer that times out is stopped. If the engine does not stop the
+ * device is marked failed: nothing is started on it anymore, and pages
+ * and mappings it may still be using are leaked instead of freed.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/module.h>
+#include <linux/dma-mapping.h>
+#include <linux/delay.h>
+#include <linux/highmem.h>
+#include <linux/jiffies.h>
+#include <linux/mm.h>
+#include <linux/pipe_fs_i.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/splice.h>
+#include <linux/uaccess.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_buffer.h"
+#include "seki_dma.h"
+#include "seki_iocopy.h"
+#include "seki_stats.h"
+#include "seki_trace.h"
+
+static bool dma_emulate;
+module_param(dma_emulate, bool, 0444);
+MODULE_PARM_DESC(dma_emulate,
+                 "Use the software DMA engine even if the device has one");
+
+// Hardware engine
+// Registered buffers and splice pages are mapped already, one descriptor
+// per run of pages contiguous on the bus
+static int seki_dma_hw_fill_mapped(SekiDmaDesc *desc, SekiDmaJob *job,
+                                   u32 flags)
+{
+    unsigned long remaining = job->length;
+    unsigned long device_offset = job->device_offset;
+    unsigned int page_offset = job->first_page_offset;
+    dma_addr_t next = 0;
+    int count = 0;
+
+    for (unsigned int i = 0; i < job->nr_pages && remaining; ++i) {
+        dma_addr_t bus = job->page_bus[i] + page_offset;
+        u32 chunk = min_t(unsigned long, PAGE_SIZE - page_offset,
+                          remaining);
+
+        if (count && bus == next) {
+            le32_add_cpu(&desc[count - 1].length, chunk);
+        } else {
+            desc[count].host_addr     = cpu_to_le64(bus);
+            desc[count].device_offset = cpu_to_le64(device_offset);
+            desc[count].length        = cpu_to_le32(chunk);
+            desc[count].flags         = cpu_to_le32(flags);
+            ++count;
+        }
+
+        next           = bus + chunk;
+        device_offset += chunk;
+        remaining     -= chunk;
+        page_offset    = 0;
+    }
+
+    desc[count - 1].flags |= cpu_to_le32(SEKI_DMA_DESC_LAST);
+
+    return count;
+}
+
+// After a timeout. Clears a late DONE or ERROR too, so the next job does
+// not take it for its own.
+static void seki_dma_hw_stop(SekiData *device_data)
+{
+    unsigned long timeout = jiffies + msecs_to_jiffies(SEKI_DMA_STOP_MS);
+
+    seki_reg_write(device_data, SEKI_REG_DMA_CONTROL, 0);
+
+    while (seki_reg_read(device_data, SEKI_REG_DMA_STATUS) &
+           SEKI_DMA_STATUS_BUSY) {
+        if (time_after(jiffies, timeout)) {
+            pr_err("DMA engine of dev %d does not stop, disabling it\n",
+                   device_data->device_num);
+            WRITE_ONCE(device_data->dma_failed, 1);
+            return;
+        }
+
+        usleep_range(10, 50);
+    }
+
+    seki_reg_write(device_data, SEKI_REG_DMA_STATUS,
+                   SEKI_DMA_STATUS_ERROR | SEKI_DMA_STATUS_DONE);
+}
+
+static int seki_dma_hw_wait(SekiData *device_data)
+{
+    unsigned long timeout = jiffies + msecs_to_jiffies(SEKI_DMA_TIMEOUT_MS);
+    u32 status;
+
+    // The IRQ handler acknowledges and records the status for us
+    if (device_data->nr_irq_vectors) {
+        if (!wait_for_completion_timeout(&device_data->dma_done,
+                msecs_to_jiffies(SEKI_DMA_TIMEOUT_MS))) {
+            pr_err("DMA timeout on dev %d\n", device_data->device_num);
+            seki_dma_hw_stop(device_data);
+            return -ETIMEDOUT;
+        }
+
+        return (device_data->dma_status & SEKI_DMA_STATUS_ERROR) ? -EIO : 0;
+    }
+
+    for (;;) {
+        status = seki_reg_read(device_data, SEKI_REG_DMA_STATUS);
+
+        if (status & SEKI_DMA_STATUS_ERROR) {
+            seki_reg_write(device_data, SEKI_REG_DMA_STATUS,
+                           SEKI_DMA_STATUS_ERROR | SEKI_DMA_STATUS_DONE);
+            return -EIO;
+        }
+
+        if (status & SEKI_DMA_STATUS_DONE) {
+            seki_reg_write(device_data, SEKI_REG_DMA_STATUS,
+                           SEKI_DMA_STATUS_DONE);
+            return 0;
+        }
+
+        if (time_after(jiffies, timeout)) {
+            pr_err("DMA timeout on dev %d\n", device_data->device_num);
+            seki_dma_hw_stop(device_data);
+            return -ETIMEDOUT;
+        }
+
+        usleep_range(10, 50);
+    }
+}
+
+static int seki_dma_hw_start(SekiData *device_data, SekiDmaJob *job)
+{
+    SekiDmaDesc *desc = device_data->dma_desc_table;
+    struct scatterlist *sg;
+    unsigned long device_offset = job->device_offset;
+    u32 flags = job->to_device ? SEKI_DMA_DESC_TO_DEVICE : 0;
+    int count = job->bounce ? 1 : job->sg_count;
+    int i;
+
+    if (device_data->dma_failed)
+        return -EIO;
+
+    if (job->page_bus)
+        count = seki_dma_hw_fill_mapped(desc, job, flags);
+
+    if (job->bounce) {
+        desc->host_addr     = cpu_to_le64(job->bounce_bus);
+        desc->device_offset = cpu_to_le64(device_offset);
+        desc->length        = cpu_to_le32(job->length);
+        desc->flags         = cpu_to_le32(flags | SEKI_DMA_DESC_LAST);
+    }
+
+    for_each_sg(job->sgt.sgl, sg, job->sg_count, i) {
+        desc[i].host_addr     = cpu_to_le64(sg_dma_address(sg));
+        desc[i].device_offset = cpu_to_le64(device_offset);
+        desc[i].length        = cpu_to_le32(sg_dma_len(sg));
+        desc[i].flags         = cpu_to_le32(flags |
+                ((i == job->sg_count - 1) ? SEKI_DMA_DESC_LAST : 0));
+
+        device_offset += sg_dma_len(sg);
+    }
+
+    reinit_completion(&device_data->dma_done);
+
+    // Table must be visible before the engine is started
+    wmb();
+
+    seki_reg_write(device_data, SEKI_REG_DMA_DESC_ADDR_LO,
+                   lower_32_bits(device_data->dma_desc_table_bus));
+    seki_reg_write(device_data, SEKI_REG_DMA_DESC_ADDR_HI,
+                   upper_32_bits(device_data->dma_desc_table_bus));
+    seki_reg_write(device_data, SEKI_REG_DMA_DESC_COUNT, count);
+    seki_reg_write(device_data, SEKI_REG_DMA_CONTROL, SEKI_DMA_CONTROL_START);
+
+    return 0;
+}
+
+static const SekiDmaEngine seki_dma_engine_hw = {
+    .name   = "hardware",
+    .start  = seki_dma_hw_start,
+    .wait   = seki_dma_hw_wait,
+};
+
+// Software stand-in, walks the pinned pages with the CPU. Done by the
+// time start() returns. The pages are not DMA mapped for it.
+static int seki_dma_sw_start(SekiData *device_data, SekiDmaJob *job)
+{
+    u8 __iomem *window;
+    unsigned long remaining = job->length;
+    unsigned long device_offset = job->device_offset;
+    unsigned int page_offset = job->first_page_offset;
+
+    window = job->to_device ? device_data->input_mmio_virtual_addr
+                            : device_data->output_mmio_virtual_addr;
+
+    if (job->bounce) {
+        if (job->to_device)
+            seki_iocopy_toio(device_data, window + device_offset,
+                             job->bounce, job->length);
+        else
+            memcpy_fromio(job->bounce, window + device_offset, job->length);
+
+        return 0;
+    }
+
+    for (unsigned int i = 0; i < job->nr_pages && remaining; ++i) {
+        size_t chunk = min_t(unsigned long, PAGE_SIZE - page_offset,
+                             remaining);
+        u8 *va = kmap_atomic(job->pages[i]);
+
+        if (job->to_device)
+            seki_iocopy_toio(device_data, window + device_offset,
+                             va + page_offset, chunk);
+        else
+            memcpy_fromio(va + page_offset, window + device_offset, chunk);
+
+        kunmap_atomic(va);
+
+        remaining     -= chunk;
+        device_offset += chunk;
+        page_offset    = 0;
+    }
+
+    return 0;
+}
+
+static int seki_dma_sw_wait(SekiData *device_data)
+{
+    SEKI_UNUSED(device_data);
+
+    return 0;
+}
+
+static const SekiDmaEngine seki_dma_engine_sw = {
+    .name   = "software",
+    .start  = seki_dma_sw_start,
+    .wait   = seki_dma_sw_wait,
+};
+
+// Pinning & mapping
+static void seki_dma_release_job(SekiData *device_data, SekiDmaJob *job)
+{
+    enum dma_data_direction dir = job->to_device ? DMA_TO_DEVICE
+                                                 : DMA_FROM_DEVICE;
+
+    // The registered buffer or the splice keeps them. If the engine did
+    // not stop it may still be using them, so they are leaked.
+    if (job->page_bus || READ_ONCE(device_data->dma_failed)) {
+        memset(job, 0, sizeof(*job));
+        return;
+    }
+
+    if (job->sg_count)
+        dma_unmap_sg(device_data->device, job->sgt.sgl,
+                     job->sgt.orig_nents, dir);
+    if (job->sgt.sgl)
+        sg_free_table(&job->sgt);
+
+    for (unsigned int i = 0; i < job->nr_pages; ++i) {
+        if (!job->to_device)
+            set_page_dirty_lock(job->pages[i]);
+        put_page(job->pages[i]);
+    }
+    kfree(job->pages);
+
+    memset(job, 0, sizeof(*job));
+}
+
+static int seki_dma_prepare_job(SekiData *device_data, SekiDmaJob *job,
+                                unsigned long user_addr, unsigned long length)
+{
+    enum dma_data_direction dir = job->to_device ? DMA_TO_DEVICE
+                                                 : DMA_FROM_DEVICE;
+    unsigned int nr_pages;
+    int pinned;
+    int rv;
+
+    job->first_page_offset = offset_in_page(user_addr);
+    job->length = length;
+    nr_pages = DIV_ROUND_UP(job->first_page_offset + length, PAGE_SIZE);
+
+    job->pages = kmalloc_array_node(nr_pages, sizeof(*job->pages),
+                                    GFP_KERNEL, device_data->node);
+    if (!job->pages)
+        return -ENOMEM;
+
+    pinned = get_user_pages_fast(user_addr & PAGE_MASK, nr_pages,
+                                 job->to_device ? 0 : FOLL_WRITE,
+                                 job->pages);
+    if (pinned < 0) {
+        rv = pinned;
+        goto err_release;
+    }
+    job->nr_pages = pinned;
+    if (pinned != nr_pages) {
+        rv = -EFAULT;
+        goto err_release;
+    }
+
+    if (!seki_dma_maps_pages(device_data))
+        return 0;
+
+    rv = sg_alloc_table_from_pages(&job->sgt, job->pages, nr_pages,
+                                   job->first_page_offset, length,
+                                   GFP_KERNEL);
+    if (rv)
+        goto err_release;
+
+    job->sg_count = dma_map_sg(device_data->device, job->sgt.sgl,
+                               job->sgt.orig_nents, dir);
+    if (!job->sg_count) {
+        rv = -EIO;
+        goto err_release;
+    }
+
+    return 0;
+
+err_release:
+    seki_dma_release_job(device_data, job);
+    return rv;
+}
+
+// A piece of a registered buffer, nothing to pin or map
+static void seki_dma_prepare_registered(SekiDmaJob *job, SekiBuffer *buffer,
+                                        unsigned long user_addr,
+                                        unsigned long length)
+{
+    unsigned long offset = user_addr - (buffer->start & PAGE_MASK);
+    unsigned long first = offset >> PAGE_SHIFT;
+
+    job->first_page_offset = offset_in_page(offset);
+    job->length = length;
+    job->nr_pages = DIV_ROUND_UP(job->first_page_offset + length,
+                                 PAGE_SIZE);
+    job->pages = buffer->pages + first;
+    job->page_bus = buffer->page_bus + first;
+}
+
+// Mapped once for both directions, so ownership moves on every use
+static void seki_dma_sync_registered(SekiData *device_data, SekiDmaJob *job,
+                                     int for_device)
+{
+    unsigned long remaining = job->length;
+    unsigned int page_offset = job->first_page_offset;
+
+    // Not mapped, see seki_buffer_map()
+    if (!seki_dma_maps_pages(device_data))
+        return;
+
+    for (unsigned int i = 0; i < job->nr_pages && remaining; ++i) {
+        size_t chunk = min_t(unsigned long, PAGE_SIZE - page_offset,
+                             remaining);
+
+        if (for_device)
+            dma_sync_single_for_device(device_data->device,
+                                       job->page_bus[i] + page_offset,
+                                       chunk, DMA_BIDIRECTIONAL);
+        else
+            dma_sync_single_for_cpu(device_data->device,
+                                    job->page_bus[i] + page_offset,
+                                    chunk, DMA_BIDIRECTIONAL);
+
+        remaining  -= chunk;
+        page_offset = 0;
+    }
+}
+
+// Interface
+int seki_dma_submit_user(SekiFile *file,
+                         const struct seki_dma_request *request)
+{
+    SekiData *device_data = file->device_data;
+    SekiBuffer *buffer;
+    unsigned long user_addr = request->user_addr;
+    unsigned long remaining = request->length;
+    unsigned long device_offset = request->device_offset;
+    unsigned long window_length;
+    int to_device;
+    int rv = 0;
+
+    if (request->flags)
+        return -EINVAL;
+
+    switch (request->direction) {
+    case SEKI_DMA_TO_DEVICE:
+        to_device = 1;
+        window_length = device_data->input_mmio_length;
+        break;
+    case SEKI_DMA_FROM_DEVICE:
+        to_device = 0;
+        window_length = device_data->output_mmio_length;
+        break;
+    default:
+        return -EINVAL;
+    }
+
+    if (!request->length || request->length > window_length ||
+        request->device_offset > window_length - request->length)
+        return -EINVAL;
+
+    if (!access_ok((void __user *)user_addr, request->length))
+        return -EFAULT;
+
+    // Registered with SEKI_IOCTL_BUFFER_REGISTER, pinned and mapped
+    buffer = seki_buffer_get(file, user_addr, request->length);
+
+    while (remaining) {
+        SekiDmaJob job = { .to_device = to_device };
+        unsigned long chunk;
+
+        chunk = min_t(unsigned long, remaining,
+                      SEKI_DMA_MAX_PAGES * PAGE_SIZE -
+                      offset_in_page(user_addr));
+        job.device_offset = device_offset;
+
+        // Pinning runs in parallel, only the engine is serialized
+        if (buffer)
+            seki_dma_prepare_registered(&job, buffer, user_addr, chunk);
+        else
+            rv = seki_dma_prepare_job(device_data, &job, user_addr, chunk);
+        if (rv)
+            break;
+
+        if (buffer)
+            seki_dma_sync_registered(device_data, &job, 1);
+
+        rv = mutex_lock_interruptible(&device_data->dma_lock);
+        if (!rv) {
+            rv = device_data->dma_engine->start(device_data, &job);
+            if (!rv)
+                rv = device_data->dma_engine->wait(device_data);
+            mutex_unlock(&device_data->dma_lock);
+        }
+
+        if (buffer)
+            seki_dma_sync_registered(device_data, &job, 0);
+
+        seki_dma_release_job(device_data, &job);
+        trace_seki_dma(device_data->device_num, to_device, device_offset,
+                       chunk, rv);
+        if (rv) {
+            seki_stats_inc(device_data, SEKI_STAT_DMA_ERRORS);
+            break;
+        }
+
+        seki_stats_inc(device_data, SEKI_STAT_DMA_TRANSFERS);
+        if (buffer)
+            seki_stats_inc(device_data, SEKI_STAT_DMA_REGISTERED);
+        seki_stats_add(device_data, to_device ? SEKI_STAT_BYTES_IN
+                                              : SEKI_STAT_BYTES_OUT, chunk);
+
+        user_addr     += chunk;
+        device_offset += chunk;
+        remaining     -= chunk;
+    }
+
+    if (buffer)
+        seki_buffer_put(buffer);
+
+    return rv;
+}
+
+// Bounce buffers
+static int seki_dma_bounce_get(SekiData *device_data)
+{
+    unsigned int slot;
+
+    for (;;) {
+        slot = find_first_zero_bit(&device_data->dma_bounce_busy,
+                                   SEKI_DMA_BOUNCE_SLOTS);
+        if (slot < SEKI_DMA_BOUNCE_SLOTS) {
+            if (!test_and_set_bit_lock(slot, &device_data->dma_bounce_busy))
+                return slot;
+            continue;   // Lost it to someone else
+        }
+
+        if (wait_event_interruptible(device_data->dma_bounce_wait,
+                find_first_zero_bit(&device_data->dma_bounce_busy,
+                                    SEKI_DMA_BOUNCE_SLOTS) <
+                SEKI_DMA_BOUNCE_SLOTS))
+            return -ERESTARTSYS;
+    }
+}
+
+static void seki_dma_bounce_put(SekiData *device_data, unsigned int slot)
+{
+    clear_bit_unlock(slot, &device_data->dma_bounce_busy);
+    wake_up_interruptible(&device_data->dma_bounce_wait);
+}
+
+static void seki_dma_bounce_account(SekiData *device_data, int to_device,
+                                    unsigned long device_offset,
+                                    unsigned long length, int rv)
+{
+    trace_seki_dma(device_data->device_num, to_device, device_offset,
+                   length, rv);
+
+    if (rv) {
+        seki_stats_inc(device_data, SEKI_STAT_DMA_ERRORS);
+        return;
+    }
+
+    seki_stats_inc(device_data, SEKI_STAT_DMA_TRANSFERS);
+    seki_stats_add(device_data, to_device ? SEKI_STAT_BYTES_IN
+                                          : SEKI_STAT_BYTES_OUT, length);
+}
+
+// One chunk at a time through the slot. dma_lock is only held for the
+// transfer, the user copies may fault and run while the engine serves
+// other callers.
+static ssize_t seki_dma_stream(SekiData *device_data, char __user *buf,
+                               size_t count, unsigned long device_offset,
+                               int to_device)
+{
+    const SekiDmaEngine *engine = device_data->dma_engine;
+    SekiDmaJob job;
+    size_t done = 0;
+    int slot;
+    int rv = 0;
+
+    slot = seki_dma_bounce_get(device_data);
+    if (slot < 0)
+        return slot;
+
+    memset(&job, 0, sizeof(job));
+    job.to_device  = to_device;
+    job.bounce     = device_data->dma_bounce[slot];
+    job.bounce_bus = device_data->dma_bounce_bus[slot];
+
+    while (done < count) {
+        job.device_offset = device_offset + done;
+        job.length = min_t(size_t, count - done, SEKI_DMA_BOUNCE_SIZE);
+
+        if (to_device && copy_from_user(job.bounce, buf + done, job.length)) {
+            rv = -EFAULT;
+            break;
+        }
+
+        rv = mutex_lock_interruptible(&device_data->dma_lock);
+        if (rv)
+            break;
+
+        rv = engine->start(device_data, &job);
+        if (!rv)
+            rv = engine->wait(device_data);
+
+        mutex_unlock(&device_data->dma_lock);
+
+        seki_dma_bounce_account(device_data, to_device, job.device_offset,
+                                job.length, rv);
+        if (rv)
+            break;
+
+        if (!to_device && copy_to_user(buf + done, job.bounce, job.length)) {
+            rv = -EFAULT;
+            break;
+        }
+
+        done += job.length;
+    }
+
+    seki_dma_bounce_put(device_data, slot);
+
+    return done ? done : rv;
+}
+
+ssize_t seki_dma_write_user(SekiData *device_data, const char __user *buf,
+                            size_t count, unsigned long device_offset)
+{
+    return seki_dma_stream(device_data, (char __user *)buf, count,
+                           device_offset, 1);
+}
+
+ssize_t seki_dma_read_user(SekiData *device_data, char __user *buf,
+                           size_t count, unsigned long device_offset)
+{
+    return seki_dma_stream(device_data, buf, count, device_offset, 0);
+}
+
+// Splicing
+// Pages only the pipe holds, handed on as they are. Sockets take them
+// with a reference of their own.
+static const struct pipe_buf_operations seki_dma_pipe_buf_ops = {
+    .confirm    = generic_pipe_buf_confirm,
+    .release    = generic_pipe_buf_release,
+    .steal      = generic_pipe_buf_steal,
+    .get        = generic_pipe_buf_get,
+};
+
+static void seki_dma_splice_release(struct splice_pipe_desc *spd,
+                                    unsigned int i)
+{
+    put_page(spd->pages[i]);
+}
+
+// The engine writes the output window straight into fresh pages, one
+// job as big as the pipe has room for, and the pipe gets those pages.
+// The data crosses the CPU only with the software engine.
+ssize_t seki_dma_splice_read(SekiData *device_data,
+                             struct pipe_inode_info *pipe, size_t count,
+                             unsigned long device_offset)
+{
+    const SekiDmaEngine *engine = device_data->dma_engine;
+    struct page *pages[PIPE_DEF_BUFFERS];
+    struct partial_page partial[PIPE_DEF_BUFFERS];
+    dma_addr_t page_bus[PIPE_DEF_BUFFERS];
+    struct splice_pipe_desc spd = {
+        .pages          = pages,
+        .partial        = partial,
+        .nr_pages_max   = PIPE_DEF_BUFFERS,
+        .ops            = &seki_dma_pipe_buf_ops,
+        .spd_release    = seki_dma_splice_release,
+    };
+    SekiDmaJob job;
+    unsigned int nr_pages;
+    unsigned int mapped = 0;
+    ssize_t rv;
+
+    // Unlocked peek, splice_to_pipe() takes back whatever does not fit
+    nr_pages = min_t(unsigned int, DIV_ROUND_UP(count, PAGE_SIZE),
+                     READ_ONCE(pipe->buffers) - READ_ONCE(pipe->nrbufs));
+    nr_pages = min_t(unsigned int, nr_pages, PIPE_DEF_BUFFERS);
+    if (!nr_pages)
+        return -EAGAIN;
+
+    for (spd.nr_pages = 0; spd.nr_pages < nr_pages; ++spd.nr_pages) {
+        pages[spd.nr_pages] = alloc_pages_node(device_data->node,
+                                               GFP_KERNEL, 0);
+        if (!pages[spd.nr_pages])
+            break;
+    }
+    if (!spd.nr_pages)
+        return -ENOMEM;
+
+    count = min_t(size_t, count, (size_t)spd.nr_pages << PAGE_SHIFT);
+
+    for (; seki_dma_maps_pages(device_data) && mapped < spd.nr_pages;
+         ++mapped) {
+        page_bus[mapped] = dma_map_page(device_data->device, pages[mapped],
+                                        0, PAGE_SIZE, DMA_FROM_DEVICE);
+        if (dma_mapping_error(device_data->device, page_bus[mapped])) {
+            rv = -ENOMEM;
+            goto out_unmap;
+        }
+    }
+
+    memset(&job, 0, sizeof(job));
+    job.pages         = pages;
+    job.nr_pages      = spd.nr_pages;
+    job.length        = count;
+    job.device_offset = device_offset;
+    job.page_bus      = page_bus;
+
+    rv = mutex_lock_interruptible(&device_data->dma_lock);
+    if (rv)
+        goto out_unmap;
+
+    rv = engine->start(device_data, &job);
+    if (!rv)
+        rv = engine->wait(device_data);
+
+    mutex_unlock(&device_data->dma_lock);
+
+    seki_dma_bounce_account(device_data, 0, device_offset, count, rv);
+
+out_unmap:
+    // Leaked, the engine may still be writing them
+    if (rv && READ_ONCE(device_data->dma_failed))
+        return rv;
+
+    while (mapped--)
+        dma_unmap_page(device_data->device, page_bus[mapped], PAGE_SIZE,
+                       DMA_FROM_DEVICE);
+
+    if (rv) {
+        for (unsigned int i = 0; i < spd.nr_pages; ++i)
+            put_page(pages[i]);
+
+        return rv;
+    }
+
+    for (unsigned int i = 0; i < spd.nr_pages; ++i) {
+        partial[i].offset  = 0;
+        partial[i].len     = min_t(size_t, count - ((size_t)i << PAGE_SHIFT),
+                                   PAGE_SIZE);
+        partial[i].private = 0;
+    }
+
+    return splice_to_pipe(pipe, &spd);
+}
+
+int seki_dma_init_device(SekiData *device_data)
+{
+    struct device *dev = device_data->device;
+
+    mutex_init(&device_data->dma_lock);
+    init_completion(&device_data->dma_done);
+
+    if (dma_set_mask_and_coherent(dev, DMA_BIT_MASK(64)) &&
+        dma_set_mask_and_coherent(dev, DMA_BIT_MASK(32))) {
+        pr_err("No usable DMA mask for dev %d\n", device_data->device_num);
+
+        return -EIO;
+    }
+
+    device_data->dma_desc_table =
+            dma_alloc_coherent(dev, SEKI_DMA_MAX_DESCS * sizeof(SekiDmaDesc),
+                               &device_data->dma_desc_table_bus, GFP_KERNEL);
+    if (!device_data->dma_desc_table)
+        return -ENOMEM;
+
+    device_data->dma_bounce_busy = 0;
+    init_waitqueue_head(&device_data->dma_bounce_wait);
+    for (unsigned int i = 0; i < SEKI_DMA_BOUNCE_SLOTS; ++i) {
+        device_data->dma_bounce[i] =
+                dma_alloc_coherent(dev, SEKI_DMA_BOUNCE_SIZE,
+                                   device_data->dma_bounce_bus + i,
+                                   GFP_KERNEL);
+        if (!device_data->dma_bounce[i]) {
+            seki_dma_uninit_device(device_data);
+            return -ENOMEM;
+        }
+    }
+
+    if (dma_emulate ||
+        !(seki_reg_read(device_data, SEKI_REG_CAPS) & SEKI_CAP_DMA))
+        device_data->dma_engine = &seki_dma_engine_sw;
+    else
+        device_data->dma_engine = &seki_dma_engine_hw;
+
+    pr_debug("Dev %d using %s DMA engine\n", device_data->device_num,
+             device_data->dma_engine->name);
+
+    // Even with the hardware engine, for anything else that copies
+    seki_iocopy_select(device_data);
+
+    return 0;
+}
+
+// Only the hardware engine needs user pages on the bus. The software
+// one copies through kmap, and unmapping would undo its writes.
+int seki_dma_maps_pages(SekiData *device_data)
+{
+    return device_data->dma_engine == &seki_dma_engine_hw;
+}
+
+void seki_dma_uninit_device(SekiData *device_data)
+{
+    // Leaked with whatever the stuck engine was given
+    if (device_data->dma_failed) {
+        memset(device_data->dma_bounce, 0, sizeof(device_data->dma_bounce));
+        device_data->dma_desc_table = 0;
+    }
+
+    for (unsigned int i = 0; i < SEKI_DMA_BOUNCE_SLOTS; ++i) {
+        if (device_data->dma_bounce[i])
+            dma_free_coherent(device_data->device, SEKI_DMA_BOUNCE_SIZE,
+                              device_data->dma_bounce[i],
+                              device_data->dma_bounce_bus[i]);
+        device_data->dma_bounce[i] = 0;
+    }
+
+    if (device_data->dma_desc_table) {
+        dma_free_coherent(device_data->device,
+                          SEKI_DMA_MAX_DESCS * sizeof(SekiDmaDesc),
+                          device_data->dma_desc_table,
+                          device_data->dma_desc_table_bus);
+        device_data->dma_desc_table = 0;
+    }
+
+    device_data->dma_engine = 0;
+    device_data->iocopy = 0;
+}
@@ -0,0 +1,72 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_dma.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_DMA_H
+#define SEKI_DMA_H
+
+#include <linux/mm_types.h>
+#include <linux/scatterlist.h>
+
+#define SEKI_DMA_MAX_PAGES      1024    // Pinned per round, 4MB with 4K pages
+#define SEKI_DMA_MAX_DESCS      SEKI_DMA_MAX_PAGES
+#define SEKI_DMA_TIMEOUT_MS     5000
+#define SEKI_DMA_STOP_MS        100     // For BUSY to clear after a timeout
+#define SEKI_DMA_BOUNCE_SIZE    0x40000 // Per bounce slot
+
+struct SekiData;
+struct SekiFile;
+struct seki_dma_request;
+struct pipe_inode_info;
+
+// One pinned, mapped piece of a user buffer, or a bounce buffer
+typedef struct SekiDmaJob {
+    struct page     **pages;
+    unsigned int    nr_pages;
+    unsigned int    first_page_offset;
+    unsigned long   length;
+    unsigned long   device_offset;
+    int             to_device;
+
+    struct sg_table sgt;
+    int             sg_count;       // Entries after dma_map_sg
+
+    const dma_addr_t *page_bus;     // Instead of sgt for registered
+                                    // buffers and splice, pages are
+                                    // borrowed
+
+    void            *bounce;        // Instead of pages when set
+    dma_addr_t      bounce_bus;
+} SekiDmaJob;
+
+// Something that moves a SekiDmaJob between host and the windows. One
+// job at a time under dma_lock, start() may return before it is done.
+typedef struct SekiDmaEngine {
+    const char  *name;
+    int         (*start)(struct SekiData *device_data, SekiDmaJob *job);
+    int         (*wait)(struct SekiData *device_data);
+} SekiDmaEngine;
+
+int seki_dma_init_device(struct SekiData *device_data);
+void seki_dma_uninit_device(struct SekiData *device_data);
+int seki_dma_maps_pages(struct SekiData *device_data);
+int seki_dma_submit_user(struct SekiFile *file,
+                         const struct seki_dma_request *request);
+ssize_t seki_dma_write_user(struct SekiData *device_data,
+                            const char __user *buf, size_t count,
+                            unsigned long device_offset);
+ssize_t seki_dma_read_user(struct SekiData *device_data, char __user *buf,
+                           size_t count, unsigned long device_offset);
+ssize_t seki_dma_splice_read(struct SekiData *device_data,
+                             struct pipe_inode_info *pipe, size_t count,
+                             unsigned long device_offset);
+
+
+#endif // SEKI_DMA_H
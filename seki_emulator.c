@@ -0,0 +1,590 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_emulator.c>
+ * Software emulated Seki devices.
+ *
+ * With emulate=N the module registers N platform devices whose BARs are
+ * plain RAM, and sets them up with the same seki_device_setup() as real
+ * cards. A kthread per device plays the accelerator: it polls the
+ * doorbell and DMA registers in the control "BAR", runs jobs on the
+ * windows (see SEKI_EMU_OP_*), posts completions and raises interrupts
+ * from an irq_work, which calls seki_irq_dispatch() in hard irq context
+ * like a real vector would.
+ *
+ * The windows are single buddy allocations, so they are only a few MB.
+ * Bus addresses are assumed to be physical addresses, which holds for
+ * platform devices without an IOMMU.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/delay.h>
+#include <linux/dma-mapping.h>
+#include <linux/gfp.h>
+#include <linux/highmem.h>
+#include <linux/io.h>
+#include <linux/irq_work.h>
+#include <linux/kthread.h>
+#include <linux/log2.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/platform_device.h>
+#include <linux/slab.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_device.h"
+#include "seki_irq.h"
+#include "seki_stats.h"
+#include "seki_trace.h"
+#include "seki_emulator.h"
+
+#define SEKI_EMU_NAME           "seki_sw"
+#define SEKI_EMU_MAX_DEVICES    16
+#define SEKI_EMU_CTRL_SIZE      0x100000    // Same 1MB as the real BAR0
+
+static unsigned int emulate;
+module_param(emulate, uint, 0444);
+MODULE_PARM_DESC(emulate, "Number of software emulated devices to create");
+
+static unsigned int emulate_queues = 4;
+module_param(emulate_queues, uint, 0444);
+MODULE_PARM_DESC(emulate_queues, "Job queues per emulated device");
+
+static unsigned int emulate_window_kb = 4096;
+module_param(emulate_window_kb, uint, 0444);
+MODULE_PARM_DESC(emulate_window_kb,
+                 "Size of the emulated input and output windows, in KB");
+
+static unsigned int emulate_poll_us = 20;
+module_param(emulate_poll_us, uint, 0644);
+MODULE_PARM_DESC(emulate_poll_us,
+                 "How long an idle emulated device sleeps between polls");
+
+typedef struct SekiEmuDevice {
+    SekiData            *device_data;
+    struct task_struct  *thread;
+
+    u8                  *ctrl;
+    u8                  *input;
+    u8                  *output;
+    unsigned long       window_size;
+
+    // Device side ring state
+    u32                 sq_head[SEKI_MAX_QUEUES];
+    u32                 cq_tail[SEKI_MAX_QUEUES];
+
+    struct irq_work     irq_work;
+    atomic_t            irq_pending;    // SEKI_IRQ_* bits
+} SekiEmuDevice;
+
+static struct platform_device *_seki_emu_pdevs[SEKI_EMU_MAX_DEVICES];
+
+// Registers
+static inline u32 seki_emu_reg_read(SekiEmuDevice *emu, unsigned int reg)
+{
+    return le32_to_cpu(READ_ONCE(*(__le32 *)(emu->ctrl + reg)));
+}
+
+static inline void seki_emu_reg_write(SekiEmuDevice *emu, unsigned int reg,
+                                      u32 value)
+{
+    WRITE_ONCE(*(__le32 *)(emu->ctrl + reg), cpu_to_le32(value));
+}
+
+static inline u64 seki_emu_reg_read64(SekiEmuDevice *emu, unsigned int reg)
+{
+    return seki_emu_reg_read(emu, reg) |
+           (u64)seki_emu_reg_read(emu, reg + 4) << 32;
+}
+
+// Interrupts
+static void seki_emu_irq_work(struct irq_work *work)
+{
+    SekiEmuDevice *emu = container_of(work, SekiEmuDevice, irq_work);
+    SekiData *device_data = emu->device_data;
+    u32 status = atomic_xchg(&emu->irq_pending, 0);
+
+    if (!status)
+        return;
+
+    trace_seki_irq(device_data->device_num, 0, status);
+    seki_stats_inc(device_data, SEKI_STAT_INTERRUPTS);
+    seki_irq_dispatch(device_data, status);
+}
+
+static void seki_emu_raise(SekiEmuDevice *emu, u32 status)
+{
+    status &= seki_emu_reg_read(emu, SEKI_REG_IRQ_MASK);
+    if (!status)
+        return;
+
+    atomic_or(status, &emu->irq_pending);
+    irq_work_queue(&emu->irq_work);
+}
+
+// DMA engine
+static int seki_emu_copy_host(SekiEmuDevice *emu, u64 host_addr,
+                              u8 *window, unsigned long length,
+                              int to_device)
+{
+    while (length) {
+        unsigned long offset = offset_in_page(host_addr);
+        unsigned long n = min(length, PAGE_SIZE - offset);
+        u8 *page = kmap_atomic(pfn_to_page(PHYS_PFN(host_addr)));
+
+        if (to_device)
+            memcpy(window, page + offset, n);
+        else
+            memcpy(page + offset, window, n);
+
+        kunmap_atomic(page);
+
+        host_addr += n;
+        window    += n;
+        length    -= n;
+    }
+
+    return 0;
+}
+
+static int seki_emu_run_dma(SekiEmuDevice *emu)
+{
+    SekiDmaDesc *table;
+    u32 count;
+    u32 status = SEKI_DMA_STATUS_DONE;
+
+    if (!(seki_emu_reg_read(emu, SEKI_REG_DMA_CONTROL) &
+          SEKI_DMA_CONTROL_START))
+        return 0;
+
+    seki_emu_reg_write(emu, SEKI_REG_DMA_CONTROL, 0);
+    seki_emu_reg_write(emu, SEKI_REG_DMA_STATUS, SEKI_DMA_STATUS_BUSY);
+
+    table = phys_to_virt(seki_emu_reg_read64(emu,
+                                             SEKI_REG_DMA_DESC_ADDR_LO));
+    count = seki_emu_reg_read(emu, SEKI_REG_DMA_DESC_COUNT);
+
+    for (u32 i = 0; i < count; ++i) {
+        SekiDmaDesc *desc = table + i;
+        u32 flags = le32_to_cpu(desc->flags);
+        u64 offset = le64_to_cpu(desc->device_offset);
+        u32 length = le32_to_cpu(desc->length);
+        int to_device = flags & SEKI_DMA_DESC_TO_DEVICE;
+        u8 *window = to_device ? emu->input : emu->output;
+
+        if (length > emu->window_size ||
+            offset > emu->window_size - length) {
+            status = SEKI_DMA_STATUS_ERROR;
+            break;
+        }
+
+        seki_emu_copy_host(emu, le64_to_cpu(desc->host_addr),
+                           window + offset, length, to_device);
+
+        if (flags & SEKI_DMA_DESC_LAST)
+            break;
+    }
+
+    seki_emu_reg_write(emu, SEKI_REG_DMA_STATUS, status);
+    seki_emu_raise(emu, SEKI_IRQ_DMA);
+
+    return 1;
+}
+
+// Job queues
+// The input is read, hand its staging slot back before the completion
+static void seki_emu_release_slot(SekiEmuDevice *emu, u64 input_offset)
+{
+    u32 count = seki_emu_reg_read(emu, SEKI_REG_STAGE_COUNT);
+    u32 offset = seki_emu_reg_read(emu, SEKI_REG_STAGE_OFFSET);
+    u32 size = seki_emu_reg_read(emu, SEKI_REG_STAGE_SIZE);
+    unsigned int base;
+    u32 slot;
+
+    if (!count || !size || input_offset < offset)
+        return;
+
+    slot = div_u64(input_offset - offset, size);
+    if (slot >= count || slot >= SEKI_MAX_STAGE_SLOTS)
+        return;
+
+    base = SEKI_REG_STAGE_SLOT(slot);
+    if (seki_emu_reg_read(emu, base + SEKI_SREG_OWNER) !=
+        SEKI_STAGE_OWNER_DEVICE)
+        return;
+
+    seki_emu_reg_write(emu, base + SEKI_SREG_OWNER, SEKI_STAGE_OWNER_HOST);
+    seki_emu_reg_write(emu, base + SEKI_SREG_DONE,
+                       seki_emu_reg_read(emu, base + SEKI_SREG_DONE) + 1);
+}
+
+static s32 seki_emu_compute(u32 opcode, u8 *out, const u8 *in, u32 length)
+{
+    switch (opcode) {
+    case SEKI_EMU_OP_COPY:
+        memcpy(out, in, length);
+        break;
+    case SEKI_EMU_OP_INVERT:
+        for (u32 i = 0; i < length; ++i)
+            out[i] = ~in[i];
+        break;
+    default:
+        return -EOPNOTSUPP;
+    }
+
+    return 0;
+}
+
+// Output ring. -EAGAIN while the record does not fit, the job is retried
+// on the next pass.
+static s32 seki_emu_oring_append(SekiEmuDevice *emu, u64 user_data,
+                                 u32 opcode, const u8 *in, u32 length)
+{
+    u32 offset = seki_emu_reg_read(emu, SEKI_REG_ORING_OFFSET);
+    u32 size = seki_emu_reg_read(emu, SEKI_REG_ORING_SIZE);
+    u32 head = seki_emu_reg_read(emu, SEKI_REG_ORING_HEAD);
+    u32 tail = seki_emu_reg_read(emu, SEKI_REG_ORING_TAIL);
+    u32 need = ALIGN(sizeof(struct seki_oring_record) + length,
+                     SEKI_ORING_ALIGN);
+    struct seki_oring_record *record;
+    u32 pos;
+    u32 pad;
+    s32 status;
+
+    if (!(seki_emu_reg_read(emu, SEKI_REG_ORING_CONTROL) &
+          SEKI_ORING_CONTROL_ENABLE))
+        return -ENODEV;
+
+    if (!is_power_of_2(size) || size > emu->window_size ||
+        offset > emu->window_size - size || need > size)
+        return -EINVAL;
+
+    pos = tail & (size - 1);
+    pad = size - pos < need ? size - pos : 0;
+    if (size - (tail - head) < pad + need)
+        return -EAGAIN;
+
+    // Records never wrap, fill the end with padding instead
+    if (pad) {
+        record = (struct seki_oring_record *)(emu->output + offset + pos);
+        record->user_data = 0;
+        record->length = pad - sizeof(*record);
+        record->flags = SEKI_ORING_RECORD_PAD;
+        tail += pad;
+        pos = 0;
+    }
+
+    record = (struct seki_oring_record *)(emu->output + offset + pos);
+    status = seki_emu_compute(opcode, (u8 *)(record + 1), in, length);
+    if (status)
+        return status;
+
+    record->user_data = user_data;
+    record->length = length;
+    record->flags = 0;
+    tail += need;
+
+    // Records before the tail
+    smp_wmb();
+    seki_emu_reg_write(emu, SEKI_REG_ORING_TAIL, tail);
+
+    if (tail - head >= seki_emu_reg_read(emu, SEKI_REG_ORING_WATERMARK))
+        seki_emu_raise(emu, SEKI_IRQ_ORING);
+
+    return 0;
+}
+
+static s32 seki_emu_run_job(SekiEmuDevice *emu, const SekiHwDesc *desc,
+                            u32 *output_length)
+{
+    u64 input_offset = le64_to_cpu(desc->input_offset);
+    u64 output_offset = le64_to_cpu(desc->output_offset);
+    u32 input_length = le32_to_cpu(desc->input_length);
+    u32 length = min(input_length, le32_to_cpu(desc->output_length));
+    u32 opcode = le32_to_cpu(desc->opcode);
+    s32 status;
+
+    *output_length = 0;
+
+    if (input_length > emu->window_size ||
+        input_offset > emu->window_size - input_length)
+        return -EINVAL;
+
+    // output_offset is the user_data of the record
+    if (opcode & SEKI_HW_OP_STREAM) {
+        status = seki_emu_oring_append(emu, output_offset,
+                                       opcode & ~SEKI_HW_OP_STREAM,
+                                       emu->input + input_offset, length);
+    } else if (length > emu->window_size ||
+               output_offset > emu->window_size - length) {
+        status = -EINVAL;
+    } else {
+        status = seki_emu_compute(opcode, emu->output + output_offset,
+                                  emu->input + input_offset, length);
+    }
+
+    if (!status)
+        *output_length = length;
+
+    return status;
+}
+
+static int seki_emu_run_queue(SekiEmuDevice *emu, unsigned int q)
+{
+    unsigned int base = SEKI_REG_QUEUE_BASE(q);
+    SekiHwDesc *sq;
+    SekiHwCqe *cq;
+    u32 depth;
+    u32 tail;
+    int done = 0;
+
+    if (!(seki_emu_reg_read(emu, base + SEKI_QREG_CONTROL) &
+          SEKI_QUEUE_CONTROL_ENABLE)) {
+        emu->sq_head[q] = 0;
+        emu->cq_tail[q] = 0;
+        return 0;
+    }
+
+    depth = seki_emu_reg_read(emu, base + SEKI_QREG_DEPTH);
+    if (!is_power_of_2(depth))
+        return 0;
+
+    tail = seki_emu_reg_read(emu, base + SEKI_QREG_SQ_TAIL);
+    if (tail == emu->sq_head[q])
+        return 0;
+
+    // Descriptors must not be read before the doorbell
+    smp_rmb();
+
+    sq = phys_to_virt(seki_emu_reg_read64(emu, base + SEKI_QREG_SQ_ADDR_LO));
+    cq = phys_to_virt(seki_emu_reg_read64(emu, base + SEKI_QREG_CQ_ADDR_LO));
+
+    while (emu->sq_head[q] != tail) {
+        SekiHwDesc *desc = sq + (emu->sq_head[q] & (depth - 1));
+        SekiHwCqe *cqe = cq + (emu->cq_tail[q] & (depth - 1));
+        u32 output_length;
+        s32 status;
+
+        status = seki_emu_run_job(emu, desc, &output_length);
+        if (status == -EAGAIN)
+            break;      // Output ring full, the host has to consume first
+        seki_emu_release_slot(emu, le64_to_cpu(desc->input_offset));
+
+        cqe->tag           = desc->tag;
+        cqe->status        = cpu_to_le32(status);
+        cqe->output_length = cpu_to_le32(output_length);
+        cqe->reserved      = 0;
+
+        ++emu->sq_head[q];
+        ++emu->cq_tail[q];
+        ++done;
+    }
+
+    if (!done)
+        return 0;
+
+    // CQ entries before the tail
+    smp_wmb();
+    seki_emu_reg_write(emu, base + SEKI_QREG_CQ_TAIL, emu->cq_tail[q]);
+    seki_emu_raise(emu, SEKI_IRQ_QUEUE(q));
+
+    return done;
+}
+
+static int seki_emu_thread(void *data)
+{
+    SekiEmuDevice *emu = data;
+
+    while (!kthread_should_stop()) {
+        int busy = seki_emu_run_dma(emu);
+
+        for (unsigned int q = 0; q < emulate_queues; ++q)
+            busy += seki_emu_run_queue(emu, q);
+
+        if (busy)
+            cond_resched();
+        else
+            usleep_range(emulate_poll_us, 2 * emulate_poll_us + 1);
+    }
+
+    return 0;
+}
+
+// Probe & remove
+static void seki_emu_free_bars(SekiEmuDevice *emu)
+{
+    if (emu->ctrl)
+        free_pages_exact(emu->ctrl, SEKI_EMU_CTRL_SIZE);
+    if (emu->input)
+        free_pages_exact(emu->input, emu->window_size);
+    if (emu->output)
+        free_pages_exact(emu->output, emu->window_size);
+
+    emu->ctrl = 0;
+    emu->input = 0;
+    emu->output = 0;
+}
+
+static int seki_emu_probe(struct platform_device *pdev)
+{
+    SekiEmuDevice *emu;
+    SekiData *device_data;
+    int rv;
+
+    emu = devm_kzalloc(&pdev->dev, sizeof(*emu), GFP_KERNEL);
+    if (!emu)
+        return -ENOMEM;
+
+    emu->window_size = PAGE_ALIGN((unsigned long)emulate_window_kb << 10);
+    emu->ctrl   = alloc_pages_exact(SEKI_EMU_CTRL_SIZE,
+                                    GFP_KERNEL | __GFP_ZERO);
+    emu->input  = alloc_pages_exact(emu->window_size,
+                                    GFP_KERNEL | __GFP_ZERO);
+    emu->output = alloc_pages_exact(emu->window_size,
+                                    GFP_KERNEL | __GFP_ZERO);
+    if (!emu->ctrl || !emu->input || !emu->output) {
+        pr_err("Failed to allocate %u KB windows for emulated device %d\n",
+               emulate_window_kb, pdev->id);
+        rv = -ENOMEM;
+        goto err_free_bars;
+    }
+
+    // What a real card reports
+    seki_emu_reg_write(emu, SEKI_REG_ID,
+                       SEKI_VENDOR_ID << 16 | SEKI_DEVICE_ID);
+    seki_emu_reg_write(emu, SEKI_REG_CAPS, SEKI_CAP_DMA);
+    seki_emu_reg_write(emu, SEKI_REG_NUM_QUEUES, emulate_queues);
+
+    init_irq_work(&emu->irq_work, seki_emu_irq_work);
+    atomic_set(&emu->irq_pending, 0);
+
+    device_data = seki_device_create(&pdev->dev);
+    if (!device_data) {
+        rv = -ENOMEM;
+        goto err_free_bars;
+    }
+    emu->device_data = device_data;
+
+    device_data->slot = pdev->id;
+    device_data->ctrl_mmio_physical_addr   = virt_to_phys(emu->ctrl);
+    device_data->ctrl_mmio_virtual_addr    = emu->ctrl;
+    device_data->ctrl_mmio_length          = SEKI_EMU_CTRL_SIZE;
+    device_data->input_mmio_physical_addr  = virt_to_phys(emu->input);
+    device_data->input_mmio_virtual_addr   = emu->input;
+    device_data->input_mmio_length         = emu->window_size;
+    device_data->output_mmio_physical_addr = virt_to_phys(emu->output);
+    device_data->output_mmio_virtual_addr  = emu->output;
+    device_data->output_mmio_length        = emu->window_size;
+
+    emu->thread = kthread_run(seki_emu_thread, emu, "seki_sw%d", pdev->id);
+    if (IS_ERR(emu->thread)) {
+        rv = PTR_ERR(emu->thread);
+        goto err_put;
+    }
+
+    rv = seki_device_setup(device_data);
+    if (rv)
+        goto err_stop;
+
+    platform_set_drvdata(pdev, emu);
+
+    pr_info("Emulated device %d is seki%d\n", pdev->id,
+            device_data->device_num);
+
+    return 0;
+
+err_stop:
+    kthread_stop(emu->thread);
+    irq_work_sync(&emu->irq_work);
+err_put:
+    seki_device_unpublish(device_data);
+    seki_device_put(device_data);
+err_free_bars:
+    seki_emu_free_bars(emu);
+    return rv;
+}
+
+static int seki_emu_remove(struct platform_device *pdev)
+{
+    SekiEmuDevice *emu = platform_get_drvdata(pdev);
+
+    // Stop the device before its rings go away, whatever is in flight
+    // completes with -ENODEV in seki_device_teardown()
+    kthread_stop(emu->thread);
+    irq_work_sync(&emu->irq_work);
+
+    seki_device_teardown(emu->device_data);
+    seki_device_put(emu->device_data);
+
+    seki_emu_free_bars(emu);
+
+    return 0;
+}
+
+static struct platform_driver seki_emu_driver = {
+    .driver = {
+        .name   = SEKI_EMU_NAME,
+    },
+    .probe      = seki_emu_probe,
+    .remove     = seki_emu_remove,
+};
+
+// Register & unregister
+int seki_emulator_register(void)
+{
+    int rv;
+
+    if (!emulate)
+        return 0;
+
+    if (emulate > SEKI_EMU_MAX_DEVICES) {
+        pr_warn("Only %d emulated devices\n", SEKI_EMU_MAX_DEVICES);
+        emulate = SEKI_EMU_MAX_DEVICES;
+    }
+
+    emulate_queues = clamp_t(u32, emulate_queues, 1, SEKI_MAX_QUEUES);
+
+    rv = platform_driver_register(&seki_emu_driver);
+    if (rv)
+        return rv;
+
+    for (unsigned int i = 0; i < emulate; ++i) {
+        struct platform_device_info info = {
+            .name       = SEKI_EMU_NAME,
+            .id         = i,
+            .dma_mask   = DMA_BIT_MASK(64),
+        };
+
+        _seki_emu_pdevs[i] = platform_device_register_full(&info);
+        if (IS_ERR(_seki_emu_pdevs[i])) {
+            rv = PTR_ERR(_seki_emu_pdevs[i]);
+            _seki_emu_pdevs[i] = 0;
+            seki_emulator_unregister();
+            return rv;
+        }
+    }
+
+    return 0;
+}
+
+void seki_emulator_unregister(void)
+{
+    if (!emulate)
+        return;
+
+    for (unsigned int i = 0; i < SEKI_EMU_MAX_DEVICES; ++i) {
+        if (_seki_emu_pdevs[i])
+            platform_device_unregister(_seki_emu_pdevs[i]);
+        _seki_emu_pdevs[i] = 0;
+    }
+
+    platform_driver_unregister(&seki_emu_driver);
+}
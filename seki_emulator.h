@@ -0,0 +1,19 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_emulator.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_EMULATOR_H
+#define SEKI_EMULATOR_H
+
+int seki_emulator_register(void);
+void seki_emulator_unregister(void);
+
+
+#endif // SEKI_EMULATOR_H
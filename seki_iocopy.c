@@ -0,0 +1,303 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_iocopy.c>
+ * CPU copies into the input window.
+ *
+ * memcpy_toio() gives no guarantee about store width, and the window is
+ * write-combined, so what reaches the card is only full PCIe bursts if
+ * whole 64 byte WC buffers get filled. The routines here align to the
+ * WC buffer, fill it with 64 bit or SSE2/AVX non-temporal stores and
+ * fence once per batch instead of per store.
+ *
+ * The iocopy module parameter picks one by name, "auto" times them all
+ * on the window of each device at probe and keeps the fastest.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/io.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+#include <asm/unaligned.h>
+
+#ifdef CONFIG_X86_64
+#include <asm/cpufeature.h>
+#include <asm/fpu/api.h>
+#include <asm/fpu/xstate.h>
+#endif
+
+#include "seki_device_defs.h"
+#include "seki_iocopy.h"
+
+#define SEKI_IOCOPY_WC_SIZE     64      // Write-combining buffer
+#define SEKI_IOCOPY_BATCH       4096    // Bytes per fence and FPU section
+#define SEKI_IOCOPY_BENCH_SIZE  0x10000
+#define SEKI_IOCOPY_BENCH_RUNS  4
+
+static char *iocopy = "auto";
+module_param(iocopy, charp, 0444);
+MODULE_PARM_DESC(iocopy, "Input window copy routine: auto (fastest at "
+                         "probe), generic, movq, sse2 or avx");
+
+// Generic
+static void seki_iocopy_generic(void __iomem *dst, const void *src,
+                                size_t length)
+{
+    memcpy_toio(dst, src, length);
+}
+
+static const SekiIocopy seki_iocopy_generic_ops = {
+    .name   = "generic",
+    .toio   = seki_iocopy_generic,
+};
+
+#ifdef CONFIG_64BIT
+// 64 bit stores, no fence
+static void seki_iocopy_movq_unfenced(u8 __iomem *dst, const u8 *src,
+                                      size_t length)
+{
+    size_t head = min_t(size_t, length, -(unsigned long)dst & 7);
+
+    memcpy_toio(dst, src, head);
+    dst    += head;
+    src    += head;
+    length -= head;
+
+    for (; length >= 8; length -= 8) {
+        __raw_writeq(get_unaligned((const u64 *)src), dst);
+        dst += 8;
+        src += 8;
+    }
+
+    memcpy_toio(dst, src, length);
+}
+
+static void seki_iocopy_movq(void __iomem *dst, const void *src,
+                             size_t length)
+{
+    seki_iocopy_movq_unfenced(dst, src, length);
+
+    // Drains the WC buffers
+    wmb();
+}
+
+static const SekiIocopy seki_iocopy_movq_ops = {
+    .name   = "movq",
+    .toio   = seki_iocopy_movq,
+};
+#endif
+
+#ifdef CONFIG_X86_64
+// Non-temporal stores of whole WC buffers. The source may be unaligned,
+// dst is aligned to SEKI_IOCOPY_WC_SIZE.
+static void seki_iocopy_sse2_blocks(u8 __iomem *dst, const u8 *src,
+                                    size_t blocks)
+{
+    for (; blocks; --blocks) {
+        asm volatile("movdqu    0(%0), %%xmm0\n\t"
+                     "movdqu   16(%0), %%xmm1\n\t"
+                     "movdqu   32(%0), %%xmm2\n\t"
+                     "movdqu   48(%0), %%xmm3\n\t"
+                     "movntdq  %%xmm0,  0(%1)\n\t"
+                     "movntdq  %%xmm1, 16(%1)\n\t"
+                     "movntdq  %%xmm2, 32(%1)\n\t"
+                     "movntdq  %%xmm3, 48(%1)\n\t"
+                     : : "r" (src), "r" (dst) : "memory");
+
+        src += SEKI_IOCOPY_WC_SIZE;
+        dst += SEKI_IOCOPY_WC_SIZE;
+    }
+}
+
+static void seki_iocopy_avx_blocks(u8 __iomem *dst, const u8 *src,
+                                   size_t blocks)
+{
+    for (; blocks; --blocks) {
+        asm volatile("vmovdqu   0(%0), %%ymm0\n\t"
+                     "vmovdqu  32(%0), %%ymm1\n\t"
+                     "vmovntdq %%ymm0,  0(%1)\n\t"
+                     "vmovntdq %%ymm1, 32(%1)\n\t"
+                     : : "r" (src), "r" (dst) : "memory");
+
+        src += SEKI_IOCOPY_WC_SIZE;
+        dst += SEKI_IOCOPY_WC_SIZE;
+    }
+}
+
+static void seki_iocopy_simd(u8 __iomem *dst, const u8 *src, size_t length,
+                             void (*blocks)(u8 __iomem *, const u8 *, size_t))
+{
+    size_t head = min_t(size_t, length,
+                        -(unsigned long)dst & (SEKI_IOCOPY_WC_SIZE - 1));
+
+    // Up to the next WC buffer, then whole ones
+    seki_iocopy_movq_unfenced(dst, src, head);
+    dst    += head;
+    src    += head;
+    length -= head;
+
+    // Batches keep preemption latency bounded
+    while (length >= SEKI_IOCOPY_WC_SIZE && irq_fpu_usable()) {
+        size_t n = min_t(size_t, length, SEKI_IOCOPY_BATCH) &
+                   ~(size_t)(SEKI_IOCOPY_WC_SIZE - 1);
+
+        kernel_fpu_begin();
+        blocks(dst, src, n / SEKI_IOCOPY_WC_SIZE);
+        asm volatile("sfence" : : : "memory");
+        kernel_fpu_end();
+
+        dst    += n;
+        src    += n;
+        length -= n;
+    }
+
+    seki_iocopy_movq(dst, src, length);
+}
+
+static void seki_iocopy_sse2(void __iomem *dst, const void *src,
+                             size_t length)
+{
+    seki_iocopy_simd(dst, src, length, seki_iocopy_sse2_blocks);
+}
+
+static bool seki_iocopy_sse2_usable(void)
+{
+    return boot_cpu_has(X86_FEATURE_XMM2);
+}
+
+static const SekiIocopy seki_iocopy_sse2_ops = {
+    .name   = "sse2",
+    .toio   = seki_iocopy_sse2,
+    .usable = seki_iocopy_sse2_usable,
+};
+
+static void seki_iocopy_avx(void __iomem *dst, const void *src,
+                            size_t length)
+{
+    seki_iocopy_simd(dst, src, length, seki_iocopy_avx_blocks);
+}
+
+static bool seki_iocopy_avx_usable(void)
+{
+    return boot_cpu_has(X86_FEATURE_AVX) &&
+           cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+}
+
+static const SekiIocopy seki_iocopy_avx_ops = {
+    .name   = "avx",
+    .toio   = seki_iocopy_avx,
+    .usable = seki_iocopy_avx_usable,
+};
+#endif
+
+static const SekiIocopy *const seki_iocopy_all[] = {
+    &seki_iocopy_generic_ops,
+#ifdef CONFIG_64BIT
+    &seki_iocopy_movq_ops,
+#endif
+#ifdef CONFIG_X86_64
+    &seki_iocopy_sse2_ops,
+    &seki_iocopy_avx_ops,
+#endif
+};
+
+static inline bool seki_iocopy_usable(const SekiIocopy *ops)
+{
+    return !ops->usable || ops->usable();
+}
+
+// Best of a few runs, in ns
+static u64 seki_iocopy_time(SekiData *device_data, const SekiIocopy *ops,
+                            const void *buf, size_t length)
+{
+    u64 best = U64_MAX;
+
+    for (int i = 0; i < SEKI_IOCOPY_BENCH_RUNS; ++i) {
+        u64 start = ktime_get_ns();
+
+        ops->toio(device_data->input_mmio_virtual_addr, buf, length);
+        best = min(best, ktime_get_ns() - start);
+    }
+
+    return best ? best : 1;
+}
+
+// The window is not handed out yet, so the benchmark can scribble on it
+static const SekiIocopy *seki_iocopy_benchmark(SekiData *device_data)
+{
+    size_t length = min_t(unsigned long, SEKI_IOCOPY_BENCH_SIZE,
+                          device_data->input_mmio_length);
+    const SekiIocopy *fastest = &seki_iocopy_generic_ops;
+    u64 fastest_ns = U64_MAX;
+    u64 generic_ns = 0;
+    void *buf;
+
+    if (!length)
+        return fastest;
+
+    buf = kmalloc_node(length, GFP_KERNEL, device_data->node);
+    if (!buf)
+        return fastest;
+    memset(buf, 0x5a, length);
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(seki_iocopy_all); ++i) {
+        const SekiIocopy *ops = seki_iocopy_all[i];
+        u64 ns;
+
+        if (!seki_iocopy_usable(ops))
+            continue;
+
+        ns = seki_iocopy_time(device_data, ops, buf, length);
+        pr_debug("Dev %d iocopy %s: %llu MB/s\n", device_data->device_num,
+                 ops->name, div64_u64((u64)length * 1000, ns));
+
+        if (ops == &seki_iocopy_generic_ops)
+            generic_ns = ns;
+
+        if (ns < fastest_ns) {
+            fastest = ops;
+            fastest_ns = ns;
+        }
+    }
+
+    kfree(buf);
+
+    pr_info("Dev %d iocopy %s, %llu MB/s against %llu MB/s generic\n",
+            device_data->device_num, fastest->name,
+            div64_u64((u64)length * 1000, fastest_ns),
+            div64_u64((u64)length * 1000, generic_ns));
+
+    return fastest;
+}
+
+void seki_iocopy_select(SekiData *device_data)
+{
+    const SekiIocopy *ops = 0;
+
+    if (!strcmp(iocopy, "auto")) {
+        ops = seki_iocopy_benchmark(device_data);
+    } else {
+        for (unsigned int i = 0; i < ARRAY_SIZE(seki_iocopy_all); ++i) {
+            if (!strcmp(iocopy, seki_iocopy_all[i]->name))
+                ops = seki_iocopy_all[i];
+        }
+
+        if (!ops || !seki_iocopy_usable(ops)) {
+            pr_warn("iocopy %s is not available, using generic\n", iocopy);
+            ops = &seki_iocopy_generic_ops;
+        }
+    }
+
+    device_data->iocopy = ops;
+
+    pr_debug("Dev %d using %s iocopy\n", device_data->device_num, ops->name);
+}
@@ -0,0 +1,35 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_iocopy.h>
+ * CPU copies into the input window, see seki_iocopy.c
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_IOCOPY_H
+#define SEKI_IOCOPY_H
+
+#include <linux/types.h>
+
+#include "seki_device_defs.h"
+
+typedef struct SekiIocopy {
+    const char  *name;
+    void        (*toio)(void __iomem *dst, const void *src, size_t length);
+    bool        (*usable)(void);    // NULL if always
+} SekiIocopy;
+
+void seki_iocopy_select(SekiData *device_data);
+
+static inline void seki_iocopy_toio(SekiData *device_data, void __iomem *dst,
+                                    const void *src, size_t length)
+{
+    device_data->iocopy->toio(dst, src, length);
+}
+
+
+#endif // SEKI_IOCOPY_H
@@ -0,0 +1,286 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_irq.c>
+ * MSI-X/MSI interrupts and completion notification.
+ *
+ * One vector per queue when the device grants enough of them, otherwise
+ * queues share vectors round robin. A completion wakes poll() waiters on
+ * the open file of /dev/seki%d the job came from and signals the eventfd
+ * registered there.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/eventfd.h>
+#include <linux/interrupt.h>
+#include <linux/pci.h>
+#include <linux/topology.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_oring.h"
+#include "seki_queue.h"
+#include "seki_stage.h"
+#include "seki_irq.h"
+#include "seki_stats.h"
+#include "seki_trace.h"
+
+// Handling
+void seki_irq_dispatch(SekiData *device_data, u32 status)
+{
+    if (status & SEKI_IRQ_DMA) {
+        device_data->dma_status = seki_reg_read(device_data,
+                                                SEKI_REG_DMA_STATUS);
+        seki_reg_write(device_data, SEKI_REG_DMA_STATUS,
+                       device_data->dma_status &
+                       (SEKI_DMA_STATUS_DONE | SEKI_DMA_STATUS_ERROR));
+        complete(&device_data->dma_done);
+    }
+
+    if (status & SEKI_IRQ_ORING)
+        seki_oring_notify(device_data);
+
+    status &= ~(SEKI_IRQ_DMA | SEKI_IRQ_ORING);
+    if (!status)
+        return;
+
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q) {
+        if (status & SEKI_IRQ_QUEUE(q)) {
+            seki_queue_reap(device_data->queues + q);
+            atomic_long_inc(&device_data->queues[q].completions);
+        }
+    }
+
+    // The device hands slots back no later than it completes their jobs
+    if (device_data->nr_stage_slots)
+        seki_stage_reap(device_data);
+}
+
+// From seki_queue_reap() under RCU, once the completion of a job of file
+// on queue q is posted. Only the file it belongs to wakes up.
+void seki_irq_notify_file(SekiFile *file, unsigned int q)
+{
+    unsigned long flags;
+
+    atomic_long_inc(file->completions + q);
+
+    spin_lock_irqsave(&file->lock, flags);
+    if (file->eventfd)
+        eventfd_signal(file->eventfd, 1);
+    spin_unlock_irqrestore(&file->lock, flags);
+
+    wake_up_interruptible(&file->event_wait);
+}
+
+static irqreturn_t seki_irq_handler(int irq, void *data)
+{
+    SekiIrqVector *vector = data;
+    SekiData *device_data = vector->device_data;
+    u32 status;
+
+    SEKI_UNUSED(irq);
+
+    status = seki_reg_read(device_data, SEKI_REG_IRQ_STATUS) &
+             vector->status_mask;
+    if (!status)
+        return IRQ_NONE;    // Shared legacy line, not ours
+
+    seki_reg_write(device_data, SEKI_REG_IRQ_STATUS, status);
+    trace_seki_irq(device_data->device_num, vector->index, status);
+    seki_stats_inc(device_data, SEKI_STAT_INTERRUPTS);
+    seki_irq_dispatch(device_data, status);
+
+    return IRQ_HANDLED;
+}
+
+// Init & uninit
+static void seki_irq_free_vector(SekiIrqVector *vector)
+{
+    irq_set_affinity_hint(vector->irq, NULL);
+    free_irq(vector->irq, vector);
+}
+
+int seki_irq_init_device(SekiData *device_data)
+{
+    struct pci_dev *dev = device_data->pci_dev;
+    unsigned long irq_flags;
+    u32 enabled = 0;
+    int nvec;
+    int rv;
+    int v;
+
+    // Emulated devices call seki_irq_dispatch() themselves, one vector
+    // with no Linux irq behind it
+    if (!dev) {
+        SekiIrqVector *vector = device_data->irq_vectors;
+
+        vector->device_data = device_data;
+        vector->index = 0;
+        vector->irq = 0;
+        vector->status_mask = SEKI_IRQ_DMA | SEKI_IRQ_ORING;
+        for (unsigned int q = 0; q < device_data->nr_queues; ++q)
+            vector->status_mask |= SEKI_IRQ_QUEUE(q);
+        snprintf(vector->name, sizeof(vector->name), "seki%d-v0",
+                 device_data->device_num);
+
+        device_data->nr_irq_vectors = 1;
+        seki_reg_write(device_data, SEKI_REG_IRQ_VECTORS, 1);
+        seki_reg_write(device_data, SEKI_REG_IRQ_MASK, vector->status_mask);
+
+        return 0;
+    }
+
+    nvec = pci_alloc_irq_vectors(dev, 1, device_data->nr_queues,
+                                 PCI_IRQ_MSIX | PCI_IRQ_MSI | PCI_IRQ_LEGACY);
+    if (nvec < 0) {
+        pr_warn("No interrupt for dev %d, completions must be polled\n",
+                device_data->device_num);
+        device_data->nr_irq_vectors = 0;
+
+        return 0;
+    }
+    device_data->nr_irq_vectors = nvec;
+
+    irq_flags = (dev->msix_enabled || dev->msi_enabled) ? 0 : IRQF_SHARED;
+
+    for (v = 0; v < nvec; ++v) {
+        SekiIrqVector *vector = device_data->irq_vectors + v;
+
+        vector->device_data = device_data;
+        vector->index = v;
+        vector->irq = pci_irq_vector(dev, v);
+        vector->status_mask = v ? 0 : SEKI_IRQ_DMA | SEKI_IRQ_ORING;
+        for (unsigned int q = v; q < device_data->nr_queues; q += nvec)
+            vector->status_mask |= SEKI_IRQ_QUEUE(q);
+        snprintf(vector->name, sizeof(vector->name), "seki%d-v%d",
+                 device_data->device_num, v);
+
+        rv = request_irq(vector->irq, seki_irq_handler, irq_flags,
+                         vector->name, vector);
+        if (rv) {
+            pr_err("Failed to request irq %d for dev %d\n",
+                   vector->irq, device_data->device_num);
+            goto err_free_irqs;
+        }
+
+        // Completions are reaped where the queues and rings live
+        if (device_data->node != NUMA_NO_NODE)
+            irq_set_affinity_hint(vector->irq,
+                                  cpumask_of_node(device_data->node));
+
+        enabled |= vector->status_mask;
+    }
+
+    seki_reg_write(device_data, SEKI_REG_IRQ_VECTORS, nvec);
+    seki_reg_write(device_data, SEKI_REG_IRQ_MASK, enabled);
+
+    pr_debug("Dev %d has %d queues on %d irq vectors\n",
+             device_data->device_num, device_data->nr_queues, nvec);
+
+    return 0;
+
+err_free_irqs:
+    while (v--)
+        seki_irq_free_vector(device_data->irq_vectors + v);
+    pci_free_irq_vectors(dev);
+    device_data->nr_irq_vectors = 0;
+    return rv;
+}
+
+void seki_irq_uninit_device(SekiData *device_data)
+{
+    if (!device_data->nr_irq_vectors)
+        return;
+
+    seki_reg_write(device_data, SEKI_REG_IRQ_MASK, 0);
+
+    if (!device_data->pci_dev) {
+        device_data->nr_irq_vectors = 0;
+        return;
+    }
+
+    for (unsigned int v = 0; v < device_data->nr_irq_vectors; ++v)
+        seki_irq_free_vector(device_data->irq_vectors + v);
+
+    pci_free_irq_vectors(device_data->pci_dev);
+    device_data->nr_irq_vectors = 0;
+}
+
+// Per file
+void seki_irq_init_file(SekiFile *file)
+{
+    spin_lock_init(&file->lock);
+    init_waitqueue_head(&file->event_wait);
+    file->eventfd = 0;
+
+    for (unsigned int q = 0; q < SEKI_MAX_QUEUES; ++q) {
+        atomic_long_set(file->completions + q, 0);
+        file->completions_seen[q] = 0;
+    }
+}
+
+void seki_irq_uninit_file(SekiFile *file)
+{
+    seki_irq_set_eventfd(file, -1);
+}
+
+int seki_irq_set_eventfd(SekiFile *file, int fd)
+{
+    struct eventfd_ctx *ctx = 0;
+    struct eventfd_ctx *old;
+
+    if (fd >= 0) {
+        ctx = eventfd_ctx_fdget(fd);
+        if (IS_ERR(ctx))
+            return PTR_ERR(ctx);
+    }
+
+    spin_lock_irq(&file->lock);
+    old = file->eventfd;
+    file->eventfd = ctx;
+    spin_unlock_irq(&file->lock);
+
+    if (old)
+        eventfd_ctx_put(old);
+
+    return 0;
+}
+
+int seki_irq_file_has_events(SekiFile *file)
+{
+    SekiData *device_data = file->device_data;
+
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q) {
+        if (atomic_long_read(file->completions + q) !=
+            READ_ONCE(file->completions_seen[q]))
+            return 1;
+    }
+
+    return 0;
+}
+
+void seki_irq_collect_events(SekiFile *file, struct seki_event_info *info)
+{
+    SekiData *device_data = file->device_data;
+
+    memset(info, 0, sizeof(*info));
+
+    spin_lock_irq(&file->lock);
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q) {
+        unsigned long now = atomic_long_read(file->completions + q);
+
+        if (now != file->completions_seen[q]) {
+            info->completions += now - file->completions_seen[q];
+            info->queue_mask  |= SEKI_IRQ_QUEUE(q);
+            file->completions_seen[q] = now;
+        }
+    }
+    spin_unlock_irq(&file->lock);
+}
@@ -0,0 +1,34 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_irq.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_IRQ_H
+#define SEKI_IRQ_H
+
+#include <linux/types.h>
+
+struct SekiData;
+struct SekiFile;
+struct seki_event_info;
+
+int seki_irq_init_device(struct SekiData *device_data);
+void seki_irq_uninit_device(struct SekiData *device_data);
+void seki_irq_dispatch(struct SekiData *device_data, u32 status);
+void seki_irq_notify_file(struct SekiFile *file, unsigned int q);
+
+void seki_irq_init_file(struct SekiFile *file);
+void seki_irq_uninit_file(struct SekiFile *file);
+int seki_irq_set_eventfd(struct SekiFile *file, int fd);
+int seki_irq_file_has_events(struct SekiFile *file);
+void seki_irq_collect_events(struct SekiFile *file,
+                             struct seki_event_info *info);
+
+
+#endif // SEKI_IRQ_H
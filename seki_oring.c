@@ -0,0 +1,323 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_oring.c>
+ * Output ring, streaming results.
+ *
+ * Results normally land at the output_offset of each job, and whoever
+ * reads them has to know which jobs are done. In streaming mode one file
+ * hands a chunk of the output window to the device as a ring, the device
+ * appends a record per job at ORING_TAIL and the file consumes them by
+ * moving ORING_HEAD. The device interrupts once the ring holds watermark
+ * bytes, so readers wake up for batches rather than for every job, and
+ * the consume ioctl takes a timeout to bound the latency of a trickle.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/jiffies.h>
+#include <linux/log2.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_alloc.h"
+#include "seki_oring.h"
+#include "seki_queue.h"
+#include "seki_sched.h"
+
+// Bytes produced since head
+static inline u32 seki_oring_fill(SekiData *device_data, u32 head)
+{
+    return seki_reg_read(device_data, SEKI_REG_ORING_TAIL) - head;
+}
+
+// Under oring_lock
+static void seki_oring_start(SekiData *device_data, SekiFile *file,
+                             SekiChunk *chunk,
+                             const struct seki_oring_params *params)
+{
+    seki_reg_write(device_data, SEKI_REG_ORING_CONTROL, 0);
+    seki_reg_write(device_data, SEKI_REG_ORING_OFFSET, params->offset);
+    seki_reg_write(device_data, SEKI_REG_ORING_SIZE, params->size);
+    seki_reg_write(device_data, SEKI_REG_ORING_WATERMARK, params->watermark);
+    seki_reg_write(device_data, SEKI_REG_ORING_HEAD, 0);
+    seki_reg_write(device_data, SEKI_REG_ORING_TAIL, 0);
+
+    device_data->oring_chunk = chunk;
+    device_data->oring_size = params->size;
+    device_data->oring_watermark = params->watermark;
+    device_data->oring_head = 0;
+    WRITE_ONCE(device_data->oring_tenant, file->sched);
+    WRITE_ONCE(device_data->oring_file, file);
+
+    seki_reg_write(device_data, SEKI_REG_ORING_CONTROL,
+                   SEKI_ORING_CONTROL_ENABLE);
+}
+
+// Under oring_lock. The device stops appending before the chunk can be
+// freed and handed to someone else, and before the ring can get a new
+// owner, which would otherwise receive the records of jobs still queued.
+static void seki_oring_stop(SekiData *device_data)
+{
+    SekiFile *file = device_data->oring_file;
+
+    if (!file)
+        return;
+
+    // From now on the device fails stream jobs, stalled ones included
+    seki_reg_write(device_data, SEKI_REG_ORING_CONTROL, 0);
+
+    WRITE_ONCE(device_data->oring_file, NULL);
+    WRITE_ONCE(device_data->oring_tenant, NULL);
+
+    // Pairs with seki_oring_job_get(), jobs not counted yet see no owner
+    smp_mb();
+
+    // Those counted already complete soon, waiting ones fail at dispatch.
+    // On removal the queues fail them all.
+    while (atomic_read(&device_data->oring_jobs) &&
+           READ_ONCE(device_data->used)) {
+        for (unsigned int q = 0; q < device_data->nr_queues; ++q)
+            seki_queue_reap(device_data->queues + q);
+
+        // Without interrupts nobody reaps for us, look again soon
+        wait_event_timeout(device_data->oring_wait,
+                           !atomic_read(&device_data->oring_jobs),
+                           device_data->nr_irq_vectors ? HZ : 1);
+    }
+
+    seki_alloc_put_mapping(file, device_data->oring_chunk);
+    device_data->oring_chunk = 0;
+
+    wake_up_interruptible(&device_data->oring_wait);
+}
+
+// Init & uninit
+void seki_oring_init_device(SekiData *device_data)
+{
+    mutex_init(&device_data->oring_lock);
+    init_waitqueue_head(&device_data->oring_wait);
+    device_data->oring_file = 0;
+    device_data->oring_tenant = 0;
+    device_data->oring_chunk = 0;
+    atomic_set(&device_data->oring_jobs, 0);
+
+    seki_reg_write(device_data, SEKI_REG_ORING_CONTROL, 0);
+}
+
+void seki_oring_uninit_device(SekiData *device_data)
+{
+    mutex_lock(&device_data->oring_lock);
+    seki_oring_stop(device_data);
+    mutex_unlock(&device_data->oring_lock);
+}
+
+void seki_oring_release_file(SekiFile *file)
+{
+    SekiData *device_data = file->device_data;
+
+    mutex_lock(&device_data->oring_lock);
+    if (device_data->oring_file == file)
+        seki_oring_stop(device_data);
+    mutex_unlock(&device_data->oring_lock);
+}
+
+// From the IRQ path
+void seki_oring_notify(SekiData *device_data)
+{
+    wake_up_interruptible(&device_data->oring_wait);
+}
+
+// Waiting
+static inline int seki_oring_ready(SekiFile *file, u32 head, u32 watermark)
+{
+    SekiData *device_data = file->device_data;
+
+    // Woken up by seki_oring_stop() too
+    return READ_ONCE(device_data->oring_file) != file ||
+           !READ_ONCE(device_data->used) ||
+           seki_oring_fill(device_data, head) >= max(watermark, 1u);
+}
+
+static int seki_oring_wait(SekiFile *file, u32 head, u32 watermark,
+                           u32 timeout_us)
+{
+    SekiData *device_data = file->device_data;
+    unsigned long deadline = jiffies + usecs_to_jiffies(timeout_us);
+    long timeout;
+    long rv;
+
+    while (!seki_oring_ready(file, head, watermark)) {
+        if (timeout_us) {
+            timeout = (long)(deadline - jiffies);
+            if (timeout <= 0)
+                return 0;   // Whatever is there by now
+        } else {
+            timeout = MAX_SCHEDULE_TIMEOUT;
+        }
+
+        // Without interrupts nobody wakes us, look again soon
+        if (!device_data->nr_irq_vectors)
+            timeout = min(timeout, 1L);
+
+        rv = wait_event_interruptible_timeout(device_data->oring_wait,
+                seki_oring_ready(file, head, watermark), timeout);
+        if (rv < 0)
+            return rv;
+    }
+
+    return 0;
+}
+
+// Interface
+int seki_oring_setup(SekiFile *file, const struct seki_oring_params *params)
+{
+    SekiData *device_data = file->device_data;
+    SekiChunk *chunk = 0;
+    int rv = 0;
+
+    if (params->size) {
+        if (!is_power_of_2(params->size) || params->size < PAGE_SIZE ||
+            !PAGE_ALIGNED(params->offset) ||
+            params->watermark > params->size)
+            return -EINVAL;
+
+        // Pinned, so it cannot be freed under the device
+        chunk = seki_alloc_get_mapping(file, SEKI_WINDOW_OUTPUT,
+                                       params->offset, params->size);
+        if (!chunk)
+            return -EACCES;
+    }
+
+    mutex_lock(&device_data->oring_lock);
+
+    if (device_data->oring_file && device_data->oring_file != file) {
+        rv = -EBUSY;
+    } else {
+        seki_oring_stop(device_data);
+        if (chunk) {
+            seki_oring_start(device_data, file, chunk, params);
+            chunk = 0;
+        }
+    }
+
+    mutex_unlock(&device_data->oring_lock);
+
+    if (chunk)
+        seki_alloc_put_mapping(file, chunk);
+
+    return rv;
+}
+
+int seki_oring_consume(SekiFile *file, struct seki_oring_consume *request)
+{
+    SekiData *device_data = file->device_data;
+    u32 watermark;
+    u32 tail;
+    int rv = 0;
+
+    if (request->flags & ~SEKI_ORING_WAIT)
+        return -EINVAL;
+
+    mutex_lock(&device_data->oring_lock);
+
+    if (device_data->oring_file != file) {
+        rv = -EINVAL;
+        goto out_unlock;
+    }
+
+    // Forward only, and not past what the device produced
+    tail = seki_reg_read(device_data, SEKI_REG_ORING_TAIL);
+    if (request->head - device_data->oring_head >
+        tail - device_data->oring_head) {
+        rv = -EINVAL;
+        goto out_unlock;
+    }
+
+    if (request->head != device_data->oring_head) {
+        device_data->oring_head = request->head;
+        seki_reg_write(device_data, SEKI_REG_ORING_HEAD, request->head);
+    }
+
+    watermark = device_data->oring_watermark;
+
+out_unlock:
+    mutex_unlock(&device_data->oring_lock);
+
+    if (rv)
+        return rv;
+
+    if (request->flags & SEKI_ORING_WAIT) {
+        rv = seki_oring_wait(file, request->head, watermark,
+                             request->timeout_us);
+        if (rv)
+            return rv;
+
+        if (!READ_ONCE(device_data->used) ||
+            READ_ONCE(device_data->oring_file) != file)
+            return -ENODEV;
+    }
+
+    request->tail = seki_reg_read(device_data, SEKI_REG_ORING_TAIL);
+
+    return 0;
+}
+
+// Called on job submission, the device checks again
+int seki_oring_validate(SekiFile *file, u32 output_length)
+{
+    SekiData *device_data = file->device_data;
+
+    if (READ_ONCE(device_data->oring_file) != file)
+        return -EINVAL;
+
+    if (output_length > READ_ONCE(device_data->oring_size) -
+                        sizeof(struct seki_oring_record))
+        return -EINVAL;
+
+    return 0;
+}
+
+// Under sq_lock, before a stream job goes to the device. It counts until
+// it completes, false if the tenant no longer owns the ring.
+bool seki_oring_job_get(SekiData *device_data, SekiSchedTenant *tenant)
+{
+    atomic_inc(&device_data->oring_jobs);
+
+    // Pairs with seki_oring_stop()
+    smp_mb__after_atomic();
+    if (READ_ONCE(device_data->oring_tenant) == tenant)
+        return true;
+
+    seki_oring_job_put(device_data);
+
+    return false;
+}
+
+void seki_oring_job_put(SekiData *device_data)
+{
+    if (atomic_dec_and_test(&device_data->oring_jobs))
+        wake_up(&device_data->oring_wait);
+}
+
+__poll_t seki_oring_poll(SekiFile *file, struct file *filp, poll_table *wait)
+{
+    SekiData *device_data = file->device_data;
+
+    if (READ_ONCE(device_data->oring_file) != file)
+        return 0;
+
+    poll_wait(filp, &device_data->oring_wait, wait);
+
+    return seki_oring_fill(device_data, READ_ONCE(device_data->oring_head)) >=
+           max(READ_ONCE(device_data->oring_watermark), 1u) ? EPOLLPRI : 0;
+}
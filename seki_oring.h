@@ -0,0 +1,43 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_oring.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_ORING_H
+#define SEKI_ORING_H
+
+#include <linux/poll.h>
+#include <linux/types.h>
+
+struct SekiData;
+struct SekiFile;
+struct SekiSchedTenant;
+struct seki_oring_params;
+struct seki_oring_consume;
+
+void seki_oring_init_device(struct SekiData *device_data);
+void seki_oring_uninit_device(struct SekiData *device_data);
+
+void seki_oring_release_file(struct SekiFile *file);
+
+void seki_oring_notify(struct SekiData *device_data);
+
+int seki_oring_setup(struct SekiFile *file,
+                     const struct seki_oring_params *params);
+int seki_oring_consume(struct SekiFile *file,
+                       struct seki_oring_consume *request);
+int seki_oring_validate(struct SekiFile *file, u32 output_length);
+bool seki_oring_job_get(struct SekiData *device_data,
+                        struct SekiSchedTenant *tenant);
+void seki_oring_job_put(struct SekiData *device_data);
+__poll_t seki_oring_poll(struct SekiFile *file, struct file *filp,
+                         poll_table *wait);
+
+
+#endif // SEKI_ORING_H
@@ -21,6 +21,11 @@
 #include "seki_device_defs.h"
 #include "seki_procfs.h"
 #include "seki_chardev.h"
+#include "seki_device.h"
+#include "seki_emulator.h"
+
+#define CREATE_TRACE_POINTS
+#include "seki_trace.h"
 
 MODULE_LICENSE("Dual MIT/GPL");
 MODULE_AUTHOR("Afa.L Cheng <afa@afa.moe>");
@@ -35,29 +40,28 @@ static const struct pci_device_id seki_dev_idtbl[] = {
 
 MODULE_DEVICE_TABLE(pci, seki_dev_idtbl);
 
-static unsigned int seki_allocate_device_number(void)
+static void seki_pcie_unmap_bars(SekiData *device_data)
 {
-    int ret = -1;
-    for (int i = 0; i < SEKI_MAX_PCI_DEVICES; ++i) {
-        if (!_seki_device_number_used_map[i]) {
-            _seki_device_number_used_map[i] = 1;
-            ret = i;
-            break;
-        }
-    }
-    return ret;
-}
+    if (device_data->ctrl_mmio_virtual_addr)
+        iounmap(device_data->ctrl_mmio_virtual_addr);
 
-static void seki_deallocate_device_number(unsigned int dev_num)
-{
-    _seki_device_number_used_map[dev_num] = 0;
+    if (device_data->input_mmio_virtual_addr)
+        iounmap(device_data->input_mmio_virtual_addr);
+
+    if (device_data->output_mmio_virtual_addr)
+        iounmap(device_data->output_mmio_virtual_addr);
+
+    device_data->ctrl_mmio_virtual_addr = 0;
+    device_data->input_mmio_virtual_addr = 0;
+    device_data->output_mmio_virtual_addr = 0;
 }
 
+// PCI specifics, the rest is seki_device_setup() and shared with the
+// software emulated devices
 static int seki_probe(struct pci_dev *dev, const struct pci_device_id *did)
 {
     int rv;
     unsigned int slot;
-    unsigned int dev_num;
     SekiData *device_data = 0;
 
     SEKI_UNUSED(did);
@@ -66,24 +70,17 @@ static int seki_probe(struct pci_dev *dev, const struct pci_device_id *did)
     pr_debug("Device Found on slot %d\n", slot);
 
     // Allocate a SekiData element
-    dev_num = seki_allocate_device_number();
-    ++_seki_device_count;
-    pr_debug("Device on slot %d allocated deviced number %d\n", slot, dev_num);
+    device_data = seki_device_create(&dev->dev);
+    if (!device_data)
+        return -ENOMEM;
 
-    if (dev_num == -1) {
-        pr_err("Driver does not support more than 4 devices\n");   // More than 4 devices?
+    pr_debug("Device on slot %d allocated deviced number %d\n", slot,
+             device_data->device_num);
 
-        return -1;
-    }
-
-    device_data = _seki_data_array + dev_num;
-    device_data->device_num = dev_num;
-    device_data->used = 1;
     device_data->slot = slot;
     device_data->board_revision = dev->revision;
-    spin_lock_init(&device_data->ctrl_mmio_lock);
-    spin_lock_init(&device_data->input_mmio_lock);
-    spin_lock_init(&device_data->output_mmio_lock);
+    device_data->pci_dev = dev;
+    pci_set_drvdata(dev, device_data);
 
     // PCI enable/init sequence
     rv = pci_enable_device(dev);
@@ -98,6 +95,7 @@ static int seki_probe(struct pci_dev *dev, const struct pci_device_id *did)
     if (pci_request_region(dev, 0, SEKI_DRIVER_NAME)) {
         pr_err("Failed to request region for device on slot %d\n", slot);
 
+        rv = -EBUSY;
         goto err_disable;
     };
 
@@ -111,9 +109,10 @@ static int seki_probe(struct pci_dev *dev, const struct pci_device_id *did)
     // Input Mem Region, 128MB
     device_data->input_mmio_physical_addr = pci_resource_start(dev, 2);
     device_data->input_mmio_length  = pci_resource_len(dev, 2);
+    // Mapped WC so the kernel mapping agrees with the user mmap memtype
     device_data->input_mmio_virtual_addr =
-            ioremap_nocache(device_data->input_mmio_physical_addr,
-                            device_data->input_mmio_length);
+            ioremap_wc(device_data->input_mmio_physical_addr,
+                       device_data->input_mmio_length);
 
     // Output Mem Region, 64MB
     device_data->output_mmio_physical_addr = pci_resource_start(dev, 4);
@@ -122,75 +121,47 @@ static int seki_probe(struct pci_dev *dev, const struct pci_device_id *did)
             ioremap_nocache(device_data->output_mmio_physical_addr,
                             device_data->output_mmio_length);
 
-
-    rv = seki_procfs_create_file_device(device_data);
-    if (rv) {
-        pr_err("Failed to create procfs file for device on slot %d\n", slot);
-        goto err_disable;
-    }
-
-    rv = seki_chardev_create_file_seki_device(device_data);
-    if (rv) {
-        pr_err("Failed to create chardev for device on slot %d\n", slot);
-        goto err_uninit_procfs;
-    }
+    rv = seki_device_setup(device_data);
+    if (rv)
+        goto err_unmap;
 
     return 0;
 
     // Errors:
-err_uninit_procfs:
-    seki_procfs_remove_file_device(device_data);
+err_unmap:
+    seki_pcie_unmap_bars(device_data);
+    pci_release_region(dev, 0);
 
 err_disable:
     pci_disable_device(dev);
 
 err_cleanused:
-    device_data->used = 0;
-    --_seki_device_count;
+    pci_set_drvdata(dev, NULL);
+    seki_device_unpublish(device_data);
+    seki_device_put(device_data);
     return rv;
 }
 
 static void seki_remove(struct pci_dev *dev) {
-    SekiData *device_data = 0;
+    SekiData *device_data = pci_get_drvdata(dev);
     unsigned int slot;
 
     slot = PCI_SLOT(dev->devfn);
 
-    for (int i = 0; i < SEKI_MAX_PCI_DEVICES; ++i) {
-        if (_seki_data_array[i].used && _seki_data_array[i].slot == slot) {
-            device_data = _seki_data_array + i;
-            break;
-        }
-    }
     if (!device_data)   // What device is it?
         return;
 
-    seki_chardev_remove_file_seki_device(device_data);
-
-    seki_procfs_remove_file_device(device_data);
-
-    if (device_data->ctrl_mmio_virtual_addr)
-        iounmap(device_data->ctrl_mmio_virtual_addr);
-
-    if (device_data->input_mmio_virtual_addr)
-        iounmap(device_data->input_mmio_virtual_addr);
+    seki_device_teardown(device_data);
 
-    if (device_data->output_mmio_virtual_addr)
-        iounmap(device_data->output_mmio_virtual_addr);
+    seki_pcie_unmap_bars(device_data);
 
     pci_release_region(dev, 0);
     pci_clear_master(dev);
     pci_disable_device(dev);
 
-    // Finalize spinlocks
-    memset(&device_data->ctrl_mmio_lock,    0, sizeof(spinlock_t));
-    memset(&device_data->input_mmio_lock,   0, sizeof(spinlock_t));
-    memset(&device_data->input_mmio_lock,   0, sizeof(spinlock_t));
-
-    // Free _seki_data_array
-    device_data->used = 0;
-    seki_deallocate_device_number(device_data->device_num);
-    --_seki_device_count;
+    // The window allocators go with the last open file
+    pci_set_drvdata(dev, NULL);
+    seki_device_put(device_data);
 
     pr_debug("Device removed, slot %d\n", slot);
 }
@@ -243,16 +214,33 @@ static int __init seki_driver_init(void)
         goto err_unregister_chardev_file_ctl;
     }
 
+    rv = seki_chardev_register_file_any();
+    if (rv) {
+        pr_err("Unable to register chardev seki-any\n");
+        goto err_unregister_chardev_file_seki_device;
+    }
+
     rv = pci_register_driver(&pcie_seki_driver);
     if (rv) {
         pr_err("Driver registration failed\n");
-        goto err_uninit_procfs;
+        goto err_unregister_chardev_file_any;
     }
 
+    rv = seki_emulator_register();
+    if (rv) {
+        pr_err("Emulated device registration failed\n");
+        goto err_unregister_pci_driver;
+    }
 
     pr_debug("Driver loaded");
     return 0;
 
+err_unregister_pci_driver:
+    pci_unregister_driver(&pcie_seki_driver);
+err_unregister_chardev_file_any:
+    seki_chardev_unregister_file_any();
+err_unregister_chardev_file_seki_device:
+    seki_chardev_unregister_file_seki_device();
 err_unregister_chardev_file_ctl:
     seki_chardev_unregister_file_ctl();
 err_uninit_procfs:
@@ -263,23 +251,26 @@ err_uninit_procfs:
 
 static void __exit seki_driver_exit(void)
 {
+    seki_emulator_unregister();
+
     pci_unregister_driver(&pcie_seki_driver);
 
+    seki_chardev_unregister_file_any();
+
     seki_chardev_unregister_file_seki_device();
 
     seki_chardev_unregister_file_ctl();
 
     seki_uninit_procfs();
 
+    // Devices and files are freed after a grace period
+    rcu_barrier();
+    idr_destroy(&_seki_device_idr);
+
     pr_debug("Driver unloaded\n");
     return;
 }
 
 
-unsigned int _seki_device_count = 0;
-
-int      _seki_device_number_used_map[SEKI_MAX_PCI_DEVICES] = {};
-SekiData _seki_data_array[SEKI_MAX_PCI_DEVICES] = {};
-
 module_init(seki_driver_init);
 module_exit(seki_driver_exit);
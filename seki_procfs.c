@@ -14,11 +14,19 @@
 #include <linux/kernel.h>
 #include <linux/proc_fs.h>
 #include <linux/fs.h>
+#include <linux/idr.h>
 #include <linux/seq_file.h>
 #include <linux/module.h>
+#include <linux/math64.h>
 
 #include "seki_device_defs.h"
+#include "seki_device.h"
 #include "seki_procfs.h"
+#include "seki_dma.h"
+#include "seki_uapi.h"
+#include "seki_iocopy.h"
+#include "seki_sched.h"
+#include "seki_stats.h"
 
 static struct proc_dir_entry *seki_proc_base_dir;
 static struct proc_dir_entry *seki_proc_status_file;
@@ -46,6 +54,73 @@ void seki_uninit_procfs(void)
 
 // File Ops
 // Device files
+static void seki_procfs_show_stats(struct seq_file *f, SekiData *device_data)
+{
+    SekiStats stats;
+    int last = -1;
+
+    seki_stats_read(device_data, &stats);
+
+    seq_puts(f, "\nStatistics:\n");
+    for (int i = 0; i < SEKI_STAT_NR; ++i)
+        seq_printf(f, "    %s:%*s%llu\n", seki_stats_name(i),
+                   (int)(28 - strlen(seki_stats_name(i))), "",
+                   stats.counters[i]);
+
+    // Up to the last non empty bucket, "2^n ns" means [2^n, 2^(n+1))
+    seq_puts(f, "\nLatency Histogram:\n");
+    for (int i = 0; i < SEKI_STAT_LATENCY_BUCKETS; ++i) {
+        if (stats.latency[i])
+            last = i;
+    }
+    for (int i = 0; i <= last; ++i)
+        seq_printf(f, "    2^%-2d ns:%21s%llu\n", i, "",
+                   stats.latency[i]);
+}
+
+// One line per open file, times in us
+static void seki_procfs_show_tenants(struct seq_file *f,
+                                     SekiData *device_data)
+{
+    static const char *const classes[SEKI_SCHED_CLASSES] = {
+        [SEKI_SCHED_RT]     = "rt",
+        [SEKI_SCHED_NORMAL] = "normal",
+        [SEKI_SCHED_BATCH]  = "batch",
+    };
+    struct seki_sched_stats stats;
+    SekiSchedTenant *tenant;
+    SekiFile *file;
+
+    seq_puts(f, "\nTenants:\n");
+    seq_printf(f, "    %7s %-16s %-6s %6s %12s %12s %8s %8s %8s %8s\n",
+               "PID", "Command", "Class", "Weight", "Jobs", "Deferred",
+               "Missed", "Wait", "MaxWait", "Latency");
+
+    rcu_read_lock();
+    list_for_each_entry_rcu(file, &device_data->files, node) {
+        tenant = READ_ONCE(file->sched);
+        if (!tenant)
+            continue;
+
+        seki_sched_read_stats(tenant, &stats);
+
+        seq_printf(f, "    %7d %-16s %-6s %6u %12llu %12llu %8llu "
+                   "%8llu %8llu %8llu\n",
+                   tenant->pid, tenant->comm,
+                   classes[READ_ONCE(tenant->sched_class)],
+                   READ_ONCE(tenant->weight),
+                   stats.jobs, stats.deferred, stats.deadline_missed,
+                   stats.deferred ?
+                           div64_u64(stats.wait_ns,
+                                     stats.deferred * NSEC_PER_USEC) : 0,
+                   div_u64(stats.wait_max_ns, NSEC_PER_USEC),
+                   stats.completed ?
+                           div64_u64(stats.latency_ns,
+                                     stats.completed * NSEC_PER_USEC) : 0);
+    }
+    rcu_read_unlock();
+}
+
 static int seki_procfs_file_dev_show(struct seq_file *f, void *data)
 {
     SekiData *device_data;
@@ -67,6 +142,13 @@ static int seki_procfs_file_dev_show(struct seq_file *f, void *data)
                "Output MMIO Physical:           0x%016lx\n"
                "Output MMIO Kernel Virtual:     0x%016lx\n"
                "Output MMIO Length:             0x%04lxMB\n"
+               "DMA Engine:                     %s\n"
+               "MMIO Copy:                      %s\n"
+               "Queues:                         %d\n"
+               "IRQ Vectors:                    %d\n"
+               "Staging Slots:                  %d x %luKB\n"
+               "Output Ring:                    %uKB\n"
+               "NUMA Node:                      %d\n"
                ,
                device_data->board_revision,
 
@@ -80,8 +162,24 @@ static int seki_procfs_file_dev_show(struct seq_file *f, void *data)
 
                device_data->output_mmio_physical_addr,
                (unsigned long)device_data->output_mmio_virtual_addr,
-               device_data->output_mmio_length / 0x100000
+               device_data->output_mmio_length / 0x100000,
+
+               device_data->dma_engine ? device_data->dma_engine->name
+                                       : "none",
+               device_data->iocopy ? device_data->iocopy->name : "none",
+
+               device_data->nr_queues,
+               device_data->nr_irq_vectors,
+               device_data->nr_stage_slots,
+               device_data->stage_slot_size >> 10,
+               READ_ONCE(device_data->oring_file) ?
+                       READ_ONCE(device_data->oring_size) >> 10 : 0,
+               device_data->node
                );
+
+    seki_procfs_show_stats(f, device_data);
+    seki_procfs_show_tenants(f, device_data);
+
     return 0;
 }
 
@@ -126,6 +224,10 @@ void seki_procfs_remove_file_device(SekiData *seki_data)
 // Procfs status file
 static int seki_procfs_file_status_show(struct seq_file *f, void *data)
 {
+    SekiData *device_data;
+    SekiStats stats;
+    int id;
+
     SEKI_UNUSED(data);
 
     seq_printf(f,
@@ -135,12 +237,12 @@ static int seki_procfs_file_status_show(struct seq_file *f, void *data)
                _seki_device_count
                );
 
-    for (int i = 0; i < _seki_device_count; ++i) {
-        if (!_seki_data_array[i].used) {
-            pr_debug("_seki_data_array corrupted\n");
-
+    rcu_read_lock();
+    idr_for_each_entry(&_seki_device_idr, device_data, id) {
+        if (!READ_ONCE(device_data->used))
             continue;
-        }
+
+        seki_stats_read(device_data, &stats);
 
         seq_printf(f,
                    "Device %2d:\n"
@@ -149,17 +251,24 @@ static int seki_procfs_file_status_show(struct seq_file *f, void *data)
                    "    Control Mem Region: %3luMB\n"
                    "    Input Mem Region:   %3luMB\n"
                    "    Output Mem Region:  %3luMB\n"
+                   "    NUMA Node:             %2d\n"
+                   "    Jobs Submitted:     %llu\n"
+                   "    Jobs Completed:     %llu\n"
                    "\n"
                    ,
-                   _seki_data_array[i].device_num,
-                   _seki_data_array[i].slot,
-                   _seki_data_array[i].board_revision,
-                   _seki_data_array[i].ctrl_mmio_length / 0x100000,
-                   _seki_data_array[i].input_mmio_length / 0x100000,
-                   _seki_data_array[i].output_mmio_length / 0x100000
+                   device_data->device_num,
+                   device_data->slot,
+                   device_data->board_revision,
+                   device_data->ctrl_mmio_length / 0x100000,
+                   device_data->input_mmio_length / 0x100000,
+                   device_data->output_mmio_length / 0x100000,
+                   device_data->node,
+                   stats.counters[SEKI_STAT_JOBS_SUBMITTED],
+                   stats.counters[SEKI_STAT_JOBS_COMPLETED]
                    );
 
     }
+    rcu_read_unlock();
 
     return 0;
 }
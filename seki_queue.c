@@ -0,0 +1,348 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_queue.c>
+ * Hardware job queues.
+ *
+ * Each queue is a descriptor ring and a completion ring in coherent
+ * memory. A batch of jobs is written to the SQ and published with a
+ * single SQ_TAIL doorbell. Any free tag implies a free SQ slot, since a
+ * descriptor is always fetched before its job completes.
+ *
+ * Every CPU submits to its own queue (see cpu_queue_map), each with its
+ * own SQ lock, CQ lock, doorbell and slice of the input window, so cores
+ * only meet on a queue when there are more cores than queues.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/cpumask.h>
+#include <linux/dma-mapping.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include <linux/slab.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_chain.h"
+#include "seki_irq.h"
+#include "seki_ring.h"
+#include "seki_queue.h"
+#include "seki_sched.h"
+#include "seki_stats.h"
+#include "seki_trace.h"
+
+static inline u32 seki_queue_reg_read(SekiQueue *queue, unsigned int reg)
+{
+    return seki_reg_read(queue->device_data,
+                         SEKI_REG_QUEUE_BASE(queue->index) + reg);
+}
+
+static inline void seki_queue_reg_write(SekiQueue *queue, unsigned int reg,
+                                        u32 value)
+{
+    seki_reg_write(queue->device_data,
+                   SEKI_REG_QUEUE_BASE(queue->index) + reg, value);
+}
+
+// Submission & completion
+SekiQueue *seki_queue_for_cpu(SekiData *device_data)
+{
+    // Being migrated right after this only costs locality
+    return device_data->queues +
+           device_data->cpu_queue_map[raw_smp_processor_id()];
+}
+
+// Under sq_lock, see seki_sched.c. Completions go to job->ring, or to
+// job->chain if it is a chain (ring 0). False if the queue is full.
+bool seki_queue_push(SekiQueue *queue, const SekiQueueJob *job,
+                     const struct seki_job_desc *desc)
+{
+    SekiHwDesc *hw;
+    unsigned int tag;
+
+    tag = find_first_zero_bit(queue->tags, SEKI_QUEUE_DEPTH);
+    if (tag >= SEKI_QUEUE_DEPTH)
+        return false;
+
+    // Atomic, the completion path clears bits without sq_lock
+    set_bit(tag, queue->tags);
+    queue->jobs[tag] = *job;
+
+    hw = queue->sq + (queue->sq_tail & (SEKI_QUEUE_DEPTH - 1));
+    hw->input_offset  = cpu_to_le64(desc->input_offset);
+    hw->input_length  = cpu_to_le32(desc->input_length);
+    hw->output_length = cpu_to_le32(desc->output_length);
+    hw->tag           = cpu_to_le32(tag);
+    if (desc->flags & SEKI_JOB_STREAM) {
+        // The record gets user_data, the ring decides where
+        hw->output_offset = cpu_to_le64(desc->user_data);
+        hw->opcode        = cpu_to_le32(desc->opcode | SEKI_HW_OP_STREAM);
+    } else {
+        hw->output_offset = cpu_to_le64(desc->output_offset);
+        hw->opcode        = cpu_to_le32(desc->opcode);
+    }
+    ++queue->sq_tail;
+
+    trace_seki_job_submit(queue->device_data->device_num, queue->index,
+                          tag, desc->user_data, desc->opcode,
+                          desc->input_length, desc->output_length);
+
+    return true;
+}
+
+// Under sq_lock, one doorbell for count jobs pushed
+void seki_queue_doorbell(SekiQueue *queue, unsigned int count, u64 bytes_in)
+{
+    if (!count)
+        return;
+
+    wmb();
+    seki_queue_reg_write(queue, SEKI_QREG_SQ_TAIL, queue->sq_tail);
+    trace_seki_doorbell(queue->device_data->device_num, queue->index,
+                        queue->sq_tail, count);
+
+    seki_stats_add(queue->device_data, SEKI_STAT_JOBS_SUBMITTED, count);
+    seki_stats_add(queue->device_data, SEKI_STAT_BYTES_IN, bytes_in);
+    seki_stats_inc(queue->device_data, SEKI_STAT_DOORBELLS);
+}
+
+// Service time estimate, mean += (sample - mean) / 8
+static inline void seki_queue_account(SekiQueue *queue, u64 service_ns)
+{
+    u64 mean = queue->mean_service_ns;
+
+    WRITE_ONCE(queue->mean_service_ns, mean - (mean >> 3) + (service_ns >> 3));
+}
+
+void seki_queue_reap(SekiQueue *queue)
+{
+    SekiData *device_data = queue->device_data;
+    unsigned long flags;
+    u64 completed = 0;
+    u64 errors = 0;
+    u64 bytes_out = 0;
+    u64 now;
+    u32 tail;
+
+    spin_lock_irqsave(&queue->cq_lock, flags);
+
+    tail = seki_queue_reg_read(queue, SEKI_QREG_CQ_TAIL);
+    if (tail == queue->cq_head) {
+        spin_unlock_irqrestore(&queue->cq_lock, flags);
+        return;
+    }
+
+    // CQ entries must not be read before the tail
+    rmb();
+
+    now = ktime_get_ns();
+
+    // Files of the jobs are freed after a grace period
+    rcu_read_lock();
+
+    while (queue->cq_head != tail) {
+        SekiHwCqe *cqe = queue->cq + (queue->cq_head & (SEKI_QUEUE_DEPTH - 1));
+        u32 tag = le32_to_cpu(cqe->tag);
+        s32 status = (s32)le32_to_cpu(cqe->status);
+        u32 output_length = le32_to_cpu(cqe->output_length);
+        SekiQueueJob job;
+        SekiFile *file;
+
+        ++queue->cq_head;
+
+        if (tag >= SEKI_QUEUE_DEPTH || !test_bit(tag, queue->tags)) {
+            pr_err("Dev %d queue %d completed bogus tag %u\n",
+                   device_data->device_num, queue->index, tag);
+            trace_seki_job_error(device_data->device_num, queue->index, 0,
+                                 -EIO);
+            continue;
+        }
+
+        // A copy, the tag is free for the next job once cleared
+        job = queue->jobs[tag];
+        seki_queue_account(queue, now - job.submit_ns);
+        seki_stats_latency(device_data, now - job.submit_ns);
+        trace_seki_job_complete(device_data->device_num, queue->index, tag,
+                                job.user_data, status, output_length,
+                                now - job.submit_ns);
+        queue->jobs[tag].ring = 0;
+        queue->jobs[tag].chain = 0;
+        clear_bit_unlock(tag, queue->tags);
+
+        ++completed;
+        if (status < 0)
+            ++errors;
+        else
+            bytes_out += output_length;
+
+        // Before the ring reference, which holds the tenant, goes
+        file = READ_ONCE(job.tenant->file);
+        seki_sched_complete(queue, &job, now);
+        if (job.chain)
+            seki_chain_complete(job.chain, job.user_data, status,
+                                output_length);
+        else
+            seki_ring_complete(job.ring, job.user_data, status,
+                               output_length);
+
+        // After the completion is posted, so the file finds it
+        if (file)
+            seki_irq_notify_file(file, queue->index);
+    }
+
+    rcu_read_unlock();
+
+    seki_queue_reg_write(queue, SEKI_QREG_CQ_HEAD, queue->cq_head);
+
+    spin_unlock_irqrestore(&queue->cq_lock, flags);
+
+    // Tags freed up, let waiting jobs have them
+    seki_sched_dispatch(queue);
+
+    seki_stats_add(device_data, SEKI_STAT_JOBS_COMPLETED, completed);
+    seki_stats_add(device_data, SEKI_STAT_JOB_ERRORS, errors);
+    seki_stats_add(device_data, SEKI_STAT_BYTES_OUT, bytes_out);
+}
+
+// Init & uninit
+static void seki_queue_free(SekiQueue *queue)
+{
+    struct device *dev = queue->device_data->device;
+
+    if (queue->sq)
+        dma_free_coherent(dev, SEKI_QUEUE_DEPTH * sizeof(SekiHwDesc),
+                          queue->sq, queue->sq_bus);
+    if (queue->cq)
+        dma_free_coherent(dev, SEKI_QUEUE_DEPTH * sizeof(SekiHwCqe),
+                          queue->cq, queue->cq_bus);
+    kfree(queue->jobs);
+
+    queue->sq = 0;
+    queue->cq = 0;
+    queue->jobs = 0;
+}
+
+// Consecutive CPUs share a queue, so siblings end up together
+static int seki_queue_map_cpus(SekiData *device_data)
+{
+    unsigned int i = 0;
+    unsigned int cpu;
+
+    device_data->cpu_queue_map = kcalloc(nr_cpu_ids,
+                                         sizeof(*device_data->cpu_queue_map),
+                                         GFP_KERNEL);
+    if (!device_data->cpu_queue_map)
+        return -ENOMEM;
+
+    for_each_possible_cpu(cpu)
+        device_data->cpu_queue_map[cpu] =
+                i++ * device_data->nr_queues / num_possible_cpus();
+
+    return 0;
+}
+
+int seki_queue_init_device(SekiData *device_data)
+{
+    struct device *dev = device_data->device;
+    unsigned long slice;
+
+    device_data->nr_queues = clamp_t(u32,
+            seki_reg_read(device_data, SEKI_REG_NUM_QUEUES),
+            1, SEKI_MAX_QUEUES);
+
+    if (seki_queue_map_cpus(device_data))
+        return -ENOMEM;
+
+    // Staging slots, if any, are at the top
+    slice = (device_data->stage_offset / device_data->nr_queues) & PAGE_MASK;
+
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q) {
+        SekiQueue *queue = device_data->queues + q;
+
+        queue->device_data = device_data;
+        queue->index = q;
+        queue->input_offset = q * slice;
+        queue->input_length = slice;
+        spin_lock_init(&queue->sq_lock);
+        spin_lock_init(&queue->cq_lock);
+        seki_sched_init_queue(queue);
+        queue->mean_service_ns = 0;
+        queue->sq_tail = 0;
+        queue->cq_head = 0;
+        bitmap_zero(queue->tags, SEKI_QUEUE_DEPTH);
+        atomic_long_set(&queue->completions, 0);
+
+        queue->sq = dma_alloc_coherent(dev,
+                                       SEKI_QUEUE_DEPTH * sizeof(SekiHwDesc),
+                                       &queue->sq_bus, GFP_KERNEL);
+        queue->cq = dma_alloc_coherent(dev,
+                                       SEKI_QUEUE_DEPTH * sizeof(SekiHwCqe),
+                                       &queue->cq_bus, GFP_KERNEL);
+        queue->jobs = kcalloc_node(SEKI_QUEUE_DEPTH, sizeof(SekiQueueJob),
+                                   GFP_KERNEL, device_data->node);
+        if (!queue->sq || !queue->cq || !queue->jobs) {
+            pr_err("Failed to allocate queue %d of dev %d\n",
+                   q, device_data->device_num);
+
+            device_data->nr_queues = q + 1;
+            seki_queue_uninit_device(device_data);
+            return -ENOMEM;
+        }
+
+        seki_queue_reg_write(queue, SEKI_QREG_SQ_ADDR_LO,
+                             lower_32_bits(queue->sq_bus));
+        seki_queue_reg_write(queue, SEKI_QREG_SQ_ADDR_HI,
+                             upper_32_bits(queue->sq_bus));
+        seki_queue_reg_write(queue, SEKI_QREG_CQ_ADDR_LO,
+                             lower_32_bits(queue->cq_bus));
+        seki_queue_reg_write(queue, SEKI_QREG_CQ_ADDR_HI,
+                             upper_32_bits(queue->cq_bus));
+        seki_queue_reg_write(queue, SEKI_QREG_DEPTH, SEKI_QUEUE_DEPTH);
+        seki_queue_reg_write(queue, SEKI_QREG_SQ_TAIL, 0);
+        seki_queue_reg_write(queue, SEKI_QREG_CQ_HEAD, 0);
+        seki_queue_reg_write(queue, SEKI_QREG_CONTROL,
+                             SEKI_QUEUE_CONTROL_ENABLE);
+    }
+
+    return 0;
+}
+
+void seki_queue_uninit_device(SekiData *device_data)
+{
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q) {
+        SekiQueue *queue = device_data->queues + q;
+        unsigned int tag;
+
+        if (queue->sq)
+            seki_queue_reg_write(queue, SEKI_QREG_CONTROL, 0);
+
+        // Whatever is waiting or in flight will never complete
+        seki_sched_uninit_queue(queue);
+        for_each_set_bit(tag, queue->tags, SEKI_QUEUE_DEPTH) {
+            SekiQueueJob *job = queue->jobs + tag;
+
+            seki_sched_complete(queue, job, ktime_get_ns());
+            if (job->chain)
+                seki_chain_complete(job->chain, job->user_data, -ENODEV, 0);
+            else
+                seki_ring_complete(job->ring, job->user_data, -ENODEV, 0);
+            job->ring = 0;
+            job->chain = 0;
+        }
+        bitmap_zero(queue->tags, SEKI_QUEUE_DEPTH);
+
+        seki_queue_free(queue);
+    }
+
+    kfree(device_data->cpu_queue_map);
+    device_data->cpu_queue_map = 0;
+    device_data->nr_queues = 0;
+}
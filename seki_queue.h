@@ -0,0 +1,33 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_queue.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_QUEUE_H
+#define SEKI_QUEUE_H
+
+#include <linux/types.h>
+
+struct SekiData;
+struct SekiQueue;
+struct SekiQueueJob;
+struct seki_job_desc;
+
+int seki_queue_init_device(struct SekiData *device_data);
+void seki_queue_uninit_device(struct SekiData *device_data);
+
+struct SekiQueue *seki_queue_for_cpu(struct SekiData *device_data);
+bool seki_queue_push(struct SekiQueue *queue, const struct SekiQueueJob *job,
+                     const struct seki_job_desc *desc);
+void seki_queue_doorbell(struct SekiQueue *queue, unsigned int count,
+                         u64 bytes_in);
+void seki_queue_reap(struct SekiQueue *queue);
+
+
+#endif // SEKI_QUEUE_H
@@ -0,0 +1,138 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_regs.h>
+ * Register map of the control window (BAR0).
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_REGS_H
+#define SEKI_REGS_H
+
+#include <linux/io.h>
+#include <linux/types.h>
+
+#include "seki_device_defs.h"
+
+// Identification
+#define SEKI_REG_ID                 0x0000
+#define SEKI_REG_CAPS               0x0004
+#define SEKI_CAP_DMA                (1u << 0)   // Has a descriptor DMA engine
+#define SEKI_CAP_SENSORS            (1u << 1)   // Temperature & clock below
+#define SEKI_REG_NUM_QUEUES         0x0008      // Hardware job queues
+
+// Interrupts. Queue q raises vector (q % SEKI_REG_IRQ_VECTORS), the DMA
+// engine and the output ring raise vector 0.
+#define SEKI_REG_IRQ_STATUS         0x0010      // Write 1 to clear
+#define SEKI_REG_IRQ_MASK           0x0014      // 1 = enabled
+#define SEKI_REG_IRQ_VECTORS        0x0018      // Vectors granted by host
+#define SEKI_IRQ_QUEUE(q)           (1u << (q))
+#define SEKI_IRQ_ORING              (1u << 30)
+#define SEKI_IRQ_DMA                (1u << 31)
+
+// Sensors, if SEKI_CAP_SENSORS
+#define SEKI_REG_TEMPERATURE        0x0020      // Millidegrees C, signed
+#define SEKI_REG_CLOCK_KHZ          0x0024      // Core clock
+
+// DMA engine
+#define SEKI_REG_DMA_DESC_ADDR_LO   0x0100      // Bus address of the table
+#define SEKI_REG_DMA_DESC_ADDR_HI   0x0104
+#define SEKI_REG_DMA_DESC_COUNT     0x0108
+#define SEKI_REG_DMA_CONTROL        0x010c      // Write 0 to stop
+#define SEKI_DMA_CONTROL_START      (1u << 0)
+#define SEKI_REG_DMA_STATUS         0x0110      // Write 1 to clear DONE/ERROR
+#define SEKI_DMA_STATUS_BUSY        (1u << 0)
+#define SEKI_DMA_STATUS_DONE        (1u << 1)
+#define SEKI_DMA_STATUS_ERROR       (1u << 2)
+
+// DMA descriptor, fetched by the device from host memory. Little endian.
+typedef struct SekiDmaDesc {
+    __le64  host_addr;
+    __le64  device_offset;  // Into the input or output window
+    __le32  length;
+    __le32  flags;
+} SekiDmaDesc;
+
+#define SEKI_DMA_DESC_TO_DEVICE     (1u << 0)   // Host -> input window
+#define SEKI_DMA_DESC_LAST          (1u << 1)
+
+// Staging slots, STAGE_COUNT slots of STAGE_SIZE bytes from STAGE_OFFSET
+// in the input window. The host writes OWNER = DEVICE before submitting
+// the job that reads a slot; the device writes OWNER = HOST and bumps
+// DONE as soon as it has read the input, possibly before the job
+// completes. STAGE_COUNT = 0 turns them off.
+#define SEKI_REG_STAGE_OFFSET       0x0200
+#define SEKI_REG_STAGE_SIZE         0x0204
+#define SEKI_REG_STAGE_COUNT        0x0208
+#define SEKI_REG_STAGE_SLOT(s)      (0x0300 + (s) * 0x08)
+#define SEKI_SREG_OWNER             0x00
+#define SEKI_STAGE_OWNER_HOST       0
+#define SEKI_STAGE_OWNER_DEVICE     1
+#define SEKI_SREG_DONE              0x04    // Hand backs, free running
+
+// Output ring, ORING_SIZE bytes (power of 2) at ORING_OFFSET in the
+// output window. Jobs with SEKI_HW_OP_STREAM append a seki_oring_record
+// there instead of writing at output_offset, which carries the record's
+// user_data instead. HEAD and TAIL are free running byte counts. The
+// device stalls the job while the record does not fit, and raises
+// SEKI_IRQ_ORING after appending if TAIL - HEAD >= ORING_WATERMARK.
+// Clearing ENABLE makes stream jobs fail with -ENODEV.
+#define SEKI_REG_ORING_OFFSET       0x0240
+#define SEKI_REG_ORING_SIZE         0x0244
+#define SEKI_REG_ORING_WATERMARK    0x0248
+#define SEKI_REG_ORING_HEAD         0x024c  // Host consumed
+#define SEKI_REG_ORING_TAIL         0x0250  // Device produced
+#define SEKI_REG_ORING_CONTROL      0x0254
+#define SEKI_ORING_CONTROL_ENABLE   (1u << 0)
+
+// Hardware job queues. The host posts SekiHwDesc entries to the SQ and
+// rings SQ_TAIL; the device posts SekiHwCqe entries to the CQ, advances
+// CQ_TAIL and raises SEKI_IRQ_QUEUE(q). Completions may be out of order,
+// jobs are matched by tag.
+#define SEKI_REG_QUEUE_BASE(q)      (0x1000 + (q) * 0x40)
+#define SEKI_QREG_SQ_ADDR_LO        0x00
+#define SEKI_QREG_SQ_ADDR_HI        0x04
+#define SEKI_QREG_CQ_ADDR_LO        0x08
+#define SEKI_QREG_CQ_ADDR_HI        0x0c
+#define SEKI_QREG_DEPTH             0x10    // Entries in both rings, pow2
+#define SEKI_QREG_SQ_TAIL           0x14    // Doorbell, free running
+#define SEKI_QREG_CQ_HEAD           0x18    // Host consumed, free running
+#define SEKI_QREG_CQ_TAIL           0x1c    // Device produced, free running
+#define SEKI_QREG_CONTROL           0x20
+#define SEKI_QUEUE_CONTROL_ENABLE   (1u << 0)
+
+typedef struct SekiHwDesc {
+    __le64  input_offset;
+    __le64  output_offset;
+    __le32  input_length;
+    __le32  output_length;
+    __le32  opcode;
+    __le32  tag;
+} SekiHwDesc;
+
+#define SEKI_HW_OP_STREAM           (1u << 31)  // In opcode, see ORING
+
+typedef struct SekiHwCqe {
+    __le32  tag;
+    __le32  status;         // 0 or a negative errno
+    __le32  output_length;
+    __le32  reserved;
+} SekiHwCqe;
+
+static inline u32 seki_reg_read(SekiData *device_data, unsigned int reg)
+{
+    return ioread32((u8 __iomem *)device_data->ctrl_mmio_virtual_addr + reg);
+}
+
+static inline void seki_reg_write(SekiData *device_data, unsigned int reg,
+                                  u32 value)
+{
+    iowrite32(value, (u8 __iomem *)device_data->ctrl_mmio_virtual_addr + reg);
+}
+
+
+#endif // SEKI_REGS_H
@@ -0,0 +1,571 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_ring.c>
+ * Submission/completion rings shared with userspace.
+ *
+ * The SQ is only ever read once per entry: each SQE is copied into
+ * ring->batch, validated there and handed to the hardware queue from the
+ * copy, so userspace rewriting the SQ behind our back changes nothing.
+ *
+ * Waiting for completions either sleeps until the interrupt, spins on the
+ * CQ_TAIL registers of the queues the ring used, or does both: sleep for
+ * half the mean service time of those queues, then spin. The last one is
+ * the NVMe hybrid polling trick, most of the latency of spinning for a
+ * fraction of the CPU.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/hrtimer.h>
+#include <linux/log2.h>
+#include <linux/module.h>
+#include <linux/mm.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_alloc.h"
+#include "seki_oring.h"
+#include "seki_queue.h"
+#include "seki_ring.h"
+#include "seki_sched.h"
+#include "seki_stats.h"
+#include "seki_trace.h"
+
+#define SEKI_RING_MAX_ENTRIES   4096
+#define SEKI_RING_MAX_BATCH     SEKI_QUEUE_DEPTH
+
+static unsigned int poll_mode = SEKI_POLL_IRQ;
+module_param(poll_mode, uint, 0644);
+MODULE_PARM_DESC(poll_mode,
+                 "Completion wait mode of new files: 0 irq, 1 spin, 2 hybrid");
+
+unsigned int seki_ring_default_poll_mode(void)
+{
+    unsigned int mode = READ_ONCE(poll_mode);
+
+    return mode > SEKI_POLL_HYBRID ? SEKI_POLL_IRQ : mode;
+}
+
+// Refcounting
+static void seki_ring_free(struct kref *ref)
+{
+    SekiRing *ring = container_of(ref, SekiRing, ref);
+
+    // Nothing can use them any more, see seki_alloc_release_file()
+    seki_alloc_release_chunks(ring->device_data, &ring->chunks);
+    if (ring->tenant)
+        seki_sched_tenant_put(ring->tenant);
+    vfree(ring->mem);
+    kfree(ring->batch);
+    kfree(ring->batch_status);
+    kfree(ring);
+}
+
+void seki_ring_get(SekiRing *ring)
+{
+    kref_get(&ring->ref);
+}
+
+void seki_ring_put(SekiRing *ring)
+{
+    kref_put(&ring->ref, seki_ring_free);
+}
+
+// Completion side
+static inline u32 seki_ring_cq_ready(SekiRing *ring)
+{
+    return READ_ONCE(ring->cq_tail) - READ_ONCE(ring->header->cq_head);
+}
+
+static void seki_ring_post(SekiRing *ring, u64 user_data, s32 status,
+                           u32 output_length)
+{
+    struct seki_completion *cqe;
+    unsigned long flags;
+
+    spin_lock_irqsave(&ring->cq_lock, flags);
+
+    if (ring->cq_tail - READ_ONCE(ring->header->cq_head) >=
+        ring->cq_entries) {
+        // Userspace is not reaping, nothing we can do but count it
+        WRITE_ONCE(ring->header->cq_overflow,
+                   ring->header->cq_overflow + 1);
+    } else {
+        cqe = ring->cqes + (ring->cq_tail & (ring->cq_entries - 1));
+        cqe->user_data     = user_data;
+        cqe->status        = status;
+        cqe->output_length = output_length;
+
+        ++ring->cq_tail;
+        smp_store_release(&ring->header->cq_tail, ring->cq_tail);
+    }
+
+    spin_unlock_irqrestore(&ring->cq_lock, flags);
+
+    wake_up_interruptible(&ring->cq_wait);
+}
+
+// Called by the queue once the device is done with a job
+void seki_ring_complete(SekiRing *ring, u64 user_data, s32 status,
+                        u32 output_length)
+{
+    seki_ring_post(ring, user_data, status, output_length);
+    atomic_dec(&ring->inflight);
+    seki_ring_put(ring);
+}
+
+static void seki_ring_reap_queues(SekiRing *ring)
+{
+    SekiData *device_data = ring->device_data;
+    unsigned long mask = READ_ONCE(ring->queue_mask);
+    unsigned int q;
+
+    for_each_set_bit(q, &mask, SEKI_MAX_QUEUES)
+        seki_queue_reap(device_data->queues + q);
+}
+
+static u64 seki_ring_service_estimate(SekiRing *ring)
+{
+    SekiData *device_data = ring->device_data;
+    unsigned long mask = READ_ONCE(ring->queue_mask);
+    u64 estimate = U64_MAX;
+    unsigned int q;
+
+    // Shortest of the queues in use, oversleeping is what hurts
+    for_each_set_bit(q, &mask, SEKI_MAX_QUEUES)
+        estimate = min(estimate,
+                       READ_ONCE(device_data->queues[q].mean_service_ns));
+
+    return estimate == U64_MAX ? 0 : estimate;
+}
+
+static int seki_ring_wait_irq(SekiRing *ring, u32 min_complete)
+{
+    SekiData *device_data = ring->device_data;
+    long timeout;
+    long rv;
+
+    while (seki_ring_cq_ready(ring) < min_complete) {
+        // Removed, what is still in flight never completes
+        if (!READ_ONCE(device_data->used))
+            return -ENODEV;
+
+        // Without interrupts nobody else is going to reap
+        if (!device_data->nr_irq_vectors) {
+            seki_ring_reap_queues(ring);
+            timeout = 1;
+        } else {
+            timeout = MAX_SCHEDULE_TIMEOUT;
+        }
+
+        rv = wait_event_interruptible_timeout(ring->cq_wait,
+                seki_ring_cq_ready(ring) >= min_complete ||
+                !READ_ONCE(device_data->used), timeout);
+        if (rv < 0)
+            return rv;
+    }
+
+    return 0;
+}
+
+static int seki_ring_wait_spin(SekiRing *ring, u32 min_complete, int hybrid)
+{
+    if (seki_ring_cq_ready(ring) >= min_complete)
+        return 0;
+
+    if (hybrid) {
+        ktime_t sleep = ns_to_ktime(seki_ring_service_estimate(ring) / 2);
+
+        if (sleep) {
+            set_current_state(TASK_INTERRUPTIBLE);
+            schedule_hrtimeout(&sleep, HRTIMER_MODE_REL);
+        }
+    }
+
+    while (seki_ring_cq_ready(ring) < min_complete) {
+        if (!READ_ONCE(ring->device_data->used))
+            return -ENODEV;
+
+        seki_ring_reap_queues(ring);
+
+        if (signal_pending(current))
+            return -ERESTARTSYS;
+
+        if (need_resched())
+            cond_resched();
+        else
+            cpu_relax();
+    }
+
+    return 0;
+}
+
+static int seki_ring_wait(SekiRing *ring, u32 min_complete,
+                          unsigned int mode)
+{
+    if (min_complete > ring->cq_entries)
+        return -EINVAL;
+
+    switch (mode) {
+    case SEKI_POLL_SPIN:
+        return seki_ring_wait_spin(ring, min_complete, 0);
+    case SEKI_POLL_HYBRID:
+        return seki_ring_wait_spin(ring, min_complete, 1);
+    default:
+        return seki_ring_wait_irq(ring, min_complete);
+    }
+}
+
+// Submission side
+s32 seki_ring_validate(SekiFile *file, const struct seki_job_desc *desc)
+{
+    SekiData *device_data = file->device_data;
+    int stream = desc->flags & SEKI_JOB_STREAM;
+
+    if ((desc->flags & ~SEKI_JOB_STREAM) || desc->reserved ||
+        (desc->opcode & SEKI_HW_OP_STREAM))
+        return -EINVAL;
+
+    if (desc->input_length > device_data->input_mmio_length ||
+        desc->input_offset >
+                device_data->input_mmio_length - desc->input_length)
+        return -EINVAL;
+
+    // Appended to the output ring of this file, output_offset unused
+    if (stream) {
+        if (seki_oring_validate(file, desc->output_length))
+            return -EINVAL;
+    } else if (desc->output_length > device_data->output_mmio_length ||
+               desc->output_offset >
+                    device_data->output_mmio_length - desc->output_length) {
+        return -EINVAL;
+    }
+
+    // Only the chunks of this file
+    if (!seki_alloc_owns(file, SEKI_WINDOW_INPUT, desc->input_offset,
+                         desc->input_length) ||
+        (!stream &&
+         !seki_alloc_owns(file, SEKI_WINDOW_OUTPUT, desc->output_offset,
+                          desc->output_length)))
+        return -EACCES;
+
+    return 0;
+}
+
+static int seki_ring_submit(SekiFile *file, SekiRing *ring, u32 to_submit)
+{
+    SekiData *device_data = ring->device_data;
+    SekiQueue *queue = seki_queue_for_cpu(device_data);
+    u32 submitted = 0;
+    int rv = 0;
+
+    if (mutex_lock_interruptible(&ring->submit_lock))
+        return -ERESTARTSYS;
+
+    if (!test_bit(queue->index, &ring->queue_mask))
+        set_bit(queue->index, &ring->queue_mask);
+
+    while (submitted < to_submit) {
+        u32 tail = smp_load_acquire(&ring->header->sq_tail);
+        u32 avail = tail - ring->sq_head;
+        u32 cq_space;
+        u32 budget;
+        u32 scanned;
+        u32 valid = 0;
+        u32 accepted;
+        u32 consumed;
+
+        if (avail > ring->sq_entries) {
+            rv = -EINVAL;   // Userspace corrupted sq_tail
+            break;
+        }
+
+        // Never have more in flight than the CQ can take
+        cq_space = ring->cq_entries - seki_ring_cq_ready(ring) -
+                   atomic_read(&ring->inflight);
+        if (cq_space > ring->cq_entries)
+            cq_space = 0;
+
+        budget = min3(to_submit - submitted, avail, cq_space);
+        budget = min_t(u32, budget, SEKI_RING_MAX_BATCH);
+        if (!budget)
+            break;
+
+        for (scanned = 0; scanned < budget; ++scanned) {
+            struct seki_job_desc *desc = ring->batch + valid;
+
+            memcpy(desc, ring->sqes +
+                   ((ring->sq_head + scanned) & (ring->sq_entries - 1)),
+                   sizeof(*desc));
+
+            ring->batch_status[scanned] = seki_ring_validate(file, desc);
+            if (!ring->batch_status[scanned])
+                ++valid;
+        }
+
+        atomic_add(valid, &ring->inflight);
+        accepted = 0;
+        if (valid)
+            accepted = seki_sched_submit(queue, ring, 0, ring->batch, valid);
+        atomic_sub(valid - accepted, &ring->inflight);
+
+        // Consume up to the first valid SQE the queue had no room for
+        consumed = scanned;
+        if (accepted < valid) {
+            u32 seen = 0;
+
+            for (consumed = 0; consumed < scanned; ++consumed) {
+                if (!ring->batch_status[consumed] && seen++ == accepted)
+                    break;
+            }
+        }
+
+        // Invalid SQEs complete right away
+        for (u32 i = 0; i < consumed; ++i) {
+            if (ring->batch_status[i]) {
+                struct seki_job_desc *sqe = ring->sqes +
+                        ((ring->sq_head + i) & (ring->sq_entries - 1));
+                u64 user_data = READ_ONCE(sqe->user_data);
+
+                seki_ring_post(ring, user_data, ring->batch_status[i], 0);
+                seki_stats_inc(device_data, SEKI_STAT_JOB_ERRORS);
+                trace_seki_job_error(device_data->device_num, -1, user_data,
+                                     ring->batch_status[i]);
+            }
+        }
+
+        ring->sq_head += consumed;
+        smp_store_release(&ring->header->sq_head, ring->sq_head);
+        submitted += consumed;
+
+        if (accepted < valid)
+            break;  // Queue is full, or our share of it
+    }
+
+    mutex_unlock(&ring->submit_lock);
+
+    return submitted ? submitted : rv;
+}
+
+// A job the driver built itself, e.g. seki_stage.c, rather than an SQE.
+// Completes on the CQ like the others. -EBUSY if the CQ or the hardware
+// queue has no room.
+int seki_ring_submit_one(SekiRing *ring, const struct seki_job_desc *desc)
+{
+    SekiData *device_data = ring->device_data;
+    SekiQueue *queue = seki_queue_for_cpu(device_data);
+    int rv = 0;
+
+    if (mutex_lock_interruptible(&ring->submit_lock))
+        return -ERESTARTSYS;
+
+    if (!test_bit(queue->index, &ring->queue_mask))
+        set_bit(queue->index, &ring->queue_mask);
+
+    if (seki_ring_cq_ready(ring) + atomic_read(&ring->inflight) >=
+        ring->cq_entries) {
+        rv = -EBUSY;
+    } else {
+        atomic_inc(&ring->inflight);
+        if (!seki_sched_submit(queue, ring, 0, desc, 1)) {
+            atomic_dec(&ring->inflight);
+            rv = -EBUSY;
+        }
+    }
+
+    mutex_unlock(&ring->submit_lock);
+
+    return rv;
+}
+
+// One CQE for a job the caller submits to queue itself, e.g. a whole
+// chain (seki_chain.c). Holds a reference until seki_ring_complete().
+int seki_ring_reserve(SekiRing *ring, SekiQueue *queue)
+{
+    int rv = 0;
+
+    if (mutex_lock_interruptible(&ring->submit_lock))
+        return -ERESTARTSYS;
+
+    if (!test_bit(queue->index, &ring->queue_mask))
+        set_bit(queue->index, &ring->queue_mask);
+
+    if (seki_ring_cq_ready(ring) + atomic_read(&ring->inflight) >=
+        ring->cq_entries) {
+        rv = -EBUSY;
+    } else {
+        atomic_inc(&ring->inflight);
+        seki_ring_get(ring);
+    }
+
+    mutex_unlock(&ring->submit_lock);
+
+    return rv;
+}
+
+// vmalloc_user() has no node variant. Same thing on the card's node.
+static void *seki_ring_alloc_mem(size_t size, int node)
+{
+    void *mem = vzalloc_node(size, node);
+
+    if (mem)
+        find_vm_area(mem)->flags |= VM_USERMAP;
+
+    return mem;
+}
+
+// Interface
+int seki_ring_setup(SekiFile *file, struct seki_ring_params *params)
+{
+    SekiData *device_data = file->device_data;
+    SekiRing *ring;
+    u32 sq_entries;
+    u32 cq_entries;
+    u32 batch;
+    size_t sq_offset;
+    size_t cq_offset;
+    size_t size;
+
+    if (params->flags || !params->sq_entries ||
+        params->sq_entries > SEKI_RING_MAX_ENTRIES ||
+        params->cq_entries > 2 * SEKI_RING_MAX_ENTRIES)
+        return -EINVAL;
+
+    sq_entries = roundup_pow_of_two(params->sq_entries);
+    cq_entries = params->cq_entries ? roundup_pow_of_two(params->cq_entries)
+                                    : 2 * sq_entries;
+    if (cq_entries < sq_entries)
+        return -EINVAL;
+
+    sq_offset = sizeof(struct seki_ring_header);
+    cq_offset = ALIGN(sq_offset + sq_entries * sizeof(struct seki_job_desc),
+                      SMP_CACHE_BYTES);
+    size = PAGE_ALIGN(cq_offset +
+                      cq_entries * sizeof(struct seki_completion));
+    batch = min_t(u32, sq_entries, SEKI_RING_MAX_BATCH);
+
+    ring = kzalloc_node(sizeof(*ring), GFP_KERNEL, device_data->node);
+    if (!ring)
+        return -ENOMEM;
+
+    kref_init(&ring->ref);
+    ring->device_data = device_data;
+    INIT_LIST_HEAD(&ring->chunks);
+    ring->tenant = file->sched;
+    seki_sched_tenant_get(ring->tenant);
+    ring->size = size;
+    ring->sq_entries = sq_entries;
+    ring->cq_entries = cq_entries;
+    mutex_init(&ring->submit_lock);
+    spin_lock_init(&ring->cq_lock);
+    init_waitqueue_head(&ring->cq_wait);
+    atomic_set(&ring->inflight, 0);
+
+    ring->mem = seki_ring_alloc_mem(size, device_data->node);
+    ring->batch = kmalloc_array_node(batch, sizeof(*ring->batch),
+                                     GFP_KERNEL, device_data->node);
+    ring->batch_status = kmalloc_array_node(batch,
+                                            sizeof(*ring->batch_status),
+                                            GFP_KERNEL, device_data->node);
+    if (!ring->mem || !ring->batch || !ring->batch_status) {
+        seki_ring_put(ring);
+        return -ENOMEM;
+    }
+
+    ring->header = ring->mem;
+    ring->sqes = (struct seki_job_desc *)((u8 *)ring->mem + sq_offset);
+    ring->cqes = (struct seki_completion *)((u8 *)ring->mem + cq_offset);
+
+    ring->header->sq_mask    = sq_entries - 1;
+    ring->header->sq_entries = sq_entries;
+    ring->header->cq_mask    = cq_entries - 1;
+    ring->header->cq_entries = cq_entries;
+
+    if (cmpxchg(&file->ring, NULL, ring)) {
+        seki_ring_put(ring);
+        return -EBUSY;
+    }
+
+    params->sq_entries = sq_entries;
+    params->cq_entries = cq_entries;
+    params->ring_size  = size;
+    params->sq_offset  = sq_offset;
+    params->cq_offset  = cq_offset;
+
+    return 0;
+}
+
+void seki_ring_release(SekiFile *file)
+{
+    SekiRing *ring = xchg(&file->ring, NULL);
+
+    if (ring)
+        seki_ring_put(ring);
+}
+
+int seki_ring_mmap(SekiFile *file, struct vm_area_struct *vma)
+{
+    SekiRing *ring = READ_ONCE(file->ring);
+
+    if (!ring) {
+        pr_err("mmap of rings before setup");
+
+        return -EINVAL;
+    }
+
+    if (vma->vm_pgoff != SEKI_MMAP_RING_OFFSET >> PAGE_SHIFT ||
+        vma->vm_end - vma->vm_start > ring->size) {
+        pr_err("mmap rings off range");
+
+        return -EINVAL;
+    }
+
+    return remap_vmalloc_range(vma, ring->mem, 0);
+}
+
+int seki_ring_enter(SekiFile *file, struct seki_ring_enter *enter)
+{
+    SekiRing *ring = READ_ONCE(file->ring);
+    int rv;
+
+    if (!ring || enter->flags)
+        return -EINVAL;
+
+    enter->submitted = 0;
+
+    if (enter->to_submit) {
+        rv = seki_ring_submit(file, ring, enter->to_submit);
+        if (rv < 0)
+            return rv;
+
+        enter->submitted = rv;
+    }
+
+    if (enter->min_complete)
+        return seki_ring_wait(ring, enter->min_complete,
+                              READ_ONCE(file->poll_mode));
+
+    return 0;
+}
+
+__poll_t seki_ring_poll(SekiFile *file, struct file *filp, poll_table *wait)
+{
+    SekiRing *ring = READ_ONCE(file->ring);
+
+    if (!ring)
+        return 0;
+
+    poll_wait(filp, &ring->cq_wait, wait);
+
+    return seki_ring_cq_ready(ring) ? EPOLLIN | EPOLLRDNORM : 0;
+}
@@ -0,0 +1,78 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_ring.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_RING_H
+#define SEKI_RING_H
+
+#include <linux/kref.h>
+#include <linux/mutex.h>
+#include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/wait.h>
+
+struct SekiData;
+struct SekiFile;
+struct SekiQueue;
+struct SekiSchedTenant;
+struct seki_job_desc;
+struct seki_ring_params;
+struct seki_ring_enter;
+
+// Submission & completion rings shared with one open file. Jobs in
+// flight hold a reference, so the rings outlive the file if needed.
+typedef struct SekiRing {
+    struct kref             ref;
+    struct SekiData         *device_data;
+    struct SekiSchedTenant  *tenant;    // Of the file, held
+    struct list_head        chunks;     // Of the file once it is released
+
+    void                    *mem;       // vmalloc_user, mmapped as a whole
+    size_t                  size;
+    struct seki_ring_header *header;
+    struct seki_job_desc    *sqes;
+    struct seki_completion  *cqes;
+    u32                     sq_entries;
+    u32                     cq_entries;
+
+    // Submission side
+    struct mutex            submit_lock;
+    u32                     sq_head;    // Private copy, header is user owned
+    struct seki_job_desc    *batch;     // Validated copies of the SQEs
+    s32                     *batch_status;
+    atomic_t                inflight;
+    unsigned long           queue_mask; // Queues it ever submitted to
+
+    // Completion side
+    spinlock_t              cq_lock;
+    u32                     cq_tail;    // Private copy
+    wait_queue_head_t       cq_wait;
+} SekiRing;
+
+int seki_ring_setup(struct SekiFile *file, struct seki_ring_params *params);
+void seki_ring_release(struct SekiFile *file);
+int seki_ring_mmap(struct SekiFile *file, struct vm_area_struct *vma);
+int seki_ring_enter(struct SekiFile *file, struct seki_ring_enter *enter);
+int seki_ring_submit_one(SekiRing *ring, const struct seki_job_desc *desc);
+int seki_ring_reserve(SekiRing *ring, struct SekiQueue *queue);
+s32 seki_ring_validate(struct SekiFile *file,
+                       const struct seki_job_desc *desc);
+__poll_t seki_ring_poll(struct SekiFile *file, struct file *filp,
+                        poll_table *wait);
+
+unsigned int seki_ring_default_poll_mode(void);
+
+void seki_ring_get(SekiRing *ring);
+void seki_ring_put(SekiRing *ring);
+void seki_ring_complete(SekiRing *ring, u64 user_data, s32 status,
+                        u32 output_length);
+
+
+#endif // SEKI_RING_H
@@ -0,0 +1,577 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_sched.c>
+ * Job scheduling between the open files of a device.
+ *
+ * The device runs each hardware queue in order, so whatever sits in the
+ * SQ ahead of a job is latency it cannot avoid. Every hardware queue has
+ * a software queue in front of it, under its sq_lock. A job goes straight
+ * to the SQ when nothing it should wait behind is queued and its class is
+ * below its cap of jobs in flight, otherwise it waits here until
+ * completions make room.
+ *
+ * Classes are strictly ordered. Below RT each one is capped so the SQ
+ * always has sched_rt_reserve tags for RT jobs and never more than
+ * sched_batch_depth batch jobs for others to wait behind. Within a class
+ * every file (tenant) has an entity per queue with a virtual time, the
+ * bytes it moved divided by its weight, and the one behind goes next.
+ * The exception is a job due before a job submitted now would typically
+ * complete, which goes first, earliest deadline first.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/capability.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/module.h>
+#include <linux/slab.h>
+#include <linux/string.h>
+
+#include "seki_device_defs.h"
+#include "seki_uapi.h"
+#include "seki_chain.h"
+#include "seki_oring.h"
+#include "seki_queue.h"
+#include "seki_ring.h"
+#include "seki_sched.h"
+
+#define SEKI_SCHED_JOB_COST     4096    // In bytes, on top of what it moves
+#define SEKI_SCHED_MAX_PENDING  1024    // Waiting jobs per tenant and queue
+
+static unsigned int sched_rt_reserve = 16;
+module_param(sched_rt_reserve, uint, 0644);
+MODULE_PARM_DESC(sched_rt_reserve,
+                 "Tags of each hardware queue only RT jobs may take");
+
+static unsigned int sched_batch_depth = 32;
+module_param(sched_batch_depth, uint, 0644);
+MODULE_PARM_DESC(sched_batch_depth,
+                 "Batch jobs in flight per hardware queue at most");
+
+// A job waiting in the software queue
+typedef struct SekiSchedJob {
+    struct list_head        node;   // In SekiSchedEntity.fifo or .edf
+    SekiSchedEntity         *entity;
+    SekiQueueJob            job;
+    struct seki_job_desc    desc;
+} SekiSchedJob;
+
+// Tenants
+static void seki_sched_tenant_free(struct kref *ref)
+{
+    SekiSchedTenant *tenant = container_of(ref, SekiSchedTenant, ref);
+
+    kfree_rcu(tenant, rcu);
+}
+
+void seki_sched_tenant_get(SekiSchedTenant *tenant)
+{
+    kref_get(&tenant->ref);
+}
+
+void seki_sched_tenant_put(SekiSchedTenant *tenant)
+{
+    kref_put(&tenant->ref, seki_sched_tenant_free);
+}
+
+int seki_sched_init_file(SekiFile *file)
+{
+    SekiData *device_data = file->device_data;
+    SekiSchedTenant *tenant;
+
+    tenant = kzalloc_node(sizeof(*tenant), GFP_KERNEL, device_data->node);
+    if (!tenant)
+        return -ENOMEM;
+
+    kref_init(&tenant->ref);
+    tenant->pid = task_tgid_nr(current);
+    get_task_comm(tenant->comm, current);
+    tenant->sched_class = SEKI_SCHED_NORMAL;
+    tenant->weight = SEKI_SCHED_WEIGHT_DEFAULT;
+    tenant->file = file;
+
+    for (unsigned int q = 0; q < SEKI_MAX_QUEUES; ++q) {
+        SekiSchedEntity *entity = tenant->entities + q;
+
+        INIT_LIST_HEAD(&entity->node);
+        INIT_LIST_HEAD(&entity->fifo);
+        INIT_LIST_HEAD(&entity->edf);
+    }
+
+    file->sched = tenant;
+
+    return 0;
+}
+
+// The ring keeps the tenant while it has jobs around
+void seki_sched_release_file(SekiFile *file)
+{
+    SekiSchedTenant *tenant = file->sched;
+
+    // The file itself goes after a grace period
+    WRITE_ONCE(tenant->file, 0);
+    WRITE_ONCE(file->sched, 0);
+    seki_sched_tenant_put(tenant);
+}
+
+int seki_sched_set(SekiFile *file, const struct seki_sched_params *params)
+{
+    SekiSchedTenant *tenant = file->sched;
+
+    if (params->priority >= SEKI_SCHED_CLASSES || !params->weight ||
+        params->weight > SEKI_SCHED_WEIGHT_MAX)
+        return -EINVAL;
+
+    if (params->priority == SEKI_SCHED_RT && !capable(CAP_SYS_NICE))
+        return -EPERM;
+
+    WRITE_ONCE(tenant->sched_class, params->priority);
+    WRITE_ONCE(tenant->weight, params->weight);
+
+    return 0;
+}
+
+void seki_sched_read_stats(SekiSchedTenant *tenant,
+                           struct seki_sched_stats *stats)
+{
+    memset(stats, 0, sizeof(*stats));
+    stats->jobs            = atomic64_read(&tenant->jobs);
+    stats->deferred        = atomic64_read(&tenant->deferred);
+    stats->completed       = atomic64_read(&tenant->completed);
+    stats->deadline_missed = atomic64_read(&tenant->deadline_missed);
+    stats->wait_ns         = atomic64_read(&tenant->wait_ns);
+    stats->wait_max_ns     = atomic64_read(&tenant->wait_max_ns);
+    stats->latency_ns      = atomic64_read(&tenant->latency_ns);
+}
+
+static inline void seki_sched_max(atomic64_t *max, u64 value)
+{
+    s64 old = atomic64_read(max);
+
+    while ((u64)old < value) {
+        s64 seen = atomic64_cmpxchg(max, old, value);
+
+        if (seen == old)
+            break;
+        old = seen;
+    }
+}
+
+// Policy
+static inline u64 seki_sched_deadline(const struct seki_job_desc *desc,
+                                      u64 now)
+{
+    if (!desc->deadline_us)
+        return U64_MAX;
+
+    return now + (u64)desc->deadline_us * NSEC_PER_USEC;
+}
+
+static inline u64 seki_sched_cost(const SekiSchedTenant *tenant,
+                                  const struct seki_job_desc *desc)
+{
+    u64 bytes = SEKI_SCHED_JOB_COST + (u64)desc->input_length +
+                desc->output_length;
+
+    return div_u64(bytes * SEKI_SCHED_WEIGHT_DEFAULT,
+                   READ_ONCE(tenant->weight));
+}
+
+// Caps count every class at or below, RT may fill the queue
+static bool seki_sched_has_room(SekiQueue *queue, unsigned int sched_class)
+{
+    unsigned int normal = atomic_read(queue->sched_inflight +
+                                      SEKI_SCHED_NORMAL);
+    unsigned int batch = atomic_read(queue->sched_inflight +
+                                     SEKI_SCHED_BATCH);
+    unsigned int shared = SEKI_QUEUE_DEPTH -
+                          min_t(unsigned int, READ_ONCE(sched_rt_reserve),
+                                SEKI_QUEUE_DEPTH - 1);
+
+    switch (sched_class) {
+    case SEKI_SCHED_RT:
+        return true;
+    case SEKI_SCHED_NORMAL:
+        return normal + batch < shared;
+    default:
+        return batch < max(READ_ONCE(sched_batch_depth), 1u) &&
+               normal + batch < shared;
+    }
+}
+
+static inline unsigned int seki_sched_nr_pending(SekiQueue *queue)
+{
+    unsigned int pending = 0;
+
+    for (unsigned int c = 0; c < SEKI_SCHED_CLASSES; ++c)
+        pending += READ_ONCE(queue->sched_pending[c]);
+
+    return pending;
+}
+
+// Nothing of the tenant nor of a class at or above waits
+static bool seki_sched_may_bypass(SekiQueue *queue, SekiSchedEntity *entity,
+                                  unsigned int sched_class)
+{
+    if (entity->nr_jobs)
+        return false;
+
+    for (unsigned int c = 0; c <= sched_class; ++c) {
+        if (queue->sched_pending[c])
+            return false;
+    }
+
+    return seki_sched_has_room(queue, sched_class);
+}
+
+// Software queue, all under sq_lock
+static void seki_sched_enqueue(SekiQueue *queue, SekiSchedJob *sjob)
+{
+    SekiSchedEntity *entity = sjob->entity;
+    SekiSchedJob *pos;
+
+    // No credit for the time it was idle. A new class of the tenant only
+    // applies once it has drained.
+    if (!entity->nr_jobs++) {
+        entity->sched_class = sjob->job.sched_class;
+        entity->vtime = max(entity->vtime,
+                            queue->sched_vtime[entity->sched_class]);
+        list_add_tail(&entity->node,
+                      queue->sched_active + entity->sched_class);
+    }
+    sjob->job.sched_class = entity->sched_class;
+    ++queue->sched_pending[entity->sched_class];
+
+    if (sjob->job.deadline_ns == U64_MAX) {
+        list_add_tail(&sjob->node, &entity->fifo);
+        return;
+    }
+
+    // Deadlines mostly come in order, look from the back
+    list_for_each_entry_reverse(pos, &entity->edf, node) {
+        if (pos->job.deadline_ns <= sjob->job.deadline_ns)
+            break;
+    }
+    list_add(&sjob->node, &pos->node);
+}
+
+static void seki_sched_dequeue(SekiQueue *queue, SekiSchedJob *sjob)
+{
+    SekiSchedEntity *entity = sjob->entity;
+
+    list_del(&sjob->node);
+    --queue->sched_pending[entity->sched_class];
+    entity->vtime += seki_sched_cost(sjob->job.tenant, &sjob->desc);
+
+    if (!--entity->nr_jobs)
+        list_del_init(&entity->node);
+}
+
+static inline SekiSchedJob *seki_sched_head(SekiSchedEntity *entity)
+{
+    if (!list_empty(&entity->edf))
+        return list_first_entry(&entity->edf, SekiSchedJob, node);
+
+    return list_first_entry(&entity->fifo, SekiSchedJob, node);
+}
+
+// The first class waiting with room. In it, the job due soonest if it is
+// due within the mean service time, else the head of the tenant behind.
+static SekiSchedJob *seki_sched_pick(SekiQueue *queue, u64 now)
+{
+    u64 horizon = now + READ_ONCE(queue->mean_service_ns);
+
+    for (unsigned int c = 0; c < SEKI_SCHED_CLASSES; ++c) {
+        SekiSchedEntity *entity;
+        SekiSchedEntity *fair = 0;
+        SekiSchedJob *urgent = 0;
+
+        if (!queue->sched_pending[c] || !seki_sched_has_room(queue, c))
+            continue;
+
+        list_for_each_entry(entity, queue->sched_active + c, node) {
+            SekiSchedJob *head = seki_sched_head(entity);
+
+            if (head->job.deadline_ns <= horizon &&
+                (!urgent || head->job.deadline_ns < urgent->job.deadline_ns))
+                urgent = head;
+
+            if (!fair || entity->vtime < fair->vtime)
+                fair = entity;
+        }
+
+        queue->sched_vtime[c] = max(queue->sched_vtime[c], fair->vtime);
+
+        return urgent ? urgent : seki_sched_head(fair);
+    }
+
+    return 0;
+}
+
+// Under sq_lock. Stream jobs count in oring_jobs from here until they
+// complete, -ENODEV when their file no longer owns the output ring.
+// -EBUSY when the SQ is full.
+static int seki_sched_push(SekiQueue *queue, SekiQueueJob *job,
+                           const struct seki_job_desc *desc)
+{
+    SekiData *device_data = queue->device_data;
+
+    job->stream = desc->flags & SEKI_JOB_STREAM;
+    if (job->stream && !seki_oring_job_get(device_data, job->tenant))
+        return -ENODEV;
+
+    if (seki_queue_push(queue, job, desc))
+        return 0;
+
+    if (job->stream)
+        seki_oring_job_put(device_data);
+
+    return -EBUSY;
+}
+
+// Completes jobs taken off the software queue without running them,
+// outside of sq_lock
+static void seki_sched_fail(struct list_head *dead)
+{
+    SekiSchedJob *sjob;
+    SekiSchedJob *tmp;
+
+    list_for_each_entry_safe(sjob, tmp, dead, node) {
+        if (sjob->job.chain)
+            seki_chain_complete(sjob->job.chain, sjob->job.user_data,
+                                -ENODEV, 0);
+        else
+            seki_ring_complete(sjob->job.ring, sjob->job.user_data,
+                               -ENODEV, 0);
+        kfree(sjob);
+    }
+}
+
+// Moves waiting jobs to the SQ while there is room, one doorbell. Stream
+// jobs of a file that lost the output ring go to dead.
+static void seki_sched_run(SekiQueue *queue, struct list_head *dead)
+{
+    u64 now = ktime_get_ns();
+    unsigned int n = 0;
+    u64 bytes_in = 0;
+    SekiSchedJob *sjob;
+    int rv;
+
+    while ((sjob = seki_sched_pick(queue, now))) {
+        SekiSchedTenant *tenant = sjob->job.tenant;
+        u64 wait = now - sjob->job.queue_ns;
+
+        sjob->job.submit_ns = now;
+        rv = seki_sched_push(queue, &sjob->job, &sjob->desc);
+        if (rv == -ENODEV) {
+            seki_sched_dequeue(queue, sjob);
+            list_add_tail(&sjob->node, dead);
+            continue;
+        }
+        if (rv)
+            break;
+
+        seki_sched_dequeue(queue, sjob);
+        atomic_inc(queue->sched_inflight + sjob->job.sched_class);
+        atomic64_add(wait, &tenant->wait_ns);
+        seki_sched_max(&tenant->wait_max_ns, wait);
+
+        bytes_in += sjob->desc.input_length;
+        ++n;
+        kfree(sjob);
+    }
+
+    seki_queue_doorbell(queue, n, bytes_in);
+}
+
+// Submission & completion
+static unsigned int seki_sched_defer(SekiQueue *queue, SekiSchedEntity *entity,
+                                     const SekiQueueJob *job,
+                                     const struct seki_job_desc *descs,
+                                     unsigned int count)
+{
+    SekiSchedJob *sjob;
+    SekiSchedJob *tmp;
+    LIST_HEAD(jobs);
+    LIST_HEAD(dead);
+    unsigned long flags;
+    unsigned int n = 0;
+
+    count = min(count, SEKI_SCHED_MAX_PENDING - READ_ONCE(entity->nr_jobs));
+
+    for (unsigned int i = 0; i < count; ++i) {
+        sjob = kmalloc_node(sizeof(*sjob), GFP_KERNEL,
+                            queue->device_data->node);
+        if (!sjob)
+            break;
+
+        sjob->entity = entity;
+        sjob->job = *job;
+        sjob->job.user_data = descs[i].user_data;
+        sjob->job.deadline_ns = seki_sched_deadline(descs + i, job->queue_ns);
+        sjob->desc = descs[i];
+        list_add_tail(&sjob->node, &jobs);
+    }
+
+    spin_lock_irqsave(&queue->sq_lock, flags);
+
+    list_for_each_entry_safe(sjob, tmp, &jobs, node) {
+        if (entity->nr_jobs >= SEKI_SCHED_MAX_PENDING)
+            break;
+
+        list_del(&sjob->node);
+        if (sjob->job.ring)
+            seki_ring_get(sjob->job.ring);
+        seki_sched_enqueue(queue, sjob);
+        ++n;
+    }
+
+    // Pairs with seki_sched_dispatch(), either a completion sees these
+    // jobs or they see the tags it freed
+    smp_mb();
+    seki_sched_run(queue, &dead);
+
+    spin_unlock_irqrestore(&queue->sq_lock, flags);
+
+    seki_sched_fail(&dead);
+
+    // Other submitters of the tenant took the room meanwhile
+    list_for_each_entry_safe(sjob, tmp, &jobs, node)
+        kfree(sjob);
+
+    atomic64_add(n, &job->tenant->deferred);
+
+    return n;
+}
+
+// Completions go to ring, or to chain if it is a chain. Returns how many
+// of descs were taken, less than count when the queue and the tenant's
+// share of the software queue are full.
+unsigned int seki_sched_submit(SekiQueue *queue, SekiRing *ring,
+                               SekiChain *chain,
+                               const struct seki_job_desc *descs,
+                               unsigned int count)
+{
+    SekiSchedTenant *tenant = ring->tenant;
+    SekiSchedEntity *entity = tenant->entities + queue->index;
+    SekiQueueJob job = {
+        .ring        = chain ? 0 : ring,
+        .chain       = chain,
+        .tenant      = tenant,
+        .queue_ns    = ktime_get_ns(),
+        .sched_class = READ_ONCE(tenant->sched_class),
+    };
+    unsigned long flags;
+    unsigned int n = 0;
+    u64 bytes_in = 0;
+
+    spin_lock_irqsave(&queue->sq_lock, flags);
+
+    while (n < count &&
+           seki_sched_may_bypass(queue, entity, job.sched_class)) {
+        const struct seki_job_desc *desc = descs + n;
+
+        job.user_data   = desc->user_data;
+        job.submit_ns   = job.queue_ns;
+        job.deadline_ns = seki_sched_deadline(desc, job.queue_ns);
+
+        // Failing a stale stream job is left to seki_sched_run()
+        if (seki_sched_push(queue, &job, desc))
+            break;
+
+        // Before the doorbell. A chain holds one for all its jobs.
+        if (job.ring)
+            seki_ring_get(ring);
+        atomic_inc(queue->sched_inflight + job.sched_class);
+
+        bytes_in += desc->input_length;
+        ++n;
+    }
+
+    seki_queue_doorbell(queue, n, bytes_in);
+
+    spin_unlock_irqrestore(&queue->sq_lock, flags);
+
+    if (n < count)
+        n += seki_sched_defer(queue, entity, &job, descs + n, count - n);
+
+    atomic64_add(n, &tenant->jobs);
+
+    return n;
+}
+
+// From seki_queue_reap(), the ring reference still held
+void seki_sched_complete(SekiQueue *queue, const SekiQueueJob *job, u64 now)
+{
+    SekiSchedTenant *tenant = job->tenant;
+
+    atomic_dec(queue->sched_inflight + job->sched_class);
+    if (job->stream)
+        seki_oring_job_put(queue->device_data);
+
+    atomic64_inc(&tenant->completed);
+    atomic64_add(now - job->queue_ns, &tenant->latency_ns);
+    if (now > job->deadline_ns)
+        atomic64_inc(&tenant->deadline_missed);
+}
+
+// After completions freed tags
+void seki_sched_dispatch(SekiQueue *queue)
+{
+    LIST_HEAD(dead);
+    unsigned long flags;
+
+    // Pairs with seki_sched_defer()
+    smp_mb();
+    if (!seki_sched_nr_pending(queue))
+        return;
+
+    spin_lock_irqsave(&queue->sq_lock, flags);
+    seki_sched_run(queue, &dead);
+    spin_unlock_irqrestore(&queue->sq_lock, flags);
+
+    seki_sched_fail(&dead);
+}
+
+// Init & uninit
+void seki_sched_init_queue(SekiQueue *queue)
+{
+    for (unsigned int c = 0; c < SEKI_SCHED_CLASSES; ++c) {
+        INIT_LIST_HEAD(queue->sched_active + c);
+        queue->sched_vtime[c] = 0;
+        queue->sched_pending[c] = 0;
+        atomic_set(queue->sched_inflight + c, 0);
+    }
+}
+
+// Waiting jobs will never reach the device
+void seki_sched_uninit_queue(SekiQueue *queue)
+{
+    SekiSchedEntity *entity;
+    SekiSchedJob *sjob;
+    LIST_HEAD(dead);
+    unsigned long flags;
+
+    spin_lock_irqsave(&queue->sq_lock, flags);
+
+    for (unsigned int c = 0; c < SEKI_SCHED_CLASSES; ++c) {
+        while (!list_empty(queue->sched_active + c)) {
+            entity = list_first_entry(queue->sched_active + c,
+                                      SekiSchedEntity, node);
+            sjob = seki_sched_head(entity);
+            seki_sched_dequeue(queue, sjob);
+            list_add_tail(&sjob->node, &dead);
+        }
+    }
+
+    spin_unlock_irqrestore(&queue->sq_lock, flags);
+
+    seki_sched_fail(&dead);
+}
@@ -0,0 +1,82 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_sched.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_SCHED_H
+#define SEKI_SCHED_H
+
+#include <linux/atomic.h>
+#include <linux/kref.h>
+#include <linux/list.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/types.h>
+
+#include "seki_device_defs.h"
+
+struct SekiRing;
+struct SekiChain;
+struct seki_job_desc;
+struct seki_sched_params;
+struct seki_sched_stats;
+
+// A tenant on one hardware queue
+typedef struct SekiSchedEntity {
+    struct list_head    node;       // In SekiQueue.sched_active while queued
+    struct list_head    fifo;       // SekiSchedJob without a deadline
+    struct list_head    edf;        // and with, earliest first
+    unsigned int        nr_jobs;
+    unsigned int        sched_class;    // Of the list it is on
+    u64                 vtime;      // Service received, weighted bytes
+} SekiSchedEntity;
+
+// Per open file, held by the file and its ring
+typedef struct SekiSchedTenant {
+    struct kref         ref;
+    struct rcu_head     rcu;        // procfs walks the files under RCU
+    SekiFile            *file;      // Told about completions, RCU, 0 once
+                                    // released
+    pid_t               pid;        // Of the opener
+    char                comm[TASK_COMM_LEN];
+    unsigned int        sched_class;    // SEKI_SCHED_*
+    unsigned int        weight;
+
+    atomic64_t          jobs;
+    atomic64_t          deferred;
+    atomic64_t          completed;
+    atomic64_t          deadline_missed;
+    atomic64_t          wait_ns;
+    atomic64_t          wait_max_ns;
+    atomic64_t          latency_ns;
+
+    SekiSchedEntity     entities[SEKI_MAX_QUEUES];
+} SekiSchedTenant;
+
+int seki_sched_init_file(SekiFile *file);
+void seki_sched_release_file(SekiFile *file);
+int seki_sched_set(SekiFile *file, const struct seki_sched_params *params);
+
+void seki_sched_tenant_get(SekiSchedTenant *tenant);
+void seki_sched_tenant_put(SekiSchedTenant *tenant);
+void seki_sched_read_stats(SekiSchedTenant *tenant,
+                           struct seki_sched_stats *stats);
+
+void seki_sched_init_queue(SekiQueue *queue);
+void seki_sched_uninit_queue(SekiQueue *queue);
+
+unsigned int seki_sched_submit(SekiQueue *queue, struct SekiRing *ring,
+                               struct SekiChain *chain,
+                               const struct seki_job_desc *descs,
+                               unsigned int count);
+void seki_sched_complete(SekiQueue *queue, const SekiQueueJob *job, u64 now);
+void seki_sched_dispatch(SekiQueue *queue);
+
+
+#endif // SEKI_SCHED_H
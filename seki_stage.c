@@ -0,0 +1,278 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_stage.c>
+ * Staging slots, pipelined job input.
+ *
+ * Filling the window, ringing and waiting before refilling leaves the
+ * link idle while the device computes. With stage_slots=N the top of the
+ * input window becomes N slots owned by the driver: a submitter takes a
+ * free slot, DMAs its input there, hands the slot to the device through
+ * the OWNER register and submits the job. The next submission fills
+ * another slot meanwhile. The device hands a slot back (OWNER, DONE) as
+ * soon as it has read it, and the completion interrupt frees it.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/jiffies.h>
+#include <linux/module.h>
+#include <linux/wait.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_alloc.h"
+#include "seki_dma.h"
+#include "seki_ring.h"
+#include "seki_stage.h"
+
+static unsigned int stage_slots;
+module_param(stage_slots, uint, 0444);
+MODULE_PARM_DESC(stage_slots, "Staging slots per device, 0 to turn off");
+
+static unsigned int stage_slot_kb = 1024;
+module_param(stage_slot_kb, uint, 0444);
+MODULE_PARM_DESC(stage_slot_kb, "Size of each staging slot, in KB");
+
+static inline u32 seki_stage_reg_read(SekiData *device_data,
+                                      unsigned int slot, unsigned int reg)
+{
+    return seki_reg_read(device_data, SEKI_REG_STAGE_SLOT(slot) + reg);
+}
+
+static inline void seki_stage_reg_write(SekiData *device_data,
+                                        unsigned int slot, unsigned int reg,
+                                        u32 value)
+{
+    seki_reg_write(device_data, SEKI_REG_STAGE_SLOT(slot) + reg, value);
+}
+
+// Slots
+// Frees the slots the device handed back. From the IRQ path, and from
+// submitters waiting on a device without interrupts.
+void seki_stage_reap(SekiData *device_data)
+{
+    unsigned long handed = READ_ONCE(device_data->stage_handed);
+    unsigned int slot;
+    int freed = 0;
+
+    for_each_set_bit(slot, &handed, device_data->nr_stage_slots) {
+        if (seki_stage_reg_read(device_data, slot, SEKI_SREG_DONE) !=
+            READ_ONCE(device_data->stage_seq[slot]))
+            continue;
+
+        if (!test_and_clear_bit(slot, &device_data->stage_handed))
+            continue;   // Someone else got there first
+
+        clear_bit_unlock(slot, &device_data->stage_busy);
+        freed = 1;
+    }
+
+    if (freed)
+        wake_up_interruptible(&device_data->stage_wait);
+}
+
+static int seki_stage_try_get(SekiData *device_data)
+{
+    unsigned int slot;
+
+    for (;;) {
+        slot = find_first_zero_bit(&device_data->stage_busy,
+                                   device_data->nr_stage_slots);
+        if (slot >= device_data->nr_stage_slots)
+            return -EBUSY;
+
+        if (!test_and_set_bit_lock(slot, &device_data->stage_busy))
+            return slot;
+    }
+}
+
+static int seki_stage_get(SekiData *device_data)
+{
+    int slot;
+
+    for (;;) {
+        if (!READ_ONCE(device_data->used))
+            return -ENODEV;
+
+        seki_stage_reap(device_data);
+
+        slot = seki_stage_try_get(device_data);
+        if (slot >= 0)
+            return slot;
+
+        // Without interrupts nobody reaps for us, look again soon
+        if (wait_event_interruptible_timeout(device_data->stage_wait,
+                find_first_zero_bit(&device_data->stage_busy,
+                                    device_data->nr_stage_slots) <
+                device_data->nr_stage_slots,
+                device_data->nr_irq_vectors ? HZ : 1) < 0)
+            return -ERESTARTSYS;
+    }
+}
+
+static void seki_stage_put(SekiData *device_data, unsigned int slot)
+{
+    clear_bit_unlock(slot, &device_data->stage_busy);
+    wake_up_interruptible(&device_data->stage_wait);
+}
+
+// Interface
+void seki_stage_get_info(SekiData *device_data, struct seki_stage_info *info)
+{
+    info->nr_slots  = device_data->nr_stage_slots;
+    info->slot_size = device_data->stage_slot_size;
+    info->offset    = device_data->stage_offset;
+}
+
+int seki_stage_submit(SekiFile *file, const struct seki_stage_submit *request)
+{
+    SekiData *device_data = file->device_data;
+    SekiRing *ring = READ_ONCE(file->ring);
+    struct seki_dma_request dma = {
+        .user_addr = request->user_addr,
+        .length    = request->input_length,
+        .direction = SEKI_DMA_TO_DEVICE,
+    };
+    struct seki_job_desc desc = {
+        .user_data     = request->user_data,
+        .output_offset = request->output_offset,
+        .input_length  = request->input_length,
+        .output_length = request->output_length,
+        .opcode        = request->opcode,
+    };
+    int slot;
+    int rv;
+
+    if (!device_data->nr_stage_slots)
+        return -EOPNOTSUPP;
+
+    // The stream bit is the driver's to set, like on ring entries
+    if (!ring || request->flags || !request->input_length ||
+        request->input_length > device_data->stage_slot_size ||
+        (request->opcode & SEKI_HW_OP_STREAM))
+        return -EINVAL;
+
+    if (!seki_alloc_owns(file, SEKI_WINDOW_OUTPUT, request->output_offset,
+                         request->output_length))
+        return -EACCES;
+
+    slot = seki_stage_get(device_data);
+    if (slot < 0)
+        return slot;
+
+    desc.input_offset = device_data->stage_offset +
+                        slot * device_data->stage_slot_size;
+    dma.device_offset = desc.input_offset;
+
+    rv = seki_dma_submit_user(file, &dma);
+    if (rv)
+        goto err_put;
+
+    // Hand over before the doorbell, the device may fetch right away
+    WRITE_ONCE(device_data->stage_seq[slot],
+               device_data->stage_seq[slot] + 1);
+    smp_mb__before_atomic();
+    set_bit(slot, &device_data->stage_handed);
+    seki_stage_reg_write(device_data, slot, SEKI_SREG_OWNER,
+                         SEKI_STAGE_OWNER_DEVICE);
+
+    rv = seki_ring_submit_one(ring, &desc);
+    if (rv)
+        goto err_take_back;
+
+    return 0;
+
+err_take_back:
+    seki_stage_reg_write(device_data, slot, SEKI_SREG_OWNER,
+                         SEKI_STAGE_OWNER_HOST);
+    clear_bit(slot, &device_data->stage_handed);
+    WRITE_ONCE(device_data->stage_seq[slot],
+               device_data->stage_seq[slot] - 1);
+err_put:
+    seki_stage_put(device_data, slot);
+    return rv;
+}
+
+// Init & uninit
+int seki_stage_init_device(SekiData *device_data)
+{
+    unsigned long length = device_data->input_mmio_length;
+    unsigned long slot_size = PAGE_ALIGN((unsigned long)stage_slot_kb << 10);
+    unsigned int nr_slots = min_t(unsigned int, stage_slots,
+                                  SEKI_MAX_STAGE_SLOTS);
+    int rv;
+
+    init_waitqueue_head(&device_data->stage_wait);
+    device_data->stage_busy = 0;
+    device_data->stage_handed = 0;
+    device_data->nr_stage_slots = 0;
+    device_data->stage_offset = length;
+
+    if (!nr_slots)
+        return 0;
+
+    // Leave at least half of the window to everyone else
+    if (!slot_size || slot_size > U32_MAX ||
+        nr_slots * slot_size > length / 2) {
+        pr_warn("%u staging slots of %uKB do not fit dev %d, turned off\n",
+                nr_slots, stage_slot_kb, device_data->device_num);
+        return 0;
+    }
+
+    device_data->stage_offset = (length - nr_slots * slot_size) & PAGE_MASK;
+    rv = seki_alloc_reserve(device_data, SEKI_WINDOW_INPUT,
+                            device_data->stage_offset, nr_slots * slot_size);
+    if (rv) {
+        device_data->stage_offset = length;
+        return rv;
+    }
+
+    device_data->stage_slot_size = slot_size;
+    device_data->nr_stage_slots = nr_slots;
+
+    for (unsigned int s = 0; s < nr_slots; ++s) {
+        seki_stage_reg_write(device_data, s, SEKI_SREG_OWNER,
+                             SEKI_STAGE_OWNER_HOST);
+        device_data->stage_seq[s] =
+                seki_stage_reg_read(device_data, s, SEKI_SREG_DONE);
+    }
+
+    seki_reg_write(device_data, SEKI_REG_STAGE_OFFSET,
+                   device_data->stage_offset);
+    seki_reg_write(device_data, SEKI_REG_STAGE_SIZE, slot_size);
+    seki_reg_write(device_data, SEKI_REG_STAGE_COUNT, nr_slots);
+
+    pr_debug("Dev %d stages through %u slots of %luKB at 0x%lx\n",
+             device_data->device_num, nr_slots, slot_size >> 10,
+             device_data->stage_offset);
+
+    return 0;
+}
+
+// After the queues, nothing reads the slots anymore
+void seki_stage_uninit_device(SekiData *device_data)
+{
+    if (!device_data->nr_stage_slots)
+        return;
+
+    seki_reg_write(device_data, SEKI_REG_STAGE_COUNT, 0);
+
+    seki_alloc_unreserve(device_data, SEKI_WINDOW_INPUT,
+                         device_data->stage_offset,
+                         device_data->nr_stage_slots *
+                         device_data->stage_slot_size);
+
+    device_data->nr_stage_slots = 0;
+    device_data->stage_offset = device_data->input_mmio_length;
+
+    // Submitters waiting for a slot see the device is gone
+    wake_up_interruptible_all(&device_data->stage_wait);
+}
@@ -0,0 +1,31 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_stage.h>
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_STAGE_H
+#define SEKI_STAGE_H
+
+struct SekiData;
+struct SekiFile;
+struct seki_stage_info;
+struct seki_stage_submit;
+
+int seki_stage_init_device(struct SekiData *device_data);
+void seki_stage_uninit_device(struct SekiData *device_data);
+
+void seki_stage_reap(struct SekiData *device_data);
+
+void seki_stage_get_info(struct SekiData *device_data,
+                         struct seki_stage_info *info);
+int seki_stage_submit(struct SekiFile *file,
+                      const struct seki_stage_submit *request);
+
+
+#endif // SEKI_STAGE_H
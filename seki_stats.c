@@ -0,0 +1,72 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_stats.c>
+ * Per-device statistics.
+ *
+ * Every CPU counts into its own copy, so the submission and completion
+ * paths never share a cache line for them. Readers add the copies up,
+ * which is only as consistent as reading a moving target can be.
+ *
+ ***************************************************************************/
+
+#include <linux/kernel.h>
+#include <linux/cpumask.h>
+#include <linux/percpu.h>
+#include <linux/string.h>
+
+#include "seki_device_defs.h"
+#include "seki_stats.h"
+
+static const char *_seki_stats_names[SEKI_STAT_NR] = {
+    [SEKI_STAT_JOBS_SUBMITTED]  = "Jobs Submitted",
+    [SEKI_STAT_JOBS_COMPLETED]  = "Jobs Completed",
+    [SEKI_STAT_JOB_ERRORS]      = "Job Errors",
+    [SEKI_STAT_BYTES_IN]        = "Bytes In",
+    [SEKI_STAT_BYTES_OUT]       = "Bytes Out",
+    [SEKI_STAT_DOORBELLS]       = "Doorbells",
+    [SEKI_STAT_INTERRUPTS]      = "Interrupts",
+    [SEKI_STAT_DMA_TRANSFERS]   = "DMA Transfers",
+    [SEKI_STAT_DMA_ERRORS]      = "DMA Errors",
+    [SEKI_STAT_DMA_REGISTERED]  = "DMA Registered",
+    [SEKI_STAT_MMAP_FAULTS]     = "MMAP Faults",
+};
+
+const char *seki_stats_name(unsigned int stat)
+{
+    return stat < SEKI_STAT_NR ? _seki_stats_names[stat] : "";
+}
+
+int seki_stats_init_device(SekiData *device_data)
+{
+    device_data->stats = alloc_percpu(SekiStats);
+    if (!device_data->stats)
+        return -ENOMEM;
+
+    return 0;
+}
+
+void seki_stats_uninit_device(SekiData *device_data)
+{
+    free_percpu(device_data->stats);
+    device_data->stats = 0;
+}
+
+void seki_stats_read(SekiData *device_data, SekiStats *sum)
+{
+    int cpu;
+
+    memset(sum, 0, sizeof(*sum));
+
+    for_each_possible_cpu(cpu) {
+        SekiStats *stats = per_cpu_ptr(device_data->stats, cpu);
+
+        for (int i = 0; i < SEKI_STAT_NR; ++i)
+            sum->counters[i] += READ_ONCE(stats->counters[i]);
+        for (int i = 0; i < SEKI_STAT_LATENCY_BUCKETS; ++i)
+            sum->latency[i] += READ_ONCE(stats->latency[i]);
+    }
+}
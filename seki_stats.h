@@ -0,0 +1,74 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_stats.h>
+ * Per-CPU counters, see seki_stats.c
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_STATS_H
+#define SEKI_STATS_H
+
+#include <linux/log2.h>
+#include <linux/percpu.h>
+#include <linux/types.h>
+
+#include "seki_device_defs.h"
+
+enum {
+    SEKI_STAT_JOBS_SUBMITTED,
+    SEKI_STAT_JOBS_COMPLETED,
+    SEKI_STAT_JOB_ERRORS,       // Completed with a negative status
+    SEKI_STAT_BYTES_IN,         // Job input and DMA to the device
+    SEKI_STAT_BYTES_OUT,        // Job output and DMA from the device
+    SEKI_STAT_DOORBELLS,
+    SEKI_STAT_INTERRUPTS,
+    SEKI_STAT_DMA_TRANSFERS,
+    SEKI_STAT_DMA_ERRORS,
+    SEKI_STAT_DMA_REGISTERED,   // Transfers from registered buffers
+    SEKI_STAT_MMAP_FAULTS,
+
+    SEKI_STAT_NR
+};
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one is open
+#define SEKI_STAT_LATENCY_BUCKETS   40
+
+typedef struct SekiStats {
+    u64     counters[SEKI_STAT_NR];
+    u64     latency[SEKI_STAT_LATENCY_BUCKETS];     // Submit to complete
+} SekiStats;
+
+int seki_stats_init_device(SekiData *device_data);
+void seki_stats_uninit_device(SekiData *device_data);
+
+const char *seki_stats_name(unsigned int stat);
+void seki_stats_read(SekiData *device_data, SekiStats *sum);
+
+static inline void seki_stats_add(SekiData *device_data, unsigned int stat,
+                                  u64 value)
+{
+    this_cpu_add(device_data->stats->counters[stat], value);
+}
+
+static inline void seki_stats_inc(SekiData *device_data, unsigned int stat)
+{
+    this_cpu_inc(device_data->stats->counters[stat]);
+}
+
+static inline void seki_stats_latency(SekiData *device_data, u64 ns)
+{
+    unsigned int bucket = ns ? ilog2(ns) : 0;
+
+    if (bucket >= SEKI_STAT_LATENCY_BUCKETS)
+        bucket = SEKI_STAT_LATENCY_BUCKETS - 1;
+
+    this_cpu_inc(device_data->stats->latency[bucket]);
+}
+
+
+#endif // SEKI_STATS_H
@@ -0,0 +1,260 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_telemetry.c>
+ * Binary stats page, mmapped read only by collectors.
+ *
+ * Reading /proc/seki/seki%d costs an open, a read and formatting every
+ * counter as text, each time. Instead every device keeps a struct
+ * seki_telemetry in a page of its own. A delayed work refreshes it every
+ * telemetry_ms while at least one mapping of it exists, bracketing each
+ * refresh with a sequence count in the page itself, the way the vDSO
+ * publishes time. Readers then spin on their own memory without a
+ * single syscall.
+ *
+ * The page belongs to SekiData and goes with its last reference. Maps
+ * hold a reference to the page too, so they stay readable after the
+ * device is removed, flagged SEKI_TELEMETRY_REMOVED.
+ *
+ ***************************************************************************/
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/kernel.h>
+#include <linux/gfp.h>
+#include <linux/jiffies.h>
+#include <linux/ktime.h>
+#include <linux/mm.h>
+#include <linux/module.h>
+#include <linux/workqueue.h>
+
+#include "seki_device_defs.h"
+#include "seki_regs.h"
+#include "seki_uapi.h"
+#include "seki_stats.h"
+#include "seki_telemetry.h"
+
+static unsigned int telemetry_ms = 10;
+module_param(telemetry_ms, uint, 0644);
+MODULE_PARM_DESC(telemetry_ms, "Refresh period of mapped telemetry pages");
+
+static inline struct seki_telemetry *seki_telemetry_of(SekiData *device_data)
+{
+    return page_address(device_data->telemetry_page);
+}
+
+static inline unsigned int seki_telemetry_period_ms(void)
+{
+    return max(READ_ONCE(telemetry_ms), 1u);
+}
+
+// Same protocol as write_seqcount_begin/end, on a count userspace sees
+static inline void seki_telemetry_write_begin(struct seki_telemetry *t)
+{
+    WRITE_ONCE(t->seq, t->seq + 1);
+    smp_wmb();
+}
+
+static inline void seki_telemetry_write_end(struct seki_telemetry *t)
+{
+    smp_wmb();
+    WRITE_ONCE(t->seq, t->seq + 1);
+}
+
+// Refreshing
+static void seki_telemetry_update(SekiData *device_data)
+{
+    struct seki_telemetry *t = seki_telemetry_of(device_data);
+    SekiStats stats;
+    s32 temperature = 0;
+    u32 clock_khz = 0;
+    u32 oring_used = 0;
+    u32 oring_size = 0;
+
+    // The slow parts outside of the count, readers only retry on the rest
+    seki_stats_read(device_data, &stats);
+
+    if (t->flags & SEKI_TELEMETRY_SENSORS) {
+        temperature = (s32)seki_reg_read(device_data, SEKI_REG_TEMPERATURE);
+        clock_khz = seki_reg_read(device_data, SEKI_REG_CLOCK_KHZ);
+    }
+
+    if (READ_ONCE(device_data->oring_file)) {
+        oring_size = READ_ONCE(device_data->oring_size);
+        oring_used = seki_reg_read(device_data, SEKI_REG_ORING_TAIL) -
+                     READ_ONCE(device_data->oring_head);
+    }
+
+    seki_telemetry_write_begin(t);
+
+    t->update_ns      = ktime_get_ns();
+    t->interval_us    = seki_telemetry_period_ms() * USEC_PER_MSEC;
+    t->nr_files       = atomic_read(&device_data->nr_files);
+    t->temperature    = temperature;
+    t->clock_khz      = clock_khz;
+    t->stage_busy     = hweight_long(READ_ONCE(device_data->stage_handed));
+    t->oring_used     = oring_used;
+    t->oring_size     = oring_size;
+
+    t->jobs_submitted = stats.counters[SEKI_STAT_JOBS_SUBMITTED];
+    t->jobs_completed = stats.counters[SEKI_STAT_JOBS_COMPLETED];
+    t->job_errors     = stats.counters[SEKI_STAT_JOB_ERRORS];
+    t->bytes_in       = stats.counters[SEKI_STAT_BYTES_IN];
+    t->bytes_out      = stats.counters[SEKI_STAT_BYTES_OUT];
+    t->doorbells      = stats.counters[SEKI_STAT_DOORBELLS];
+    t->interrupts     = stats.counters[SEKI_STAT_INTERRUPTS];
+    t->dma_transfers  = stats.counters[SEKI_STAT_DMA_TRANSFERS];
+    t->dma_errors     = stats.counters[SEKI_STAT_DMA_ERRORS];
+    t->dma_registered = stats.counters[SEKI_STAT_DMA_REGISTERED];
+    t->mmap_faults    = stats.counters[SEKI_STAT_MMAP_FAULTS];
+    memcpy(t->latency, stats.latency, sizeof(t->latency));
+
+    for (unsigned int q = 0; q < device_data->nr_queues; ++q) {
+        SekiQueue *queue = device_data->queues + q;
+        struct seki_telemetry_queue *tq = t->queues + q;
+
+        tq->inflight = bitmap_weight(queue->tags, SEKI_QUEUE_DEPTH);
+        tq->waiting = 0;
+        for (unsigned int c = 0; c < SEKI_SCHED_CLASSES; ++c)
+            tq->waiting += READ_ONCE(queue->sched_pending[c]);
+        tq->completions = atomic_long_read(&queue->completions);
+        tq->mean_service_ns = READ_ONCE(queue->mean_service_ns);
+    }
+
+    seki_telemetry_write_end(t);
+}
+
+static void seki_telemetry_work(struct work_struct *work)
+{
+    SekiData *device_data = container_of(to_delayed_work(work), SekiData,
+                                         telemetry_work);
+
+    seki_telemetry_update(device_data);
+
+    // Only while someone looks
+    mutex_lock(&device_data->telemetry_lock);
+    if (device_data->telemetry_live &&
+        atomic_read(&device_data->telemetry_users))
+        queue_delayed_work(system_power_efficient_wq,
+                           &device_data->telemetry_work,
+                           msecs_to_jiffies(seki_telemetry_period_ms()));
+    mutex_unlock(&device_data->telemetry_lock);
+}
+
+// Mapping
+static void seki_telemetry_vma_open(struct vm_area_struct *vma)
+{
+    SekiData *device_data = vma->vm_private_data;
+
+    atomic_inc(&device_data->telemetry_users);
+}
+
+static void seki_telemetry_vma_close(struct vm_area_struct *vma)
+{
+    SekiData *device_data = vma->vm_private_data;
+
+    atomic_dec(&device_data->telemetry_users);
+}
+
+static const struct vm_operations_struct seki_telemetry_vm_ops = {
+    .open   = seki_telemetry_vma_open,
+    .close  = seki_telemetry_vma_close,
+};
+
+int seki_telemetry_mmap(SekiFile *file, struct vm_area_struct *vma)
+{
+    SekiData *device_data = file->device_data;
+    int rv;
+
+    if (vma->vm_pgoff != SEKI_MMAP_TELEMETRY_OFFSET >> PAGE_SHIFT ||
+        vma->vm_end - vma->vm_start != PAGE_SIZE) {
+        pr_err("mmap telemetry off range");
+
+        return -EINVAL;
+    }
+
+    if (vma->vm_flags & VM_WRITE)
+        return -EPERM;
+
+    vma->vm_flags &= ~VM_MAYWRITE;
+    vma->vm_flags |= VM_DONTEXPAND | VM_DONTDUMP;
+
+    rv = vm_insert_page(vma, vma->vm_start, device_data->telemetry_page);
+    if (rv)
+        return rv;
+
+    vma->vm_private_data = device_data;
+    vma->vm_ops = &seki_telemetry_vm_ops;
+    seki_telemetry_vma_open(vma);
+
+    // Fresh from the start, whatever was left from the last reader
+    mutex_lock(&device_data->telemetry_lock);
+    if (device_data->telemetry_live)
+        mod_delayed_work(system_power_efficient_wq,
+                         &device_data->telemetry_work, 0);
+    mutex_unlock(&device_data->telemetry_lock);
+
+    return 0;
+}
+
+// Init & uninit
+int seki_telemetry_init_device(SekiData *device_data)
+{
+    struct seki_telemetry *t;
+    struct page *page;
+
+    BUILD_BUG_ON(sizeof(struct seki_telemetry) > PAGE_SIZE);
+    BUILD_BUG_ON(SEKI_TELEMETRY_MAX_QUEUES < SEKI_MAX_QUEUES);
+    BUILD_BUG_ON(SEKI_TELEMETRY_LATENCY_BUCKETS !=
+                 SEKI_STAT_LATENCY_BUCKETS);
+
+    page = alloc_pages_node(device_data->node, GFP_KERNEL | __GFP_ZERO, 0);
+    if (!page)
+        return -ENOMEM;
+
+    device_data->telemetry_page = page;
+    mutex_init(&device_data->telemetry_lock);
+    INIT_DELAYED_WORK(&device_data->telemetry_work, seki_telemetry_work);
+    atomic_set(&device_data->telemetry_users, 0);
+    device_data->telemetry_live = 1;
+
+    t = seki_telemetry_of(device_data);
+    t->version        = SEKI_TELEMETRY_VERSION;
+    t->size           = sizeof(*t);
+    t->device_num     = device_data->device_num;
+    t->nr_queues      = device_data->nr_queues;
+    t->nr_stage_slots = device_data->nr_stage_slots;
+    if (seki_reg_read(device_data, SEKI_REG_CAPS) & SEKI_CAP_SENSORS)
+        t->flags |= SEKI_TELEMETRY_SENSORS;
+
+    seki_telemetry_update(device_data);
+
+    return 0;
+}
+
+// Before the queues and the BARs go, the page stays for its mappings
+void seki_telemetry_stop_device(SekiData *device_data)
+{
+    struct seki_telemetry *t = seki_telemetry_of(device_data);
+
+    mutex_lock(&device_data->telemetry_lock);
+    device_data->telemetry_live = 0;
+    mutex_unlock(&device_data->telemetry_lock);
+
+    cancel_delayed_work_sync(&device_data->telemetry_work);
+
+    seki_telemetry_write_begin(t);
+    t->flags |= SEKI_TELEMETRY_REMOVED;
+    seki_telemetry_write_end(t);
+}
+
+// With the last reference on the device
+void seki_telemetry_uninit_device(SekiData *device_data)
+{
+    if (device_data->telemetry_page)
+        __free_page(device_data->telemetry_page);
+    device_data->telemetry_page = 0;
+}
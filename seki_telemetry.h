@@ -0,0 +1,28 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_telemetry.h>
+ * Binary stats page, see seki_telemetry.c
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_TELEMETRY_H
+#define SEKI_TELEMETRY_H
+
+#include <linux/mm_types.h>
+
+struct SekiData;
+struct SekiFile;
+
+int seki_telemetry_init_device(struct SekiData *device_data);
+void seki_telemetry_stop_device(struct SekiData *device_data);
+void seki_telemetry_uninit_device(struct SekiData *device_data);
+
+int seki_telemetry_mmap(struct SekiFile *file, struct vm_area_struct *vma);
+
+
+#endif // SEKI_TELEMETRY_H
@@ -0,0 +1,273 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_trace.h>
+ * Tracepoints, under events/seki in tracefs.
+ *
+ * seki_pcie_device.c defines CREATE_TRACE_POINTS, everything else just
+ * includes this.
+ *
+ ***************************************************************************/
+
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM seki
+
+#if !defined(SEKI_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define SEKI_TRACE_H
+
+#include <linux/tracepoint.h>
+
+// Device lifetime
+TRACE_EVENT(seki_probe,
+    TP_PROTO(unsigned int dev, unsigned int slot, unsigned int nr_queues,
+             unsigned int nr_irq_vectors),
+    TP_ARGS(dev, slot, nr_queues, nr_irq_vectors),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned int,   slot)
+        __field(unsigned int,   nr_queues)
+        __field(unsigned int,   nr_irq_vectors)
+    ),
+
+    TP_fast_assign(
+        __entry->dev            = dev;
+        __entry->slot           = slot;
+        __entry->nr_queues      = nr_queues;
+        __entry->nr_irq_vectors = nr_irq_vectors;
+    ),
+
+    TP_printk("dev=%u slot=%u queues=%u vectors=%u",
+              __entry->dev, __entry->slot, __entry->nr_queues,
+              __entry->nr_irq_vectors)
+);
+
+TRACE_EVENT(seki_remove,
+    TP_PROTO(unsigned int dev),
+    TP_ARGS(dev),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dev;
+    ),
+
+    TP_printk("dev=%u", __entry->dev)
+);
+
+// Mappings
+TRACE_EVENT(seki_mmap,
+    TP_PROTO(unsigned int dev, unsigned long offset, unsigned long length),
+    TP_ARGS(dev, offset, length),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned long,  offset)
+        __field(unsigned long,  length)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->offset = offset;
+        __entry->length = length;
+    ),
+
+    TP_printk("dev=%u offset=0x%lx length=0x%lx",
+              __entry->dev, __entry->offset, __entry->length)
+);
+
+TRACE_EVENT(seki_fault,
+    TP_PROTO(unsigned int dev, unsigned long phys, unsigned long size,
+             unsigned int result),
+    TP_ARGS(dev, phys, size, result),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned long,  phys)
+        __field(unsigned long,  size)
+        __field(unsigned int,   result)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->phys   = phys;
+        __entry->size   = size;
+        __entry->result = result;
+    ),
+
+    TP_printk("dev=%u phys=0x%lx size=0x%lx result=0x%x",
+              __entry->dev, __entry->phys, __entry->size, __entry->result)
+);
+
+// Jobs. A job is identified by dev, queue and tag while in flight, and
+// by the user_data of its ring entry.
+TRACE_EVENT(seki_job_submit,
+    TP_PROTO(unsigned int dev, unsigned int queue, unsigned int tag,
+             u64 user_data, u32 opcode, u32 input_length, u32 output_length),
+    TP_ARGS(dev, queue, tag, user_data, opcode, input_length, output_length),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned int,   queue)
+        __field(unsigned int,   tag)
+        __field(u64,            user_data)
+        __field(u32,            opcode)
+        __field(u32,            input_length)
+        __field(u32,            output_length)
+    ),
+
+    TP_fast_assign(
+        __entry->dev           = dev;
+        __entry->queue         = queue;
+        __entry->tag           = tag;
+        __entry->user_data     = user_data;
+        __entry->opcode        = opcode;
+        __entry->input_length  = input_length;
+        __entry->output_length = output_length;
+    ),
+
+    TP_printk("dev=%u queue=%u tag=%u user_data=0x%llx opcode=%u in=%u out=%u",
+              __entry->dev, __entry->queue, __entry->tag,
+              (unsigned long long)__entry->user_data, __entry->opcode,
+              __entry->input_length, __entry->output_length)
+);
+
+TRACE_EVENT(seki_doorbell,
+    TP_PROTO(unsigned int dev, unsigned int queue, u32 sq_tail,
+             unsigned int count),
+    TP_ARGS(dev, queue, sq_tail, count),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned int,   queue)
+        __field(u32,            sq_tail)
+        __field(unsigned int,   count)
+    ),
+
+    TP_fast_assign(
+        __entry->dev     = dev;
+        __entry->queue   = queue;
+        __entry->sq_tail = sq_tail;
+        __entry->count   = count;
+    ),
+
+    TP_printk("dev=%u queue=%u sq_tail=%u jobs=%u",
+              __entry->dev, __entry->queue, __entry->sq_tail, __entry->count)
+);
+
+TRACE_EVENT(seki_irq,
+    TP_PROTO(unsigned int dev, unsigned int vector, u32 status),
+    TP_ARGS(dev, vector, status),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned int,   vector)
+        __field(u32,            status)
+    ),
+
+    TP_fast_assign(
+        __entry->dev    = dev;
+        __entry->vector = vector;
+        __entry->status = status;
+    ),
+
+    TP_printk("dev=%u vector=%u status=0x%08x",
+              __entry->dev, __entry->vector, __entry->status)
+);
+
+TRACE_EVENT(seki_job_complete,
+    TP_PROTO(unsigned int dev, unsigned int queue, unsigned int tag,
+             u64 user_data, s32 status, u32 output_length, u64 latency_ns),
+    TP_ARGS(dev, queue, tag, user_data, status, output_length, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(unsigned int,   queue)
+        __field(unsigned int,   tag)
+        __field(u64,            user_data)
+        __field(s32,            status)
+        __field(u32,            output_length)
+        __field(u64,            latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev           = dev;
+        __entry->queue         = queue;
+        __entry->tag           = tag;
+        __entry->user_data     = user_data;
+        __entry->status        = status;
+        __entry->output_length = output_length;
+        __entry->latency_ns    = latency_ns;
+    ),
+
+    TP_printk("dev=%u queue=%u tag=%u user_data=0x%llx status=%d out=%u "
+              "latency=%lluns",
+              __entry->dev, __entry->queue, __entry->tag,
+              (unsigned long long)__entry->user_data, __entry->status,
+              __entry->output_length,
+              (unsigned long long)__entry->latency_ns)
+);
+
+// Jobs that never reached a queue, and bogus completions
+TRACE_EVENT(seki_job_error,
+    TP_PROTO(unsigned int dev, int queue, u64 user_data, s32 status),
+    TP_ARGS(dev, queue, user_data, status),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(int,            queue)
+        __field(u64,            user_data)
+        __field(s32,            status)
+    ),
+
+    TP_fast_assign(
+        __entry->dev       = dev;
+        __entry->queue     = queue;
+        __entry->user_data = user_data;
+        __entry->status    = status;
+    ),
+
+    TP_printk("dev=%u queue=%d user_data=0x%llx status=%d",
+              __entry->dev, __entry->queue,
+              (unsigned long long)__entry->user_data, __entry->status)
+);
+
+TRACE_EVENT(seki_dma,
+    TP_PROTO(unsigned int dev, int to_device, unsigned long device_offset,
+             unsigned long length, int status),
+    TP_ARGS(dev, to_device, device_offset, length, status),
+
+    TP_STRUCT__entry(
+        __field(unsigned int,   dev)
+        __field(int,            to_device)
+        __field(unsigned long,  device_offset)
+        __field(unsigned long,  length)
+        __field(int,            status)
+    ),
+
+    TP_fast_assign(
+        __entry->dev           = dev;
+        __entry->to_device     = to_device;
+        __entry->device_offset = device_offset;
+        __entry->length        = length;
+        __entry->status        = status;
+    ),
+
+    TP_printk("dev=%u %s offset=0x%lx length=0x%lx status=%d",
+              __entry->dev, __entry->to_device ? "to_device" : "from_device",
+              __entry->device_offset, __entry->length, __entry->status)
+);
+
+#endif // SEKI_TRACE_H
+
+// Outside of the guard, define_trace.h includes us again
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE seki_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,457 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_uapi.h>
+ * Definitions shared between the driver and userspace.
+ *
+ ***************************************************************************/
+
+
+#ifndef SEKI_UAPI_H
+#define SEKI_UAPI_H
+
+#include <linux/ioctl.h>
+#include <linux/types.h>
+
+// mmap offsets on /dev/seki%d, in bytes
+// Every region gets a 256MB slot of the file offset space, so the
+// largest window (128MB input) always fits with room to grow.
+#define SEKI_MMAP_REGION_SIZE       0x10000000UL
+#define SEKI_MMAP_INPUT_OFFSET      0x00000000UL    // BAR2, write-combined
+#define SEKI_MMAP_OUTPUT_OFFSET     0x10000000UL    // BAR4, uncached
+#define SEKI_MMAP_RING_OFFSET       0x20000000UL    // Job rings of the fd
+#define SEKI_MMAP_TELEMETRY_OFFSET  0x30000000UL    // Read only, see below
+
+// ioctls on /dev/seki%d
+#define SEKI_IOCTL_MAGIC            0xFA
+
+// Direction of a DMA transfer
+#define SEKI_DMA_TO_DEVICE          0   // User buffer -> input window
+#define SEKI_DMA_FROM_DEVICE        1   // Output window -> user buffer
+
+struct seki_dma_request {
+    __u64   user_addr;
+    __u64   length;
+    __u64   device_offset;  // Into the input or output window
+    __u32   direction;      // SEKI_DMA_*
+    __u32   flags;          // Must be 0
+};
+
+#define SEKI_IOCTL_DMA_SUBMIT \
+    _IOW(SEKI_IOCTL_MAGIC, 0x01, struct seki_dma_request)
+
+// Completions of jobs submitted through this fd since the last
+// SEKI_IOCTL_GET_EVENTS on it. poll() reports POLLIN while there are some,
+// the eventfd is signaled once per completion.
+struct seki_event_info {
+    __u64   completions;
+    __u32   queue_mask;     // Queues that completed something
+    __u32   reserved;
+};
+
+// Argument is an eventfd, or -1 to stop signaling
+#define SEKI_IOCTL_SET_EVENTFD \
+    _IOW(SEKI_IOCTL_MAGIC, 0x02, __s32)
+#define SEKI_IOCTL_GET_EVENTS \
+    _IOR(SEKI_IOCTL_MAGIC, 0x03, struct seki_event_info)
+
+// Job rings
+//
+// SEKI_IOCTL_RING_SETUP creates a submission and a completion ring for
+// the fd, mmap them at SEKI_MMAP_RING_OFFSET. Userspace fills SQ entries,
+// publishes them by advancing sq_tail (release) and calls
+// SEKI_IOCTL_RING_ENTER. The whole batch goes to the device with one
+// doorbell. Completions show up in the CQ at cq_tail (acquire), userspace
+// consumes them by advancing cq_head.
+
+// Opcodes of the software emulated device (the emulate module
+// parameter). Output is min(input_length, output_length) bytes.
+#define SEKI_EMU_OP_COPY            0   // Output = input
+#define SEKI_EMU_OP_INVERT          1   // Output = ~input, bytewise
+
+struct seki_job_desc {
+    __u64   user_data;      // Returned in the completion
+    __u64   input_offset;   // Into the input window
+    __u64   output_offset;  // Into the output window
+    __u32   input_length;
+    __u32   output_length;
+    __u32   opcode;         // Device defined
+    __u32   flags;          // SEKI_JOB_*
+    __u32   deadline_us;    // From submission, 0 for none
+    __u32   reserved;       // Must be 0
+};
+
+#define SEKI_JOB_STREAM             (1u << 0)   // To the output ring
+
+struct seki_completion {
+    __u64   user_data;
+    __s32   status;         // 0 or a negative errno
+    __u32   output_length;
+};
+
+// Producer and consumer fields live on their own cache lines
+struct seki_ring_header {
+    __u32   sq_head;        // Written by the kernel
+    __u32   sq_tail;        // Written by userspace
+    __u32   sq_mask;
+    __u32   sq_entries;
+    __u32   sq_reserved[12];
+
+    __u32   cq_head;        // Written by userspace
+    __u32   cq_tail;        // Written by the kernel
+    __u32   cq_mask;
+    __u32   cq_entries;
+    __u32   cq_overflow;    // Completions dropped because the CQ was full
+    __u32   cq_reserved[11];
+};
+
+struct seki_ring_params {
+    __u32   sq_entries;     // In, rounded up to a power of 2
+    __u32   cq_entries;     // In, 0 for twice sq_entries
+    __u32   flags;          // Must be 0
+    __u32   reserved;
+
+    // Out, byte offsets from the start of the ring mapping
+    __u64   ring_size;
+    __u64   sq_offset;
+    __u64   cq_offset;
+};
+
+struct seki_ring_enter {
+    __u32   to_submit;
+    __u32   min_complete;   // Wait until this many CQ entries are ready
+    __u32   flags;          // Must be 0
+    __u32   submitted;      // Out
+};
+
+#define SEKI_IOCTL_RING_SETUP \
+    _IOWR(SEKI_IOCTL_MAGIC, 0x04, struct seki_ring_params)
+#define SEKI_IOCTL_RING_ENTER \
+    _IOWR(SEKI_IOCTL_MAGIC, 0x05, struct seki_ring_enter)
+
+// The hardware queue jobs submitted from the calling CPU go to, and the
+// slice of the input window that belongs to it. Workers pinned one per
+// CPU can claim their slice with SEKI_ALLOC_FIXED and stage input there
+// without coordinating.
+struct seki_queue_info {
+    __u32   queue;
+    __u32   nr_queues;
+    __u64   input_offset;
+    __u64   input_length;
+};
+
+#define SEKI_IOCTL_GET_QUEUE_INFO \
+    _IOR(SEKI_IOCTL_MAGIC, 0x06, struct seki_queue_info)
+
+// How SEKI_IOCTL_RING_ENTER waits for min_complete on this fd. The
+// default comes from the poll_mode module parameter.
+#define SEKI_POLL_IRQ               0   // Sleep until the interrupt
+#define SEKI_POLL_SPIN              1   // Spin on the completion register
+#define SEKI_POLL_HYBRID            2   // Sleep half the mean service time,
+                                        // then spin
+
+#define SEKI_IOCTL_SET_POLL_MODE \
+    _IOW(SEKI_IOCTL_MAGIC, 0x07, __u32)
+
+// Window chunks
+//
+// mmap of the input/output windows, DMA and jobs are limited to chunks
+// the fd allocated. Chunks are page granular and aligned to their size
+// rounded up to a power of 2. They go back to the driver on
+// SEKI_IOCTL_FREE or when the fd is closed.
+#define SEKI_WINDOW_INPUT           0
+#define SEKI_WINDOW_OUTPUT          1
+
+#define SEKI_ALLOC_FIXED            (1u << 0)   // Exactly at offset, e.g.
+                                                // the queue's input slice
+
+struct seki_alloc_request {
+    __u32   window;         // SEKI_WINDOW_*
+    __u32   flags;          // SEKI_ALLOC_*
+    __u64   size;           // In, ignored by SEKI_IOCTL_FREE
+    __u64   offset;         // Out, in for SEKI_ALLOC_FIXED and FREE
+};
+
+#define SEKI_IOCTL_ALLOC \
+    _IOWR(SEKI_IOCTL_MAGIC, 0x08, struct seki_alloc_request)
+#define SEKI_IOCTL_FREE \
+    _IOW(SEKI_IOCTL_MAGIC, 0x09, struct seki_alloc_request)
+
+// read()/write() and pread()/pwrite() on /dev/seki%d take the mmap
+// offsets above. write() goes to the input window and read() comes from
+// the output window, by DMA through bounce buffers of the driver, so no
+// mapping is needed. Like mmap, a call must stay within one chunk of the
+// fd. Short counts happen at the end of a window.
+//
+// splice() and sendfile() read the output window the same way, except
+// the device DMAs into pages that go to the pipe or socket as they are.
+// Each call moves at most what the pipe has room for.
+
+// Which seki%d the fd talks to. Mostly for /dev/seki-any, which picks
+// the least loaded card, preferring the NUMA node of the opener, and
+// stays on it until the fd is closed.
+#define SEKI_IOCTL_GET_DEVICE_NUM \
+    _IOR(SEKI_IOCTL_MAGIC, 0x0a, __u32)
+
+// Staging slots
+//
+// With the stage_slots module parameter, the driver keeps the top of the
+// input window as slots it stages job input into, so one job's input is
+// transferred while the device computes on the previous one.
+// SEKI_IOCTL_STAGE_SUBMIT copies user_addr into a free slot by DMA and
+// submits the job on the ring of the fd (see SEKI_IOCTL_RING_SETUP),
+// then returns without waiting for it. A slot is free again as soon as
+// the device has read it. Only sleeps when all slots are in use.
+struct seki_stage_info {
+    __u32   nr_slots;       // 0 when staging is off
+    __u32   slot_size;      // Largest input_length
+    __u64   offset;         // Of the slots in the input window
+};
+
+struct seki_stage_submit {
+    __u64   user_addr;      // Job input
+    __u64   output_offset;  // Into a chunk of the output window of the fd
+    __u64   user_data;      // Returned in the completion
+    __u32   input_length;
+    __u32   output_length;
+    __u32   opcode;
+    __u32   flags;          // Must be 0
+};
+
+#define SEKI_IOCTL_STAGE_INFO \
+    _IOR(SEKI_IOCTL_MAGIC, 0x0b, struct seki_stage_info)
+#define SEKI_IOCTL_STAGE_SUBMIT \
+    _IOW(SEKI_IOCTL_MAGIC, 0x0c, struct seki_stage_submit)
+
+// Job chains
+//
+// SEKI_IOCTL_CHAIN_SUBMIT takes an array of up to SEKI_CHAIN_MAX_JOBS
+// job descriptors, validates all of them before anything is submitted
+// and rings the doorbell once for as many as the hardware queue has room
+// for, i.e. once for chains up to SEKI_QUEUE_DEPTH long. The user_data of
+// the descriptors is ignored. The chain completes as one entry on the CQ
+// of the fd (see SEKI_IOCTL_RING_SETUP) when its last job is done:
+// user_data of the chain, status of the first failed job or 0, and the
+// sum of the output lengths. Per job status and output length are then
+// collected with SEKI_IOCTL_CHAIN_STATUS, in descriptor order, which also
+// lets go of the chain, or fails with EBUSY while it runs. Up to
+// SEKI_CHAIN_MAX_PENDING chains per fd may await that, more fail with
+// EBUSY. SEKI_CHAIN_NO_RESULTS chains only complete on the CQ and need no
+// SEKI_IOCTL_CHAIN_STATUS. Jobs not yet submitted when a signal arrives
+// complete with EINTR.
+#define SEKI_CHAIN_MAX_JOBS         1024
+#define SEKI_CHAIN_MAX_PENDING      256
+
+#define SEKI_CHAIN_NO_RESULTS       (1u << 0)
+
+struct seki_chain_submit {
+    __u64   descs;          // struct seki_job_desc[count]
+    __u64   user_data;      // Returned in the completion
+    __u32   count;
+    __u32   flags;          // SEKI_CHAIN_*
+    __u64   id;             // Out, for SEKI_IOCTL_CHAIN_STATUS
+    __u32   error_index;    // Out, first invalid descriptor on failure
+    __u32   reserved;
+};
+
+struct seki_chain_result {
+    __s32   status;         // 0 or a negative errno
+    __u32   output_length;
+};
+
+struct seki_chain_status {
+    __u64   id;
+    __u64   results;        // struct seki_chain_result[count]
+    __u32   count;          // In, room in results. Out, jobs in the chain
+    __u32   reserved;
+};
+
+#define SEKI_IOCTL_CHAIN_SUBMIT \
+    _IOWR(SEKI_IOCTL_MAGIC, 0x0d, struct seki_chain_submit)
+#define SEKI_IOCTL_CHAIN_STATUS \
+    _IOWR(SEKI_IOCTL_MAGIC, 0x0e, struct seki_chain_status)
+
+// Output ring
+//
+// SEKI_IOCTL_ORING_SETUP turns a chunk of the output window of the fd
+// into a ring the device appends results to, one fd per device at a
+// time. Jobs of that fd with SEKI_JOB_STREAM then append a record (header
+// and up to output_length bytes) at the tail instead of writing at
+// output_offset, which is ignored. Records of chained jobs carry their
+// index in the chain. Failed jobs append nothing, their status is on the
+// CQ as usual.
+//
+// Records start every SEKI_ORING_ALIGN bytes and never wrap: a record
+// with SEKI_ORING_RECORD_PAD fills the end of the ring instead. Each one
+// is followed by the next at ALIGN(sizeof(header) + length), in ring
+// offsets (head & (size - 1)). The fd mmaps its chunk to read records
+// and hands the space back with SEKI_IOCTL_ORING_CONSUME, which can also
+// wait until the ring holds watermark bytes, with a timeout to bound
+// latency. poll() reports POLLPRI while it does. The device stalls jobs
+// when the ring is full.
+#define SEKI_ORING_ALIGN            16
+#define SEKI_ORING_RECORD_PAD       (1u << 0)
+
+struct seki_oring_record {
+    __u64   user_data;      // Of the job
+    __u32   length;         // Bytes of output after the header
+    __u32   flags;          // SEKI_ORING_RECORD_*
+};
+
+struct seki_oring_params {
+    __u64   offset;         // Of an output window chunk of the fd
+    __u32   size;           // Power of 2, at least a page. 0 to stop.
+    __u32   watermark;      // Bytes, wake up when the ring holds as many
+};
+
+#define SEKI_ORING_WAIT             (1u << 0)
+
+struct seki_oring_consume {
+    __u32   head;           // In, consumed up to here, free running
+    __u32   flags;          // SEKI_ORING_*
+    __u32   timeout_us;     // With SEKI_ORING_WAIT, 0 waits forever
+    __u32   tail;           // Out, produced up to here, free running
+};
+
+#define SEKI_IOCTL_ORING_SETUP \
+    _IOW(SEKI_IOCTL_MAGIC, 0x0f, struct seki_oring_params)
+#define SEKI_IOCTL_ORING_CONSUME \
+    _IOWR(SEKI_IOCTL_MAGIC, 0x10, struct seki_oring_consume)
+
+// Registered buffers
+//
+// SEKI_IOCTL_BUFFER_REGISTER pins a user buffer and maps it for DMA once,
+// so SEKI_IOCTL_DMA_SUBMIT, SEKI_IOCTL_STAGE_SUBMIT, read() and write()
+// on ranges inside it skip pinning and mapping, and read()/write() skip
+// the bounce buffers too. Pinned pages count against RLIMIT_MEMLOCK.
+// Only the process that registered first can register on the fd. The
+// driver drops a buffer by itself once any of its range is unmapped or
+// remapped, later transfers pin as if it never was. Unregistering takes
+// the same user_addr and length, ENOENT if it was dropped. EAGAIN if the
+// range changed while being registered, EEXIST if it overlaps another.
+struct seki_buffer_register {
+    __u64   user_addr;
+    __u64   length;
+    __u32   flags;          // Must be 0
+    __u32   reserved;
+};
+
+#define SEKI_IOCTL_BUFFER_REGISTER \
+    _IOW(SEKI_IOCTL_MAGIC, 0x11, struct seki_buffer_register)
+#define SEKI_IOCTL_BUFFER_UNREGISTER \
+    _IOW(SEKI_IOCTL_MAGIC, 0x12, struct seki_buffer_register)
+
+// Scheduling
+//
+// Each fd is a tenant of the device. Jobs go straight to the hardware
+// queue of the submitting CPU unless jobs of their class or above are
+// waiting, otherwise they wait in a software queue in front of it.
+// Classes are strictly ordered, and below SEKI_SCHED_RT each may only
+// have so many jobs in flight per hardware queue (the sched_rt_reserve
+// and sched_batch_depth module parameters), so a flood of batch jobs
+// never sits in the device ahead of latency sensitive ones. Within a
+// class tenants share the device by weight, in bytes moved, except that
+// jobs about to miss their deadline_us go first, earliest first. A
+// tenant's own jobs with a deadline go before those without. Late jobs
+// still run and count in deadline_missed.
+//
+// SEKI_SCHED_RT needs CAP_SYS_NICE. A new class applies to jobs of the
+// tenant already waiting once they have all been dispatched.
+#define SEKI_SCHED_RT               0
+#define SEKI_SCHED_NORMAL           1   // Default
+#define SEKI_SCHED_BATCH            2
+
+#define SEKI_SCHED_WEIGHT_DEFAULT   100
+#define SEKI_SCHED_WEIGHT_MAX       10000
+
+struct seki_sched_params {
+    __u32   priority;       // SEKI_SCHED_*
+    __u32   weight;         // 1 to SEKI_SCHED_WEIGHT_MAX
+};
+
+// Of this fd since it was opened, times in ns
+struct seki_sched_stats {
+    __u64   jobs;           // Accepted
+    __u64   deferred;       // Waited in the software queue
+    __u64   completed;
+    __u64   deadline_missed;
+    __u64   wait_ns;        // Total in the software queue
+    __u64   wait_max_ns;
+    __u64   latency_ns;     // Total from submission to completion
+};
+
+#define SEKI_IOCTL_SCHED_SET \
+    _IOW(SEKI_IOCTL_MAGIC, 0x13, struct seki_sched_params)
+#define SEKI_IOCTL_SCHED_STATS \
+    _IOR(SEKI_IOCTL_MAGIC, 0x14, struct seki_sched_stats)
+
+// Telemetry
+//
+// One page per device, mapped read only at SEKI_MMAP_TELEMETRY_OFFSET.
+// While it is mapped the driver refreshes it every telemetry_ms (module
+// parameter) under a sequence count, so collectors read it without any
+// syscall:
+//
+//     do {
+//         seq = __atomic_load_n(&t->seq, __ATOMIC_ACQUIRE);
+//         memcpy(&copy, t, sizeof(copy));
+//         __atomic_thread_fence(__ATOMIC_ACQUIRE);
+//     } while ((seq & 1) || seq != __atomic_load_n(&t->seq,
+//                                                  __ATOMIC_RELAXED));
+//
+// Fields are only ever appended, with version bumped, so check size
+// before reading past what a given version had.
+#define SEKI_TELEMETRY_VERSION          1
+#define SEKI_TELEMETRY_MAX_QUEUES       16
+#define SEKI_TELEMETRY_LATENCY_BUCKETS  40
+
+#define SEKI_TELEMETRY_SENSORS      (1u << 0)   // temperature, clock_khz
+#define SEKI_TELEMETRY_REMOVED      (1u << 1)   // No more updates
+
+struct seki_telemetry_queue {
+    __u32   inflight;       // Jobs on the device
+    __u32   waiting;        // Jobs in the software queue
+    __u64   completions;    // Completion interrupts
+    __u64   mean_service_ns;
+};
+
+struct seki_telemetry {
+    __u32   seq;            // Odd while being updated
+    __u32   version;        // SEKI_TELEMETRY_VERSION
+    __u32   size;           // sizeof(struct seki_telemetry) of the driver
+    __u32   flags;          // SEKI_TELEMETRY_*
+    __u64   update_ns;      // CLOCK_MONOTONIC of the last update
+    __u32   interval_us;
+    __u32   device_num;
+    __u32   nr_queues;
+    __u32   nr_files;
+    __s32   temperature;    // Millidegrees C
+    __u32   clock_khz;
+    __u32   stage_busy;     // Staging slots owned by the device
+    __u32   nr_stage_slots;
+    __u32   oring_used;     // Bytes of the output ring not consumed
+    __u32   oring_size;     // 0 when off
+
+    __u64   jobs_submitted;
+    __u64   jobs_completed;
+    __u64   job_errors;
+    __u64   bytes_in;
+    __u64   bytes_out;
+    __u64   doorbells;
+    __u64   interrupts;
+    __u64   dma_transfers;
+    __u64   dma_errors;
+    __u64   dma_registered;
+    __u64   mmap_faults;
+
+    // Bucket i counts jobs that took [2^i, 2^(i+1)) ns
+    __u64   latency[SEKI_TELEMETRY_LATENCY_BUCKETS];
+
+    struct seki_telemetry_queue queues[SEKI_TELEMETRY_MAX_QUEUES];
+};
+
+
+#endif // SEKI_UAPI_H
@@ -0,0 +1,818 @@
+/**************************************************************************
+ * Copyright (c) 2014 Afa.L Cheng <afa@afa.moe>
+ *                    Rosen Center for Advanced Computing, Purdue University
+ *
+ * This file is dual MIT/GPL licensed.
+ *
+ * <seki_bench.c>
+ * Userspace benchmarks for the Seki driver.
+ *
+ *   store_wc   Store bandwidth into the input window, write-combined
+ *   store_uc   Store bandwidth into the output window, which is mapped
+ *              uncached. The input window can only be mapped WC.
+ *   load       Load bandwidth from the output window (uncached)
+ *   pwrite     pwrite() bandwidth into the input window, no mapping
+ *   pread      pread() bandwidth from the output window
+ *   doorbell   Register write + read back round trip through the
+ *              /dev/sekictrl mapping
+ *   jobs       Jobs/sec and completion latency through the job rings,
+ *              for every combination of -t threads and -q queue depths
+ *
+ * Results go to stdout as one JSON document, so runs can be diffed and
+ * compared by scripts. Progress and errors go to stderr.
+ *
+ ***************************************************************************/
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+#include "seki_uapi.h"
+
+// From seki_regs.h, which is kernel only. Writing 0 to the write 1 to
+// clear IRQ_STATUS does nothing, so it is safe on a live device.
+#define SEKI_REG_IRQ_STATUS     0x0010
+
+// sekictrl gives every device 0x100 pages of the file offset space
+#define SEKI_CTL_DEVICE_PAGES   0x100
+
+#define SEKI_BENCH_MAX_LIST     16
+
+typedef struct SekiBenchOptions {
+    unsigned int    device;
+    const char      *benchmarks;
+    size_t          window_size;    // Bytes touched by the MMIO benchmarks
+    unsigned int    repeat;
+    unsigned int    doorbells;
+    unsigned int    threads[SEKI_BENCH_MAX_LIST];
+    unsigned int    nr_threads;
+    unsigned int    depths[SEKI_BENCH_MAX_LIST];
+    unsigned int    nr_depths;
+    unsigned int    job_length;
+    unsigned int    opcode;
+    double          seconds;
+} SekiBenchOptions;
+
+static SekiBenchOptions _seki_bench_opts = {
+    .device         = 0,
+    .benchmarks     = "store_wc,store_uc,load,pwrite,pread,doorbell,jobs",
+    .window_size    = 1 << 20,
+    .repeat         = 16,
+    .doorbells      = 100000,
+    .threads        = { 1, 2, 4 },
+    .nr_threads     = 3,
+    .depths         = { 1, 8, 32 },
+    .nr_depths      = 3,
+    .job_length     = 4096,
+    .opcode         = SEKI_EMU_OP_COPY,
+    .seconds        = 2.0,
+};
+
+static int _seki_bench_results;     // Emitted so far, for the commas
+static int _seki_bench_failed;
+
+// Helpers
+static inline uint64_t seki_bench_now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static int seki_bench_enabled(const char *name)
+{
+    size_t len = strlen(name);
+    const char *p = _seki_bench_opts.benchmarks;
+
+    while ((p = strstr(p, name))) {
+        if ((p == _seki_bench_opts.benchmarks || p[-1] == ',') &&
+            (p[len] == ',' || p[len] == 0))
+            return 1;
+        p += len;
+    }
+
+    return 0;
+}
+
+static int seki_bench_cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+// Samples must be sorted
+static uint64_t seki_bench_percentile(uint64_t *samples, size_t count,
+                                      double p)
+{
+    size_t i;
+
+    if (!count)
+        return 0;
+
+    i = (size_t)(p * (count - 1) + 0.5);
+    return samples[i];
+}
+
+static void seki_bench_begin_result(const char *name)
+{
+    printf("%s\n    {\"bench\": \"%s\"", _seki_bench_results++ ? "," : "",
+           name);
+}
+
+static void seki_bench_end_result(void)
+{
+    printf("}");
+    fflush(stdout);
+}
+
+static void seki_bench_error(const char *name, const char *what, int err)
+{
+    fprintf(stderr, "%s: %s: %s\n", name, what, strerror(err));
+
+    seki_bench_begin_result(name);
+    printf(", \"error\": \"%s: %s\"", what, strerror(err));
+    seki_bench_end_result();
+
+    _seki_bench_failed = 1;
+}
+
+static void seki_bench_latencies(uint64_t *samples, size_t count)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < count; ++i)
+        sum += samples[i];
+
+    qsort(samples, count, sizeof(*samples), seki_bench_cmp_u64);
+
+    printf(", \"mean_ns\": %.1f, \"p50_ns\": %llu, \"p99_ns\": %llu, "
+           "\"p999_ns\": %llu, \"max_ns\": %llu",
+           count ? (double)sum / count : 0.0,
+           (unsigned long long)seki_bench_percentile(samples, count, 0.50),
+           (unsigned long long)seki_bench_percentile(samples, count, 0.99),
+           (unsigned long long)seki_bench_percentile(samples, count, 0.999),
+           (unsigned long long)(count ? samples[count - 1] : 0));
+}
+
+static int seki_bench_open_device(void)
+{
+    char path[32];
+
+    snprintf(path, sizeof(path), "/dev/seki%u", _seki_bench_opts.device);
+    return open(path, O_RDWR);
+}
+
+// Allocates a chunk of a window for fd and maps it
+static void *seki_bench_map_window(int fd, unsigned int window, size_t size)
+{
+    struct seki_alloc_request request = {
+        .window = window,
+        .size   = size,
+    };
+    unsigned long base = window == SEKI_WINDOW_INPUT ? SEKI_MMAP_INPUT_OFFSET
+                                                     : SEKI_MMAP_OUTPUT_OFFSET;
+    void *addr;
+
+    if (ioctl(fd, SEKI_IOCTL_ALLOC, &request))
+        return MAP_FAILED;
+
+    addr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                base + request.offset);
+    return addr;
+}
+
+// MMIO bandwidth
+static void seki_bench_store(volatile uint64_t *dst, size_t words)
+{
+    for (size_t i = 0; i < words; ++i)
+        dst[i] = i;
+
+    // Drains the write-combining buffers
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static uint64_t seki_bench_load(volatile const uint64_t *src, size_t words)
+{
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < words; ++i)
+        sum += src[i];
+
+    return sum;
+}
+
+static void seki_bench_mmio(const char *name, unsigned int window, int store)
+{
+    size_t size = _seki_bench_opts.window_size;
+    size_t words = size / sizeof(uint64_t);
+    uint64_t best = UINT64_MAX;
+    uint64_t total = 0;
+    volatile uint64_t sink = 0;
+    void *addr;
+    int fd;
+
+    fd = seki_bench_open_device();
+    if (fd < 0) {
+        seki_bench_error(name, "open", errno);
+        return;
+    }
+
+    addr = seki_bench_map_window(fd, window, size);
+    if (addr == MAP_FAILED) {
+        seki_bench_error(name, "map window", errno);
+        close(fd);
+        return;
+    }
+
+    // The first pass takes the page faults
+    if (store)
+        seki_bench_store(addr, words);
+    else
+        sink += seki_bench_load(addr, words);
+
+    for (unsigned int r = 0; r < _seki_bench_opts.repeat; ++r) {
+        uint64_t start = seki_bench_now_ns();
+        uint64_t elapsed;
+
+        if (store)
+            seki_bench_store(addr, words);
+        else
+            sink += seki_bench_load(addr, words);
+
+        elapsed = seki_bench_now_ns() - start;
+        total += elapsed;
+        if (elapsed < best)
+            best = elapsed;
+    }
+    (void)sink;
+
+    seki_bench_begin_result(name);
+    printf(", \"bytes\": %zu, \"repeat\": %u, \"mean_mbps\": %.1f, "
+           "\"best_mbps\": %.1f", size, _seki_bench_opts.repeat,
+           (double)size * _seki_bench_opts.repeat * 1000.0 / total,
+           (double)size * 1000.0 / best);
+    seki_bench_end_result();
+
+    munmap(addr, size);
+    close(fd);
+}
+
+// pread() & pwrite(), through the bounce buffers of the driver
+static void seki_bench_rw(const char *name, unsigned int window)
+{
+    size_t size = _seki_bench_opts.window_size;
+    struct seki_alloc_request request = {
+        .window = window,
+        .size   = size,
+    };
+    off_t offset;
+    uint64_t best = UINT64_MAX;
+    uint64_t total = 0;
+    void *buf;
+    int fd;
+
+    fd = seki_bench_open_device();
+    if (fd < 0) {
+        seki_bench_error(name, "open", errno);
+        return;
+    }
+
+    if (ioctl(fd, SEKI_IOCTL_ALLOC, &request)) {
+        seki_bench_error(name, "ALLOC", errno);
+        close(fd);
+        return;
+    }
+    offset = (window == SEKI_WINDOW_INPUT ? SEKI_MMAP_INPUT_OFFSET
+                                          : SEKI_MMAP_OUTPUT_OFFSET) +
+             request.offset;
+
+    buf = malloc(size);
+    if (!buf) {
+        seki_bench_error(name, "malloc", ENOMEM);
+        close(fd);
+        return;
+    }
+    memset(buf, 0x5a, size);
+
+    for (unsigned int r = 0; r < _seki_bench_opts.repeat; ++r) {
+        uint64_t start = seki_bench_now_ns();
+        uint64_t elapsed;
+        ssize_t n;
+
+        if (window == SEKI_WINDOW_INPUT)
+            n = pwrite(fd, buf, size, offset);
+        else
+            n = pread(fd, buf, size, offset);
+
+        if (n != (ssize_t)size) {
+            seki_bench_error(name, window == SEKI_WINDOW_INPUT ? "pwrite"
+                                                               : "pread",
+                             n < 0 ? errno : EIO);
+            goto out;
+        }
+
+        elapsed = seki_bench_now_ns() - start;
+        total += elapsed;
+        if (elapsed < best)
+            best = elapsed;
+    }
+
+    seki_bench_begin_result(name);
+    printf(", \"bytes\": %zu, \"repeat\": %u, \"mean_mbps\": %.1f, "
+           "\"best_mbps\": %.1f", size, _seki_bench_opts.repeat,
+           (double)size * _seki_bench_opts.repeat * 1000.0 / total,
+           (double)size * 1000.0 / best);
+    seki_bench_end_result();
+
+out:
+    free(buf);
+    close(fd);
+}
+
+// Doorbell round trip. The read back is non-posted, so it only returns
+// once the write has reached the device.
+static void seki_bench_doorbell(void)
+{
+    const char *name = "doorbell";
+    unsigned int count = _seki_bench_opts.doorbells;
+    long page_size = sysconf(_SC_PAGESIZE);
+    volatile uint32_t *regs;
+    uint64_t *samples;
+    int fd;
+
+    fd = open("/dev/sekictrl", O_RDWR);
+    if (fd < 0) {
+        seki_bench_error(name, "open /dev/sekictrl", errno);
+        return;
+    }
+
+    regs = mmap(NULL, page_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd,
+                (off_t)_seki_bench_opts.device * SEKI_CTL_DEVICE_PAGES *
+                page_size);
+    if (regs == MAP_FAILED) {
+        seki_bench_error(name, "mmap", errno);
+        close(fd);
+        return;
+    }
+
+    samples = calloc(count, sizeof(*samples));
+    if (!samples) {
+        seki_bench_error(name, "calloc", ENOMEM);
+        munmap((void *)regs, page_size);
+        close(fd);
+        return;
+    }
+
+    for (unsigned int i = 0; i < count; ++i) {
+        uint64_t start = seki_bench_now_ns();
+
+        regs[SEKI_REG_IRQ_STATUS / 4] = 0;
+        (void)regs[SEKI_REG_IRQ_STATUS / 4];
+
+        samples[i] = seki_bench_now_ns() - start;
+    }
+
+    seki_bench_begin_result(name);
+    printf(", \"iterations\": %u", count);
+    seki_bench_latencies(samples, count);
+    seki_bench_end_result();
+
+    free(samples);
+    munmap((void *)regs, page_size);
+    close(fd);
+}
+
+// End to end jobs
+typedef struct SekiBenchWorker {
+    pthread_t       thread;
+    unsigned int    index;
+    unsigned int    depth;
+    pthread_barrier_t *barrier;
+
+    int             err;
+    const char      *what;
+
+    uint64_t        jobs;
+    uint64_t        errors;
+    uint64_t        *latencies;
+    size_t          nr_latencies;
+    size_t          max_latencies;
+} SekiBenchWorker;
+
+static void seki_bench_worker_fail(SekiBenchWorker *worker, const char *what)
+{
+    worker->err = errno ? errno : EIO;
+    worker->what = what;
+}
+
+static int seki_bench_worker_record(SekiBenchWorker *worker,
+                                    uint64_t latency)
+{
+    if (worker->nr_latencies == worker->max_latencies) {
+        size_t max = worker->max_latencies ? 2 * worker->max_latencies
+                                           : 65536;
+        uint64_t *latencies = realloc(worker->latencies,
+                                      max * sizeof(*latencies));
+
+        if (!latencies)
+            return -1;
+
+        worker->latencies = latencies;
+        worker->max_latencies = max;
+    }
+
+    worker->latencies[worker->nr_latencies++] = latency;
+    return 0;
+}
+
+static void seki_bench_worker_loop(SekiBenchWorker *worker, int fd,
+                                   uint8_t *ring, struct seki_ring_params *p,
+                                   uint64_t input_offset,
+                                   uint64_t output_offset)
+{
+    struct seki_ring_header *header = (struct seki_ring_header *)ring;
+    struct seki_job_desc *sqes = (struct seki_job_desc *)(ring + p->sq_offset);
+    struct seki_completion *cqes =
+            (struct seki_completion *)(ring + p->cq_offset);
+    unsigned int length = _seki_bench_opts.job_length;
+    unsigned int depth = worker->depth;
+    uint64_t *submit_ns = calloc(depth, sizeof(*submit_ns));
+    unsigned int *free_slots = calloc(depth, sizeof(*free_slots));
+    unsigned int nr_free = depth;
+    unsigned int inflight = 0;
+    uint32_t sq_tail = 0;
+    uint64_t deadline;
+
+    if (!submit_ns || !free_slots) {
+        errno = ENOMEM;
+        seki_bench_worker_fail(worker, "calloc");
+        // The others are waiting for everyone to be ready
+        pthread_barrier_wait(worker->barrier);
+        goto out;
+    }
+
+    for (unsigned int i = 0; i < depth; ++i)
+        free_slots[i] = i;
+
+    pthread_barrier_wait(worker->barrier);
+    deadline = seki_bench_now_ns() +
+               (uint64_t)(_seki_bench_opts.seconds * 1e9);
+
+    for (;;) {
+        int stopping = seki_bench_now_ns() >= deadline;
+        struct seki_ring_enter enter = { 0 };
+        uint32_t cq_head;
+        uint32_t cq_tail;
+        uint64_t now;
+
+        if (stopping && !inflight)
+            break;
+
+        // Top up to depth jobs in flight, one output slot per job
+        while (!stopping && nr_free) {
+            unsigned int slot = free_slots[--nr_free];
+            struct seki_job_desc *sqe = sqes + (sq_tail & (p->sq_entries - 1));
+
+            memset(sqe, 0, sizeof(*sqe));
+            sqe->user_data     = slot;
+            sqe->input_offset  = input_offset;
+            sqe->output_offset = output_offset + (uint64_t)slot * length;
+            sqe->input_length  = length;
+            sqe->output_length = length;
+            sqe->opcode        = _seki_bench_opts.opcode;
+
+            submit_ns[slot] = seki_bench_now_ns();
+            ++sq_tail;
+            ++inflight;
+        }
+        __atomic_store_n(&header->sq_tail, sq_tail, __ATOMIC_RELEASE);
+
+        enter.to_submit = sq_tail -
+                          __atomic_load_n(&header->sq_head, __ATOMIC_ACQUIRE);
+        enter.min_complete = 1;
+        if (ioctl(fd, SEKI_IOCTL_RING_ENTER, &enter) && errno != EINTR) {
+            seki_bench_worker_fail(worker, "RING_ENTER");
+            break;
+        }
+
+        cq_head = header->cq_head;
+        cq_tail = __atomic_load_n(&header->cq_tail, __ATOMIC_ACQUIRE);
+        now = seki_bench_now_ns();
+
+        for (; cq_head != cq_tail; ++cq_head) {
+            struct seki_completion *cqe =
+                    cqes + (cq_head & (p->cq_entries - 1));
+            unsigned int slot = cqe->user_data;
+
+            if (slot >= depth)
+                continue;
+
+            if (cqe->status)
+                ++worker->errors;
+            else
+                ++worker->jobs;
+
+            if (seki_bench_worker_record(worker, now - submit_ns[slot])) {
+                errno = ENOMEM;
+                seki_bench_worker_fail(worker, "realloc");
+            }
+
+            free_slots[nr_free++] = slot;
+            --inflight;
+        }
+        __atomic_store_n(&header->cq_head, cq_head, __ATOMIC_RELEASE);
+
+        if (worker->err)
+            break;
+    }
+
+out:
+    free(submit_ns);
+    free(free_slots);
+}
+
+static void *seki_bench_worker(void *data)
+{
+    SekiBenchWorker *worker = data;
+    unsigned int length = _seki_bench_opts.job_length;
+    struct seki_ring_params params = {
+        .sq_entries = worker->depth,
+    };
+    struct seki_alloc_request input = {
+        .window = SEKI_WINDOW_INPUT,
+        .size   = length,
+    };
+    struct seki_alloc_request output = {
+        .window = SEKI_WINDOW_OUTPUT,
+        .size   = (uint64_t)length * worker->depth,
+    };
+    uint8_t *ring = MAP_FAILED;
+    long nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    cpu_set_t cpus;
+    int fd;
+
+    // One worker per CPU, so each submits to the queue of its CPU
+    CPU_ZERO(&cpus);
+    CPU_SET(worker->index % (nr_cpus > 0 ? nr_cpus : 1), &cpus);
+    pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+
+    fd = seki_bench_open_device();
+    if (fd < 0) {
+        seki_bench_worker_fail(worker, "open");
+        goto out_barrier;
+    }
+
+    if (ioctl(fd, SEKI_IOCTL_ALLOC, &input) ||
+        ioctl(fd, SEKI_IOCTL_ALLOC, &output)) {
+        seki_bench_worker_fail(worker, "ALLOC");
+        goto out_close;
+    }
+
+    if (ioctl(fd, SEKI_IOCTL_RING_SETUP, &params)) {
+        seki_bench_worker_fail(worker, "RING_SETUP");
+        goto out_close;
+    }
+
+    ring = mmap(NULL, params.ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                fd, SEKI_MMAP_RING_OFFSET);
+    if (ring == MAP_FAILED) {
+        seki_bench_worker_fail(worker, "mmap ring");
+        goto out_close;
+    }
+
+    seki_bench_worker_loop(worker, fd, ring, &params, input.offset,
+                           output.offset);
+
+    munmap(ring, params.ring_size);
+    close(fd);
+    return 0;
+
+out_close:
+    close(fd);
+out_barrier:
+    // The others are waiting for everyone to be ready
+    pthread_barrier_wait(worker->barrier);
+    return 0;
+}
+
+static void seki_bench_jobs_run(unsigned int nr_threads, unsigned int depth)
+{
+    const char *name = "jobs";
+    SekiBenchWorker *workers = calloc(nr_threads, sizeof(*workers));
+    pthread_barrier_t barrier;
+    uint64_t *latencies = 0;
+    size_t nr_latencies = 0;
+    uint64_t jobs = 0;
+    uint64_t errors = 0;
+    uint64_t start;
+    uint64_t elapsed;
+    int err = 0;
+    const char *what = 0;
+
+    if (!workers) {
+        seki_bench_error(name, "calloc", ENOMEM);
+        return;
+    }
+
+    fprintf(stderr, "jobs: %u threads, depth %u\n", nr_threads, depth);
+
+    // The workers and us
+    pthread_barrier_init(&barrier, NULL, nr_threads + 1);
+
+    for (unsigned int i = 0; i < nr_threads; ++i) {
+        workers[i].index = i;
+        workers[i].depth = depth;
+        workers[i].barrier = &barrier;
+        pthread_create(&workers[i].thread, NULL, seki_bench_worker,
+                       workers + i);
+    }
+
+    pthread_barrier_wait(&barrier);
+    start = seki_bench_now_ns();
+
+    for (unsigned int i = 0; i < nr_threads; ++i) {
+        pthread_join(workers[i].thread, NULL);
+
+        jobs   += workers[i].jobs;
+        errors += workers[i].errors;
+        nr_latencies += workers[i].nr_latencies;
+        if (workers[i].err && !err) {
+            err  = workers[i].err;
+            what = workers[i].what;
+        }
+    }
+    elapsed = seki_bench_now_ns() - start;
+
+    pthread_barrier_destroy(&barrier);
+
+    if (err) {
+        seki_bench_error(name, what, err);
+        goto out;
+    }
+
+    latencies = malloc((nr_latencies ? nr_latencies : 1) *
+                       sizeof(*latencies));
+    if (!latencies) {
+        seki_bench_error(name, "malloc", ENOMEM);
+        goto out;
+    }
+
+    nr_latencies = 0;
+    for (unsigned int i = 0; i < nr_threads; ++i) {
+        memcpy(latencies + nr_latencies, workers[i].latencies,
+               workers[i].nr_latencies * sizeof(*latencies));
+        nr_latencies += workers[i].nr_latencies;
+    }
+
+    seki_bench_begin_result(name);
+    printf(", \"threads\": %u, \"depth\": %u, \"job_bytes\": %u, "
+           "\"opcode\": %u, \"seconds\": %.3f, \"jobs\": %llu, "
+           "\"errors\": %llu, \"jobs_per_sec\": %.1f, \"mbps\": %.1f",
+           nr_threads, depth, _seki_bench_opts.job_length,
+           _seki_bench_opts.opcode, elapsed / 1e9,
+           (unsigned long long)jobs, (unsigned long long)errors,
+           jobs * 1e9 / elapsed,
+           (double)jobs * _seki_bench_opts.job_length * 1000.0 / elapsed);
+    seki_bench_latencies(latencies, nr_latencies);
+    seki_bench_end_result();
+
+    if (errors)
+        _seki_bench_failed = 1;
+
+out:
+    for (unsigned int i = 0; i < nr_threads; ++i)
+        free(workers[i].latencies);
+    free(workers);
+    free(latencies);
+}
+
+static void seki_bench_jobs(void)
+{
+    for (unsigned int t = 0; t < _seki_bench_opts.nr_threads; ++t)
+        for (unsigned int d = 0; d < _seki_bench_opts.nr_depths; ++d)
+            seki_bench_jobs_run(_seki_bench_opts.threads[t],
+                                _seki_bench_opts.depths[d]);
+}
+
+// Command line
+static unsigned int seki_bench_parse_list(const char *arg,
+                                          unsigned int *list)
+{
+    unsigned int count = 0;
+    char *end;
+
+    while (*arg && count < SEKI_BENCH_MAX_LIST) {
+        unsigned long value = strtoul(arg, &end, 0);
+
+        if (end == arg || !value)
+            return 0;
+
+        list[count++] = value;
+        arg = *end == ',' ? end + 1 : end;
+    }
+
+    return count;
+}
+
+static void seki_bench_usage(const char *argv0)
+{
+    fprintf(stderr,
+            "Usage: %s [options]\n"
+            "  -d N        Device number, /dev/sekiN (0)\n"
+            "  -b LIST     Benchmarks to run (%s)\n"
+            "  -s KB       Bytes of window the MMIO benchmarks touch (1024)\n"
+            "  -r N        Passes over the window per MMIO benchmark (16)\n"
+            "  -n N        Doorbell round trips (100000)\n"
+            "  -t LIST     Thread counts of the jobs benchmark (1,2,4)\n"
+            "  -q LIST     Jobs in flight per thread (1,8,32)\n"
+            "  -l BYTES    Input and output length of each job (4096)\n"
+            "  -o OPCODE   Job opcode (%u, SEKI_EMU_OP_COPY)\n"
+            "  -T SECONDS  Duration of each jobs run (2)\n",
+            argv0, _seki_bench_opts.benchmarks, SEKI_EMU_OP_COPY);
+}
+
+int main(int argc, char **argv)
+{
+    SekiBenchOptions *opts = &_seki_bench_opts;
+    int c;
+
+    while ((c = getopt(argc, argv, "d:b:s:r:n:t:q:l:o:T:h")) != -1) {
+        switch (c) {
+        case 'd':
+            opts->device = strtoul(optarg, NULL, 0);
+            break;
+        case 'b':
+            opts->benchmarks = optarg;
+            break;
+        case 's':
+            opts->window_size = strtoul(optarg, NULL, 0) << 10;
+            break;
+        case 'r':
+            opts->repeat = strtoul(optarg, NULL, 0);
+            break;
+        case 'n':
+            opts->doorbells = strtoul(optarg, NULL, 0);
+            break;
+        case 't':
+            opts->nr_threads = seki_bench_parse_list(optarg, opts->threads);
+            break;
+        case 'q':
+            opts->nr_depths = seki_bench_parse_list(optarg, opts->depths);
+            break;
+        case 'l':
+            opts->job_length = strtoul(optarg, NULL, 0);
+            break;
+        case 'o':
+            opts->opcode = strtoul(optarg, NULL, 0);
+            break;
+        case 'T':
+            opts->seconds = strtod(optarg, NULL);
+            break;
+        default:
+            seki_bench_usage(argv[0]);
+            return 2;
+        }
+    }
+
+    if (!opts->window_size || !opts->repeat || !opts->doorbells ||
+        !opts->nr_threads || !opts->nr_depths || !opts->job_length ||
+        opts->seconds <= 0) {
+        seki_bench_usage(argv[0]);
+        return 2;
+    }
+
+    printf("{\n  \"device\": %u,\n  \"results\": [", opts->device);
+
+    if (seki_bench_enabled("store_wc"))
+        seki_bench_mmio("store_wc", SEKI_WINDOW_INPUT, 1);
+    if (seki_bench_enabled("store_uc"))
+        seki_bench_mmio("store_uc", SEKI_WINDOW_OUTPUT, 1);
+    if (seki_bench_enabled("load"))
+        seki_bench_mmio("load", SEKI_WINDOW_OUTPUT, 0);
+    if (seki_bench_enabled("pwrite"))
+        seki_bench_rw("pwrite", SEKI_WINDOW_INPUT);
+    if (seki_bench_enabled("pread"))
+        seki_bench_rw("pread", SEKI_WINDOW_OUTPUT);
+    if (seki_bench_enabled("doorbell"))
+        seki_bench_doorbell();
+    if (seki_bench_enabled("jobs"))
+        seki_bench_jobs();
+
+    printf("\n  ]\n}\n");
+
+    return _seki_bench_failed;
+}